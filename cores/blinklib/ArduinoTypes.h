@@ -17,6 +17,10 @@
     typedef uint8_t byte;
     typedef unsigned int word;
 
-    typedef uint32_t ulong;
+    // glibc already has an `ulong` in <sys/types.h>, so host builds (see the `sim` folder) use that one
+
+    #ifndef BLINKLIB_HOST
+        typedef uint32_t ulong;
+    #endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+/*
+
+    Lets you say once how the bits of a face value are split up into fields, and then get and set each field
+    by name instead of writing the shifts and masks by hand in every game.
+
+    The widths are listed lowest bits first. For example, WHAM packs a 3 bit go/strike signal above a 1 bit flag,
+    a 2 bit game state above that...
+
+        #include "FaceValueLayout.h"
+
+        typedef FaceValueLayout< 1 , 3 , 2 > WhamValue;
+
+        typedef WhamValue::Field<0> Flag;
+        typedef WhamValue::Field<1> GoStrikeSignal;
+        typedef WhamValue::Field<2> GameState;
+
+        // Reading a neighbor
+
+        if ( GameState::get( getLastValueReceivedOnFace( f ) ) == GAME ) { ... }
+
+        // Building a value out of constants. A constant that does not fit in its field will not compile.
+
+        setValueSentOnAllFaces( GameState::value<GAME>() | GoStrikeSignal::value<GO>() );
+
+        // Changing just one field of a value (anything too big for the field is cut down to fit)
+
+        myValue = GoStrikeSignal::set( myValue , strikes );
+
+        // Faces where the neighbor's game state changed since last time through loop() (needs IR_FACE_EVENTS)
+
+        FOREACH_FACE_IN( f , GameState::changedFaces() ) { ... }
+
+    Everything is constexpr, so it compiles down to the same shifts and masks you would have written yourself.
+    If the fields add up to more bits than a face value has, it will not compile. That is 6 bits, or 12 if
+    blinklib is compiled with IR_WIDE_VALUES (then use the wide functions to send and get the value).
+
+*/
+
+#ifndef FaceValueLayout_h
+
+    #define FaceValueLayout_h
+
+    #include "blinklib.h"
+
+    #ifdef IR_WIDE_VALUES
+        #define FACE_VALUE_LAYOUT_MAX_BITS 12
+    #else
+        #define FACE_VALUE_LAYOUT_MAX_BITS 6
+    #endif
+
+    // One field that is WIDTH bits wide, starting SHIFT bits up from the bottom of the value
+
+    template< byte SHIFT , byte WIDTH >
+    struct FaceValueField {
+
+        static_assert( WIDTH > 0 , "A face value field needs at least 1 bit" );
+
+        static constexpr byte shift = SHIFT;
+        static constexpr byte width = WIDTH;
+
+        static constexpr word max  = ( 1 << WIDTH ) - 1;        // Biggest number that fits in the field
+        static constexpr word mask = max << SHIFT;              // Where the field sits in the value
+
+        // This field out of a whole value
+
+        static constexpr word get( word value ) {
+            return ( value >> SHIFT ) & max;
+        }
+
+        // The whole value with this field changed to x
+
+        static constexpr word set( word value , word x ) {
+            return ( value & ~mask ) | ( ( x & max ) << SHIFT );
+        }
+
+        // A constant X moved into place, to OR together with the other fields
+
+        template< word X >
+        static constexpr word value() {
+            static_assert( X <= max , "Constant is too big for this face value field" );
+            return X << SHIFT;
+        }
+
+        // True if this field is different in a and b
+
+        static constexpr bool changed( word a , word b ) {
+            return ( ( a ^ b ) & mask ) != 0;
+        }
+
+        #ifdef IR_FACE_EVENTS
+
+            // Faces where this field of the neighbor's value changed since last time through loop()
+
+            static byte changedFaces() {
+                return getFaceEventsChangedIn( mask );
+            }
+
+        #endif
+
+    };
+
+    // Adds up the widths
+
+    template< byte... WIDTHS >
+    struct FaceValueLayoutBits;
+
+    template<>
+    struct FaceValueLayoutBits<> {
+        static constexpr byte total = 0;
+    };
+
+    template< byte WIDTH , byte... REST >
+    struct FaceValueLayoutBits< WIDTH , REST... > {
+        static constexpr byte total = WIDTH + FaceValueLayoutBits< REST... >::total;
+    };
+
+    // Finds where field N starts and how wide it is
+
+    template< byte N , byte... WIDTHS >
+    struct FaceValueLayoutPlace;
+
+    template< byte WIDTH , byte... REST >
+    struct FaceValueLayoutPlace< 0 , WIDTH , REST... > {
+        static constexpr byte shift = 0;
+        static constexpr byte width = WIDTH;
+    };
+
+    template< byte N , byte WIDTH , byte... REST >
+    struct FaceValueLayoutPlace< N , WIDTH , REST... > {
+        static constexpr byte shift = WIDTH + FaceValueLayoutPlace< N - 1 , REST... >::shift;
+        static constexpr byte width = FaceValueLayoutPlace< N - 1 , REST... >::width;
+    };
+
+    template< byte... WIDTHS >
+    struct FaceValueLayout {
+
+        static constexpr byte fields = sizeof...( WIDTHS );
+        static constexpr byte bits   = FaceValueLayoutBits< WIDTHS... >::total;
+
+        static_assert( bits <= FACE_VALUE_LAYOUT_MAX_BITS , "These fields do not fit in a face value" );
+
+        template< byte N >
+        using Field = FaceValueField< FaceValueLayoutPlace< N , WIDTHS... >::shift , FaceValueLayoutPlace< N , WIDTHS... >::width >;
+
+    };
+
+#endif
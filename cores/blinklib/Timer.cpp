@@ -5,7 +5,7 @@
 // The timer should capture millis() in a closure, but no good way to
 // do that in C++ that is not verbose and inefficient, so here we are.
 
-#define NEVER (ULONG_MAX)
+#define NEVER ( (uint32_t) ULONG_MAX )     // ULONG_MAX is 64 bits on a host build (see `sim`)
 
 // All Timers come into this world pre-expired, so their expireTime is 0
 // Here we leave the constructor empty and depend in the BBS section clearing
@@ -58,3 +58,37 @@ void Timer::never(void) {
     m_expireTime=NEVER;
 }
 
+
+#ifdef IR_TIME_SYNC
+
+// Same as above but on cluster time
+
+bool ClusterTimer::isExpired() {
+    return clusterMillis() > m_expireTime;
+}
+
+void ClusterTimer::set( uint32_t ms ) {
+    m_expireTime= clusterMillis()+ms;
+}
+
+void ClusterTimer::setAt( uint32_t clusterTime ) {
+    m_expireTime= clusterTime;
+}
+
+uint32_t ClusterTimer::getRemaining() {
+
+    uint32_t c = clusterMillis();
+
+    if( c >= m_expireTime) {
+        return 0;
+    }
+
+    return m_expireTime - c;
+
+}
+
+void ClusterTimer::never(void) {
+    m_expireTime=NEVER;
+}
+
+#endif
@@ -46,6 +46,18 @@
 
 #include "shared/blinkbios_shared_functions.h"     // Gets us ir_send_packet()
 
+// On a real tile the BlinkBIOS ISRs update the shared blocks in the background while we busy-wait.
+// A host build (see the `sim` folder) has no background, so we have to explicitly give the simulated BIOS
+// a chance to run inside any loop that waits for the BIOS to change something.
+// Compiles to nothing on the real hardware.
+
+#ifdef BLINKLIB_HOST
+    extern "C" void blinkbios_sim_spin(void);
+    #define BLINKBIOS_SPIN() blinkbios_sim_spin()
+#else
+    #define BLINKBIOS_SPIN()
+#endif
+
 
 #define TX_PROBE_TIME_MS           150     // How often to do a blind send when no RX has happened recently to trigger ping pong
                                            // Nice to have probe time shorter than expire time so you have to miss 2 messages
@@ -53,6 +65,37 @@
 
 #define RX_EXPIRE_TIME_MS         200      // If we do not see a message in this long, then show that face as expired
 
+// #define IR_LISTEN_BEFORE_TALK to have TX_IRFaces() hold off on a face while bits are coming in on it, and then wait a
+// random little while before trying again so two tiles that keep stepping on each other get out of sync. Without it we just
+// try again next time through, and the BIOS refuses the send if something is coming in.
+
+#ifdef IR_LISTEN_BEFORE_TALK
+    #define TX_BACKOFF_MAX_EXP      5      // Longest random wait after stepping on the other side is (2^TX_BACKOFF_MAX_EXP)-1 ms
+#endif
+
+// #define IR_PROBE_BACKOFF_MAX_MS to have faces with nobody there probe less often, which saves IR LED power
+// and time in TX_IRFaces() on the faces that have nobody there. Once a face has been expired for
+// PROBE_BACKOFF_AFTER_MS, each blind probe doubles the time until the next one, up to IR_PROBE_BACKOFF_MAX_MS
+// (which has to fit in a word).
+// Anything received on the face, a new neighbor showing up on a face next to it, or a button press (ours or
+// viral) snaps it right back to probing every TX_PROBE_TIME_MS.
+// Worst case, two backed off tiles pushed together notice each other within IR_PROBE_BACKOFF_MAX_MS + FACE_COUNT ms.
+// If only one of them is backed off, the other one's probes still find it within TX_PROBE_TIME_MS + FACE_COUNT ms.
+
+#ifdef IR_PROBE_BACKOFF_MAX_MS
+
+    #if IR_PROBE_BACKOFF_MAX_MS > 65535
+        #error IR_PROBE_BACKOFF_MAX_MS must fit in a word
+    #endif
+
+    #if IR_PROBE_BACKOFF_MAX_MS < TX_PROBE_TIME_MS
+        #error IR_PROBE_BACKOFF_MAX_MS can not be less than TX_PROBE_TIME_MS, we never probe faster than that
+    #endif
+
+    #define PROBE_BACKOFF_AFTER_MS    1000
+
+#endif
+
 #define VIRAL_BUTTON_PRESS_LOCKOUT_MS   2000    // Any viral button presses received from IR within this time period are ignored 
                                                 // since insures that a single press can not circulate around indefinitely.                                                
 
@@ -79,6 +122,132 @@
 
 #define NOP_SPECIAL_VALUE   0b00110011
 
+// This is the header value for a reliable datagram. The payload is preceded by a sequence number byte and
+// an ACK byte (0 if no ACK). The receiver ACKs each one it accepts so the sender can stop resending it.
+// See sendReliableDatagramOnFace().
+
+#define RELIABLE_DATAGRAM_SPECIAL_VALUE     0b00101101
+
+// An ACK is a byte with the top two bits 10 and the sequence number being ACKed in the bottom 6 bits.
+// It rides along as the second byte of a face value packet or in the ACK byte of a reliable datagram.
+// Nothing else ever sends a 2 byte packet with the top bit of the second byte set, so we can tell.
+
+#define ACK_FLAG                    0b10000000
+#define ACK_MASK                    0b11000000
+#define ACK_SEQ_MASK                0b00111111
+
+#define IS_ACK( b )                 ( ( (b) & ACK_MASK ) == ACK_FLAG )
+
+// The second byte of a face value packet (an ACK, link info, or the high bits of a wide value) has no parity of its own,
+// so the parity bit in the header byte covers it too. That way one flipped bit can not turn one kind into another.
+// The one flip parity can not catch is one that clears the top bits of the second byte, since the warm sleep and NOP
+// packets (which have no parity) look like that. So in a face value packet, the sequence number in an ACK goes out
+// XORed with the value bits flipped over. It would take sequence number 63 to land on one of those, and we never use it.
+
+#define ACK_SEQ_LIMIT               63      // Sequence numbers go 0 to ACK_SEQ_LIMIT-1
+
+#define ACK_ON_VALUE( ack , value ) ( ACK_FLAG | ( ( (ack) ^ ~(value) ) & ACK_SEQ_MASK ) )
+
+// A second byte with the top two bits 11 is link info instead. Right now that is just which of our faces it went out of,
+// so the neighbor can tell which of its faces is touching which of ours (see getNeighborFaceOnFace()). We tack it onto a face
+// value when there is no ACK to send, for the first one after a new neighbor shows up and then every LINK_INFO_EVERY after that.
+// Only sent and kept when IR_NEIGHBOR_FACES is defined. Without it we still take the face value off any that come in.
+
+#define LINK_INFO_FLAG              0b11000000
+#define LINK_INFO_FACE_MASK         0b00000111
+
+#define IS_LINK_INFO( b )           ( ( (b) & ACK_MASK ) == LINK_INFO_FLAG )
+
+#define LINK_INFO_EVERY             16
+
+// With IR_WIDE_VALUES, a second byte with the top two bits 01 has the high 6 bits of a 12 bit face value (the header
+// byte has the low 6 like always). Nothing else sends a 2 byte packet like that - the warm sleep and NOP packets have 00
+// there, and every datagram has at least one payload byte and a checksum after its header byte - so we can tell.
+// We only send the second byte when the high bits are not 0, so games that stay under IR_DATA_VALUE_MAX pay nothing.
+// The high bits go out XORed with the low bits. That way a wide value can never be one flipped bit away from a warm
+// sleep or NOP packet (that would take high bits of 0, which we send as a normal value).
+
+#define WIDE_VALUE_FLAG             0b01000000
+#define WIDE_VALUE_MASK             0b00111111
+#define WIDE_VALUE_SHIFT            6
+
+#define IS_WIDE_VALUE( b )          ( ( (b) & ACK_MASK ) == WIDE_VALUE_FLAG )
+
+#ifdef IR_WIDE_VALUES
+    typedef uint16_t face_value_t;
+#else
+    typedef uint8_t face_value_t;
+#endif
+
+// How long after a face expires before we forget the last reliable sequence number we got on it.
+// Must be longer than a sender could keep resending one datagram when it gets no answers at all
+// (one try every probe time), otherwise a late resend could get delivered twice.
+
+#ifdef IR_RELIABLE
+    #define RELIABLE_FORGET_MS      ( IR_RELIABLE_DATAGRAM_TRIES * ( TX_PROBE_TIME_MS + FACE_COUNT ) )
+#endif
+
+// This is the header value for a fragment of a transfer (see sendTransferOnFace()). It is sent just like a reliable
+// datagram, with the total length and the offset of this fragment (both little endian words) in front of the data.
+// Fragments use the whole BIOS packet buffer, so take out the header, seq, ack, length, offset, and checksum bytes.
+
+#define TRANSFER_SPECIAL_VALUE      0b00101110
+
+#define TRANSFER_FRAGMENT_LEN       ( IR_RX_PACKET_SIZE - 8 )
+
+// This is the header value for a broadcast (see sendBroadcast()). In front of the payload are the origin tag (4 bytes, the whole
+// serial number folded down so two tiles are very unlikely to share one), the origin's sequence number, the TTL, how many
+// hops it has taken including this one, and its age in ms (word).
+// Checksum at the end like a datagram.
+
+#define BROADCAST_SPECIAL_VALUE     0b00101011
+
+#define BROADCAST_HEADER_LEN        9
+
+#define BROADCAST_SEEN_COUNT        8       // How many recent broadcasts we remember so we only forward each one once
+
+// This is the header value for a time sync packet (see clusterMillis()). After it comes the sender's cluster time (4 bytes),
+// the low word of the sender's millis for us to echo back, the low word of our millis they are echoing, and how
+// many ms they held that before sending this (0xffff if they have nothing to echo). All little endian. Then the checksum.
+
+#define TIME_SYNC_SPECIAL_VALUE     0b00101100
+
+#define TIME_SYNC_BODY_LEN          10
+
+#define TIME_SYNC_PERIOD_MS         100     // How often we send one on each face that has a neighbor
+#define TIME_SYNC_NO_ECHO           0xffff
+#define TIME_SYNC_QUICK_MS          20      // An echo held less than this is a quick answer, so good for measuring the round trip.
+                                            // Anything slower we answer right away so they get a quick one back.
+#define TIME_SYNC_FLIGHT_UNKNOWN    0xff
+#define TIME_SYNC_DEADBAND_MS       1       // Only move our clock if they are more than this far ahead. Keeps little errors from ratcheting everyone forward.
+
+// This is the header value for a tree beacon (see setTreeRoot()). After it comes the serial number of the root the sender
+// is following, the root's sequence number, the sender's level (depth+1, or 0 if it has no root), TREE_FLAG_* plus the
+// query op, the query round, and the sender's subtree result for that round (4 bytes little endian). Then the checksum.
+
+#define TREE_SPECIAL_VALUE          0b00101111
+
+#define TREE_BODY_LEN               ( SERIAL_NUMBER_LEN + 8 )
+
+#define TREE_FLAG_PARENT            0b00000001      // You are my parent
+#define TREE_FLAG_REPORTED          0b00000010      // The result is in for my whole subtree for this round
+#define TREE_FLAG_WAITING           0b00000100      // I am still waiting for your result for this round
+#define TREE_OP_SHIFT               3
+
+#define TREE_SEQ_PERIOD_MS          1000    // How often the root bumps its sequence number, which sends a wave of beacons down the tree
+#define TREE_ROOT_TIMEOUT_MS        3500    // Give up on the root if its sequence number has not gone up for this long
+#define TREE_SEQ_SLACK              3       // A neighbor can be this many sequence numbers behind us and still be our parent
+#define TREE_RETRY_MS               100     // How often to poke a child that has not answered a query
+#define TREE_FACE_GRACE_MS          500     // How long a face can be expired before we take it out of the tree. A couple of lost
+                                            // packets in a row expire a face, and every time that moves a parent or child mid-query
+                                            // the answer comes out wrong.
+
+#define LEADER_SETTLE_MS            ( 2 * TREE_SEQ_PERIOD_MS )     // With IR_LEADER, same leader for this long and we call it settled
+
+// Stored in the top bit of outDatagramLen to mark a queued datagram as reliable
+
+#define DATAGRAM_RELIABLE_FLAG      0b10000000
+
 
 // We use bit 6 in the IR data to indicate that a button has been pressed so we should 
 // postpone sleeping. This spreads a button press to all connected tiles so 
@@ -159,25 +328,150 @@ static uint8_t irValueDecodePostponeSleepFlag( uint8_t d ) {
     #error IR_DATAGRAM_LEN must not be bigger than IR_RX_PACKET_SIZE
 #endif
 
+// Queued outgoing datagrams are stored right where they sit in the packet, so we can hand the slot
+// straight to the BIOS without copying it anywhere. In front of the payload there is room for the
+// header byte, sequence number, and ACK of a reliable datagram. A plain datagram only uses the last of
+// those for its header byte, so without IR_RELIABLE that is all the room there is. The byte after the payload is for the checksum.
+
+#ifdef IR_RELIABLE
+    #define OUT_DATAGRAM_HEADROOM 3
+#else
+    #define OUT_DATAGRAM_HEADROOM 1
+#endif
+
 // All semantics chosen to have sane startup 0 so we can
 // keep this in bss section and have it zeroed out at startup. 
 
 struct face_t {
 
-    uint8_t inValue;        // Last received value on this face, or 0 if no neighbor ever seen since startup
-    uint8_t outValue;       // Value we send out on this face
+    face_value_t inValue;   // Last received value on this face, or 0 if no neighbor ever seen since startup
+    face_value_t outValue;  // Value we send out on this face
     millis_t expireTime;    // When this face will be considered to be expired (no neighbor there)
     millis_t sendTime;      // Next time we will transmit on this face (set to 0 every time we get a good message so we ping-pong across the link)
+
+    #ifdef IR_PROBE_BACKOFF_MAX_MS
+        uint16_t probeInterval;     // How long between blind probes right now. 0 means TX_PROBE_TIME_MS.
+    #endif
+
+    #ifdef IR_LISTEN_BEFORE_TALK
+        uint8_t txBackoffExp;   // How many times in a row we could not send on this face, up to TX_BACKOFF_MAX_EXP. Sets the random backoff window.
+    #endif
+
+    uint8_t outValueSkips;  // How many packets in a row we sent on this face that were not face values. See IR_VALUE_MAX_SKIPS.
+
+    #ifdef IR_NEIGHBOR_FACES
+        uint8_t inNeighborFace;     // 1 + the neighbor's face that is touching this one, or 0 if we do not know
+        uint8_t linkInfoCountdown;  // Face values to send before we tack on link info again. 0 means the next one.
+    #endif
+
+    #ifdef IR_TIME_SYNC
+        millis_t syncTime;          // Next time we send a time sync packet on this face
+        millis_t syncEchoAt;        // When we got the last one from the neighbor (so we can tell them how long we held it)
+        uint16_t syncEcho;          // Low word of their millis from the last one, to send back to them
+        uint8_t  syncHaveEcho;      // 1 once we have gotten one
+        uint8_t  syncFlight;        // Shortest time a packet has taken to get from them to us, or TIME_SYNC_FLIGHT_UNKNOWN
+    #endif
+
+    #ifdef IR_TREE
+        uint8_t  treeLevel;         // Their level in our tree from their last beacon, or 0 if they are not in it
+        uint8_t  treeSeq;           // ...and the rest of what they told us
+        uint8_t  treeFlags;
+        uint8_t  treeRound;
+        uint32_t treeResult;
+    #endif
     
-    uint8_t inDatagramLen;  // 0= No datagram waiting to be read
-    uint8_t inDatagramData[IR_DATAGRAM_LEN];
+    // Received datagrams wait in a little ring until they are marked read
+
+    uint8_t inDatagramCount;    // Number of datagrams waiting to be read
+    uint8_t inDatagramHead;     // Slot with the oldest one
+    uint8_t inDatagramDropped;  // Datagrams thrown out because the ring was full since last checked. Sticks at 255.
+    uint8_t inDatagramLen[IR_DATAGRAM_RX_QUEUE_DEPTH];
+
+    #ifdef IR_DATAGRAM_ZERO_COPY
+        const uint8_t *inDatagramData[IR_DATAGRAM_RX_QUEUE_DEPTH];           // Points into the BIOS packet buffer we are holding
+    #else
+        uint8_t inDatagramData[IR_DATAGRAM_RX_QUEUE_DEPTH][IR_DATAGRAM_LEN];
+    #endif
+
+    // Datagrams waiting to go out, oldest first
+
+    uint8_t outDatagramCount;   // Number of datagrams waiting to be sent
+    uint8_t outDatagramHead;    // Slot with the oldest one, which goes out next
+    uint8_t outDatagramLen[IR_DATAGRAM_TX_QUEUE_DEPTH];
+    uint8_t outDatagramData[IR_DATAGRAM_TX_QUEUE_DEPTH][OUT_DATAGRAM_HEADROOM + IR_DATAGRAM_LEN + 1];    // Each one is already laid out as the packet that goes out, see above
+
+    #ifdef IR_RELIABLE
+
+        // Reliable datagram state. All 0 means nothing going on, which is what we want at startup.
+
+        uint8_t outReliableSeq;     // Sequence number of the reliable datagram at the head of the send queue
+        uint8_t outReliableTries;   // How many times we have sent it without getting an ACK
+        uint8_t outReliableFailed;  // Reliable datagrams we gave up on since last checked. Sticks at 255.
+        uint8_t outAck;             // ACK we owe the neighbor, or 0 for none
+        uint8_t inReliableSeq;      // ACK_FLAG | sequence number of the last reliable datagram we accepted, or 0 for none
+
+    #endif
+
+    #ifdef IR_TRANSFERS
 
-    uint8_t outDatagramLen;  // 0= No datagram waiting to be sent
-    uint8_t outDatagramData[IR_DATAGRAM_LEN];
+        const uint8_t *outTransferData;     // What we are sending. Belongs to the caller.
+        uint16_t outTransferLen;
+        uint16_t outTransferSent;           // Bytes the neighbor has ACKed so far
+        uint8_t  outTransferStatus;         // TRANSFER_*
+        uint8_t  outTransferInFlight;       // 1 if a fragment went out and we are waiting for the ACK
+
+        uint8_t *inTransferBuffer;          // Where to put what we receive, or NULL if not receiving. Belongs to the caller.
+        uint16_t inTransferMax;             // Size of inTransferBuffer
+        uint16_t inTransferLen;             // Total length the sender told us, 0 until the first fragment
+        uint16_t inTransferReceived;        // Bytes received so far
+
+    #endif
+
+    #ifdef IR_STATS
+        uint16_t stats[IR_STAT_COUNT];     // Link counters, indexed by IR_STAT_*
+        millis_t statsValueTime;           // When the last face value came in, for IR_STAT_RX_VALUE_GAP_MAX
+    #endif
 };
 
 static face_t faces[FACE_COUNT];
 
+// #define IR_DATAGRAM_ZERO_COPY to leave received datagrams sitting in the BIOS packet buffer instead of copying
+// them into face_t. Saves IR_DATAGRAM_LEN bytes of RAM per face (minus a pointer) and a memcpy per datagram.
+// The catch is that the BIOS can not receive anything else on that face until the datagram is marked read,
+// so the face value is stuck at the last one we got while we are holding it. The face still expires on time
+// if that goes on for longer than RX_EXPIRE_TIME_MS. Mark them read quick!
+
+#if defined( IR_DATAGRAM_ZERO_COPY ) && IR_DATAGRAM_RX_QUEUE_DEPTH != 1
+    #error IR_DATAGRAM_ZERO_COPY only works with IR_DATAGRAM_RX_QUEUE_DEPTH 1 since the BIOS only has one buffer per face
+#endif
+
+// #define IR_STATS to keep the per-face link counters. Otherwise counting compiles to nothing.
+
+#ifdef IR_STATS
+    #define IR_STAT_INC( face , stat )  ((face)->stats[ IR_STAT_##stat ]++)
+#else
+    #define IR_STAT_INC( face , stat )
+#endif
+
+// Put a face back to probing at the normal rate, starting right now
+
+static void resetProbeOnFace( face_t *face ) {
+
+    #ifdef IR_PROBE_BACKOFF_MAX_MS
+
+        if ( face->probeInterval ) {
+            face->probeInterval = 0;
+            face->sendTime = 0;
+        }
+
+    #else
+
+        (void) face;
+
+    #endif
+
+}
+
 uint8_t viralButtonPressSendOnFaceBitflags;   // A 1 here means send the viral button press bit on the next IR packet on this face. Cleared when it gets sent. 
 
 Timer viralButtonPressLockoutTimer;     // Set each time we send a viral button press to avoid sending getting into a circular loop
@@ -185,13 +479,56 @@ Timer viralButtonPressLockoutTimer;     // Set each time we send a viral button
 // Millis snapshot for this pass though loop
 millis_t now;
 
+#ifdef IR_STATS
+
+    // How long since the last face value came in on this face
+
+    static uint16_t statValueGapOnFace( const face_t *face ) {
+
+        millis_t gap = now - face->statsValueTime;
+
+        return gap > UINT16_MAX ? UINT16_MAX : gap;
+
+    }
+
+#endif
+
+// Count a face value coming in, and keep track of the longest we had to wait for one
+
+static void statRxValueOnFace( face_t *face ) {
+
+    #ifdef IR_STATS
+
+        face->stats[ IR_STAT_RX_VALUES ]++;
+
+        uint16_t gap = statValueGapOnFace( face );
+
+        if ( gap > face->stats[ IR_STAT_RX_VALUE_GAP_MAX ] ) {
+            face->stats[ IR_STAT_RX_VALUE_GAP_MAX ] = gap;
+        }
+
+        face->statsValueTime = now;
+
+    #else
+
+        (void) face;
+
+    #endif
+
+}
+
 // Capture time snapshot
 // It is 4 bytes long so we cli() so it can not get updated in the middle of us grabbing it
 
-void updateNow() {
+static millis_t currentMillis() {
     cli();
-    now = blinkbios_millis_block.millis;
+    millis_t m = blinkbios_millis_block.millis;
     sei();
+    return m;
+}
+
+void updateNow() {
+    now = currentMillis();
 }
 
 unsigned long millis() {
@@ -215,28 +552,168 @@ uint8_t computePacketChecksum( volatile const uint8_t *buffer , uint8_t len ) {
 }
 
 
+// Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs"
+// The state must be non-zero
+
+static uint32_t xorshift32( uint32_t x ) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+#if defined( IR_LISTEN_BEFORE_TALK ) || defined( IR_BROADCAST )
+
+    // Squash the serial number down into 32 bits. Never 0, so it works as an xorshift seed.
+
+    static uint32_t serialNumberHash() {
+
+        uint32_t h = 0;
+
+        for( uint8_t n=0; n < SERIAL_NUMBER_LEN ; n++ ) {
+            h = ( h << 5 ) ^ ( h >> 27 ) ^ getSerialNumberByte( n );
+        }
+
+        if ( !h ) {
+            h = 2463534242UL;
+        }
+
+        return h;
+    }
+
+#endif
+
 #if  ( ( IR_LONG_PACKET_MAX_LEN + 3  ) > IR_RX_PACKET_SIZE )
 
     #error There has to be enough room in the blinkos packet buffer to hold the user packet plus 2 header bytes and one checksum byte
 
 #endif
 
+// Slot of the nth oldest entry in a ring. No divide since the AVR does not have one.
+
+static uint8_t ringSlot( uint8_t head , uint8_t n , uint8_t depth ) {
+
+    uint8_t slot = head + n;
+
+    if ( slot >= depth ) {
+        slot -= depth;
+    }
+
+    return slot;
+}
+
+static uint8_t inDatagramSlot( const face_t *f , uint8_t n ) {
+    return ringSlot( f->inDatagramHead , n , IR_DATAGRAM_RX_QUEUE_DEPTH );
+}
+
+static uint8_t outDatagramSlot( const face_t *f , uint8_t n ) {
+    return ringSlot( f->outDatagramHead , n , IR_DATAGRAM_TX_QUEUE_DEPTH );
+}
+
 byte getDatagramLengthOnFace( uint8_t face ) {    
-    return faces[face].inDatagramLen;
+    return peekDatagramLengthOnFace( 0 , face );
 }
 
 boolean isDatagramReadyOnFace( uint8_t face ) {
-    return getDatagramLengthOnFace(face) != 0;
+    return faces[face].inDatagramCount != 0;
 }
 
 const byte *getDatagramOnFace( uint8_t face ) {
-    return faces[face].inDatagramData;
+    return peekDatagramOnFace( 0 , face );
 }
 
 void markDatagramReadOnFace( uint8_t face ) {
-    faces[face].inDatagramLen = 0;
+
+    face_t *f = &faces[face];
+
+    if ( f->inDatagramCount ) {
+        f->inDatagramHead = inDatagramSlot( f , 1 );
+        f->inDatagramCount--;
+
+        #ifdef IR_DATAGRAM_ZERO_COPY
+            // Let the BIOS have its buffer back
+            blinkbios_irdata_block.ir_rx_states[face].packetBufferReady = 0;
+        #endif
+    }
 }    
 
+byte getDatagramCountOnFace( uint8_t face ) {
+    return faces[face].inDatagramCount;
+}
+
+byte peekDatagramLengthOnFace( byte n , uint8_t face ) {
+
+    const face_t *f = &faces[face];
+
+    if ( n >= f->inDatagramCount ) {
+        return 0;
+    }
+
+    return f->inDatagramLen[ inDatagramSlot( f , n ) ];
+}
+
+const byte *peekDatagramOnFace( byte n , uint8_t face ) {
+
+    const face_t *f = &faces[face];
+
+    if ( n >= f->inDatagramCount ) {
+        return NULL;
+    }
+
+    return f->inDatagramData[ inDatagramSlot( f , n ) ];
+}
+
+byte getDatagramOverflowCountOnFace( uint8_t face ) {
+
+    byte dropped = faces[face].inDatagramDropped;
+
+    faces[face].inDatagramDropped = 0;
+
+    return dropped;
+}
+
+word getIRStatOnFace( byte stat , byte face ) {
+
+    #ifdef IR_STATS
+
+        if ( stat >= IR_STAT_COUNT ) {
+            return 0;
+        }
+
+        const face_t *f = &faces[face];
+
+        // The value we are waiting on right now counts too, as long as someone is there to send it
+
+        if ( stat == IR_STAT_RX_VALUE_GAP_MAX && f->expireTime >= now ) {
+
+            uint16_t gap = statValueGapOnFace( f );
+
+            if ( gap > f->stats[stat] ) {
+                return gap;
+            }
+
+        }
+
+        return f->stats[stat];
+
+    #else
+        (void) stat;
+        (void) face;
+        return 0;
+    #endif
+
+}
+
+void clearIRStatsOnFace( byte face ) {
+
+    #ifdef IR_STATS
+        memset( faces[face].stats , 0 , sizeof( faces[face].stats ) );
+    #else
+        (void) face;
+    #endif
+
+}
+
 // Jump to the send packet function all way up in the bootloader
 
 uint8_t blinkbios_irdata_send_packet(  uint8_t face, const uint8_t *data , uint8_t len ) {
@@ -251,465 +728,2192 @@ uint8_t blinkbios_irdata_send_packet(  uint8_t face, const uint8_t *data , uint8
 #define CBI(x,b) (x&=~(1<<b))           // Clear bit
 #define TBI(x,b) (x&(1<<b))             // Test bit
 
-void sendDatagramOnFace( const void *data, byte len , byte face ) {
+boolean canSendDatagramOnFace( byte face ) {
+    return faces[face].outDatagramCount < IR_DATAGRAM_TX_QUEUE_DEPTH;
+}
+
+// Add a datagram to the end of the send queue. `flags` gets stored in the top bit of the length.
+
+static boolean queueDatagramOnFace( const void *data, byte len , byte face , uint8_t flags ) {
 
-    if ( len > IR_DATAGRAM_LEN ) {
+    if ( len == 0 || len > IR_DATAGRAM_LEN ) {
 
-        // Ignore request to send oversized packet
+        // Ignore request to send oversized (or empty) packet
 
-        return;
+        return false;
 
     }
     
     face_t *f = &faces[face];
-    
-    f->outDatagramLen = len;
-    memcpy( f->outDatagramData , data , len ); 
-    
-}
 
+    if ( f->outDatagramCount == IR_DATAGRAM_TX_QUEUE_DEPTH ) {
 
-static void clear_packet_buffers() {
-
-    FOREACH_FACE(f) {
+        // No room. Tell them so they can try again next time around.
 
-        blinkbios_irdata_block.ir_rx_states[f].packetBufferReady = 0;
+        IR_STAT_INC( f , TX_DATAGRAMS_REJECTED );
 
+        return false;
     }
-}
 
-// Set the color and display it immediately
-// for internal use where we do not want the loop buffering
-
-static void setColorNow( Color newColor ) {
+    uint8_t slot = outDatagramSlot( f , f->outDatagramCount );
     
-    setColor( newColor );
-    BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
-        
-}
+    f->outDatagramLen[slot] = len | flags;
+    memcpy( f->outDatagramData[slot] + OUT_DATAGRAM_HEADROOM , data , len ); 
 
+    f->outDatagramCount++;
 
-Color dim( Color color, byte brightness) {
-    return MAKECOLOR_5BIT_RGB(
-        (GET_5BIT_R(color)*brightness)/MAX_BRIGHTNESS,
-        (GET_5BIT_G(color)*brightness)/MAX_BRIGHTNESS,
-        (GET_5BIT_B(color)*brightness)/MAX_BRIGHTNESS
-    );
+    return true;
+    
 }
 
-Color lighten( Color color, byte brightness) {
-    return MAKECOLOR_5BIT_RGB(
-        (GET_5BIT_R(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_R(color)))*brightness)/MAX_BRIGHTNESS )),
-        (GET_5BIT_G(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_G(color)))*brightness)/MAX_BRIGHTNESS )),
-        (GET_5BIT_B(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_B(color)))*brightness)/MAX_BRIGHTNESS ))
-    );
+boolean sendDatagramOnFace( const void *data, byte len , byte face ) {
+    return queueDatagramOnFace( data , len , face , 0 );
 }
 
-// When will we warm sleep due to inactivity
-// reset by a button press or seeing a button press bit on
-// an incoming packet
+#ifdef IR_RELIABLE
 
-Timer warm_sleep_time;
+    boolean sendReliableDatagramOnFace( const void *data, byte len , byte face ) {
+        return queueDatagramOnFace( data , len , face , DATAGRAM_RELIABLE_FLAG );
+    }
 
-void reset_warm_sleep_timer() {
+#endif
 
-    warm_sleep_time.set( WARM_SLEEP_TIMEOUT_MS );
+#ifdef IR_SHARED_DATAGRAMS
 
-}
+    // One datagram going out on a bunch of faces at once (see sendDatagramOnFaces()). It is laid out just like it goes out,
+    // checksum and all, so TX_IRFaces() sends it right from here on each face and then clears that face's bit.
 
-// Remembers if we have woken from either a BIOS sleep or
-// a blinklib forced sleep.
+    static uint8_t sharedDatagramPacket[ 1 + IR_DATAGRAM_LEN + 1 ];    // Header byte, payload, checksum
+    static uint8_t sharedDatagramLen;
+    static uint8_t sharedDatagramFaces;         // Bit for each face it still has to go out on
+    static uint8_t sharedDatagramAhead[FACE_COUNT];     // Datagrams from sendDatagramOnFace() that were already waiting on each face, which go first
 
-uint8_t hasWarmWokenFlag =0;
+    boolean sendDatagramOnFaces( const void *data , byte len , byte faceMask ) {
 
-// We need to save the pixel buffer when we warm sleep so we display our 
-// sleep and wake animations and then restore the original game pixels before restarting the game
+        if ( len == 0 || len > IR_DATAGRAM_LEN || sharedDatagramFaces ) {
+            return false;
+        }
 
-pixelColor_t savedPixelBuffer[PIXEL_COUNT];
+        memcpy( sharedDatagramPacket + 1 , data , len );
+        sharedDatagramPacket[ 1 + len ] = computePacketChecksum( sharedDatagramPacket + 1 , len );
 
-void savePixels() {
-   // Save game pixels
-   
-   FOREACH_FACE(f) {
-       
-       savedPixelBuffer[f] = blinkbios_pixel_block.pixelBuffer[f];
-       
-   }    
-}
+        sharedDatagramLen = len;
 
-void restorePixels() {
-    // Save game pixels
-    
-    FOREACH_FACE(f) {
-        
-        blinkbios_pixel_block.pixelBuffer[f] = savedPixelBuffer[f];
-        
-    }
-}
+        // No point sending it where nobody is there, that would only hold up the next one
 
+        sharedDatagramFaces = 0;
 
-#define SLEEP_ANIMATION_DURATION_MS     300
-#define SLEEP_ANIMATION_MAX_BRIGHTNESS  200
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
 
-// A special warm sleep trigger packet has len 2 and the two bytes are both the special cookie value
-// Because it must be 2 long, this means that the cookie can still be a data value since that value would only have a 1 byte packet
+            if ( TBI( faceMask , f ) && faces[f].expireTime >= now ) {
+                sharedDatagramFaces |= 1 << f;
+                sharedDatagramAhead[f] = faces[f].outDatagramCount;
+            }
+
+        }
+
+        return true;
+
+    }
+
+    boolean sendDatagramOnAllFaces( const void *data , byte len ) {
+        return sendDatagramOnFaces( data , len , IR_FACE_BITMASK );
+    }
+
+    boolean canSendDatagramOnFaces() {
+        return !sharedDatagramFaces;
+    }
+
+#endif
+
+#ifdef IR_RELIABLE
+
+    byte getReliableDatagramFailCountOnFace( byte face ) {
+
+        byte failed = faces[face].outReliableFailed;
+
+        faces[face].outReliableFailed = 0;
+
+        return failed;
+    }
+
+#endif
+
+// Take the datagram at the head of the send queue off
+
+static void popOutDatagram( face_t *face ) {
+
+    face->outDatagramHead = outDatagramSlot( face , 1 );
+    face->outDatagramCount--;
+
+    #ifdef IR_SHARED_DATAGRAMS
+
+        // One less in front of the shared datagram on this face
+
+        uint8_t *ahead = &sharedDatagramAhead[ face - faces ];
+
+        if ( *ahead ) {
+            (*ahead)--;
+        }
+
+    #endif
+
+}
+
+// ACK we owe the neighbor on this face, or 0 for none. Always 0 without IR_RELIABLE, so everything
+// that checks it compiles away.
+
+static inline uint8_t outAckOnFace( const face_t *face ) {
+
+    #ifdef IR_RELIABLE
+        return face->outAck;
+    #else
+        (void) face;
+        return 0;
+    #endif
+
+}
+
+#ifdef IR_RELIABLE
+
+    // Done with the reliable datagram at the head of the send queue, either because it got ACKed or
+    // because we gave up on it. Either way the next one gets a new sequence number.
+
+    static void nextOutReliableSeq( face_t *face ) {
+
+        face->outReliableSeq = ( face->outReliableSeq + 1 ) % ACK_SEQ_LIMIT;
+        face->outReliableTries = 0;
+
+    }
+
+    static void popOutReliableDatagram( face_t *face ) {
+
+        popOutDatagram( face );
+
+        nextOutReliableSeq( face );
+
+    }
+
+#endif
+
+#ifdef IR_TRANSFERS
+
+    boolean sendTransferOnFace( const void *data , uint16_t len , byte face ) {
+
+        face_t *f = &faces[face];
+
+        if ( len == 0 || f->outTransferStatus == TRANSFER_SENDING ) {
+            return false;
+        }
+
+        f->outTransferData = (const uint8_t *) data;
+        f->outTransferLen = len;
+        f->outTransferSent = 0;
+        f->outTransferStatus = TRANSFER_SENDING;
+
+        return true;
+    }
+
+    byte getTransferSendStatusOnFace( byte face ) {
+        return faces[face].outTransferStatus;
+    }
+
+    uint16_t getTransferSentOnFace( byte face ) {
+        return faces[face].outTransferSent;
+    }
+
+    void receiveTransferOnFace( void *buffer , uint16_t maxLen , byte face ) {
+
+        face_t *f = &faces[face];
+
+        f->inTransferBuffer = (uint8_t *) buffer;
+        f->inTransferMax = maxLen;
+        f->inTransferLen = 0;
+        f->inTransferReceived = 0;
+
+    }
+
+    uint16_t getTransferLengthOnFace( byte face ) {
+        return faces[face].inTransferLen;
+    }
+
+    uint16_t getTransferReceivedOnFace( byte face ) {
+        return faces[face].inTransferReceived;
+    }
+
+    boolean isTransferCompleteOnFace( byte face ) {
+        return faces[face].inTransferLen && faces[face].inTransferReceived == faces[face].inTransferLen;
+    }
+
+    // How many bytes go in the next fragment we send
+
+    static uint8_t outFragmentLen( const face_t *face ) {
+
+        uint16_t left = face->outTransferLen - face->outTransferSent;
+
+        return left > TRANSFER_FRAGMENT_LEN ? TRANSFER_FRAGMENT_LEN : left;
+    }
+
+    // Try to put a received fragment into the buffer. They must come in order, so anything else
+    // gets thrown out (and not ACKed). Returns true if we took it.
+
+    static boolean receiveFragment( face_t *face , uint16_t len , uint16_t offset , const uint8_t *data , uint8_t dataLen ) {
+
+        if ( !face->inTransferBuffer || len > face->inTransferMax || offset != face->inTransferReceived || offset + dataLen > len ) {
+            return false;
+        }
+
+        if ( face->inTransferReceived && len != face->inTransferLen ) {
+            return false;       // Somebody else's transfer
+        }
+
+        memcpy( face->inTransferBuffer + offset , data , dataLen );
+
+        face->inTransferLen = len;
+        face->inTransferReceived += dataLen;
+
+        return true;
+
+    }
+
+#endif
+
+#ifdef IR_RELIABLE
+
+    // The neighbor ACKed something. If it is the reliable datagram or transfer fragment we are waiting on, then it is delivered.
+
+    static void processAck( face_t *face , uint8_t ack ) {
+
+        #ifdef IR_TRANSFERS
+
+            if ( face->outTransferInFlight ) {
+
+                if ( ( ack & ACK_SEQ_MASK ) == face->outReliableSeq ) {
+
+                    face->outTransferSent += outFragmentLen( face );
+                    face->outTransferInFlight = 0;
+
+                    if ( face->outTransferSent == face->outTransferLen ) {
+                        face->outTransferStatus = TRANSFER_DONE;
+                    }
+
+                    nextOutReliableSeq( face );
+
+                }
+
+                return;
+            }
+
+        #endif
+
+        if ( face->outDatagramCount && ( face->outDatagramLen[ face->outDatagramHead ] & DATAGRAM_RELIABLE_FLAG ) && ( ack & ACK_SEQ_MASK ) == face->outReliableSeq ) {
+
+            popOutReliableDatagram( face );
+
+        }
+
+    }
+
+#endif
+
+// Try to put a received datagram into the ring. Returns false if it did not fit.
+
+static boolean receiveDatagram( face_t *face , const uint8_t *data , uint8_t len ) {
+
+    if ( face->inDatagramCount < IR_DATAGRAM_RX_QUEUE_DEPTH && !(len > IR_DATAGRAM_LEN) ) {        // Check if room in the ring and datagram not too long
+
+        uint8_t slot = inDatagramSlot( face , face->inDatagramCount );
+
+        face->inDatagramLen[slot] = len;
+
+        #ifdef IR_DATAGRAM_ZERO_COPY
+            face->inDatagramData[slot] = data;           // RX_IRFaces() sees we are holding it and leaves the buffer alone
+        #else
+            memcpy( face->inDatagramData[slot]  , data , len );
+        #endif
+
+        face->inDatagramCount++;
+
+        IR_STAT_INC( face , RX_DATAGRAMS );
+
+        return true;
+
+    }
+
+    if ( face->inDatagramCount == IR_DATAGRAM_RX_QUEUE_DEPTH && face->inDatagramDropped < UINT8_MAX ) {
+        face->inDatagramDropped++;
+    }
+
+    IR_STAT_INC( face , RX_DATAGRAMS_DROPPED );
+
+    return false;
+
+}
+
+#ifdef IR_BROADCAST
+
+    // The broadcast we are sending (or forwarding), laid out just like it goes out so TX_IRFaces() can send
+    // it right from here. One buffer is shared by all faces, and each face clears its bit once it has sent it.
+
+    static uint8_t  broadcastOutPacket[ 1 + BROADCAST_HEADER_LEN + IR_BROADCAST_LEN + 1 ];     // Header byte, header, payload, checksum
+    static uint8_t  broadcastOutLen;            // Payload length
+    static uint8_t  broadcastOutFaces;          // Bit for each face it still has to go out on
+    static millis_t broadcastOutBorn;           // When the origin sent it, on our clock, so now-broadcastOutBorn is its age
+
+    // The last broadcast we got, until it is marked read. 0 length means none.
+
+    static uint8_t  broadcastInData[ IR_BROADCAST_LEN ];
+    static uint8_t  broadcastInLen;
+    static uint8_t  broadcastInFace;
+    static uint8_t  broadcastInHops;
+    static uint16_t broadcastInAge;
+
+    struct broadcast_id_t {
+        uint32_t origin;
+        uint8_t  seq;           // Never 0, so the all 0 startup entries never match anything
+    };
+
+    static broadcast_id_t broadcastSeen[ BROADCAST_SEEN_COUNT ];
+    static uint8_t broadcastSeenNext;           // Oldest entry, which gets replaced next
+    static uint8_t broadcastSeenForwarded;      // Bit for each entry above that we already passed on (or started ourselves)
+
+    #if BROADCAST_SEEN_COUNT > 8
+        #error broadcastSeenForwarded only has room for 8 entries
+    #endif
+
+    static uint8_t broadcastSeq;                // Sequence number of the last broadcast we started
+
+    // Which entry in broadcastSeen has this one, or BROADCAST_SEEN_COUNT if we have not seen it
+
+    static uint8_t findBroadcastSeen( uint32_t origin , uint8_t seq ) {
+
+        for( uint8_t i=0; i < BROADCAST_SEEN_COUNT ; i++ ) {
+
+            if ( broadcastSeen[i].origin == origin && broadcastSeen[i].seq == seq ) {
+                return i;
+            }
+
+        }
+
+        return BROADCAST_SEEN_COUNT;
+    }
+
+    // Remember this one in place of the oldest entry, as not passed on yet. Returns the entry.
+
+    static uint8_t markBroadcastSeen( uint32_t origin , uint8_t seq ) {
+
+        uint8_t i = broadcastSeenNext;
+
+        broadcastSeen[i].origin = origin;
+        broadcastSeen[i].seq = seq;
+
+        CBI( broadcastSeenForwarded , i );
+
+        if ( ++broadcastSeenNext == BROADCAST_SEEN_COUNT ) {
+            broadcastSeenNext = 0;
+        }
+
+        return i;
+
+    }
+
+    // Load up the out buffer to go out on every face that has a neighbor except `skipFace`
+
+    static void queueBroadcast( uint32_t origin , uint8_t seq , uint8_t ttl , uint8_t hops , const uint8_t *data , uint8_t len , millis_t born , uint8_t skipFace ) {
+
+        uint8_t *d = broadcastOutPacket + 1;
+
+        memcpy( d , &origin , sizeof( origin ) );
+        d += sizeof( origin );
+
+        *d++ = seq;
+        *d++ = ttl;
+        *d++ = hops;
+        d += 2;                 // Age gets filled in when it actually goes out on each face
+
+        memcpy( d , data , len );
+
+        broadcastOutLen = len;
+        broadcastOutBorn = born;
+
+        // No point sending it where nobody is there. That would only hold up the next one until the probe time.
+
+        broadcastOutFaces = 0;
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+            if ( f != skipFace && faces[f].expireTime >= now ) {
+                broadcastOutFaces |= 1 << f;
+            }
+
+        }
+
+    }
+
+    boolean sendBroadcast( const void *data , byte len , byte ttl ) {
+
+        if ( len == 0 || len > IR_BROADCAST_LEN || ttl == 0 || broadcastOutFaces ) {
+            return false;
+        }
+
+        if ( !++broadcastSeq ) {
+            broadcastSeq = 1;
+        }
+
+        uint32_t origin = serialNumberHash();
+
+        SBI( broadcastSeenForwarded , markBroadcastSeen( origin , broadcastSeq ) );     // So we do not forward it again when it comes back around
+
+        queueBroadcast( origin , broadcastSeq , ttl , 1 , (const uint8_t *) data , len , now , FACE_COUNT );
+
+        return true;
+
+    }
+
+    boolean canSendBroadcast() {
+        return !broadcastOutFaces;
+    }
+
+    // `body` is everything after the header byte, without the checksum
+
+    static void receiveBroadcast( uint8_t f , const uint8_t *body , uint8_t bodyLen ) {
+
+        uint8_t len = bodyLen - BROADCAST_HEADER_LEN;
+
+        if ( len > IR_BROADCAST_LEN ) {
+            return;
+        }
+
+        uint32_t origin;
+        memcpy( &origin , body , sizeof( origin ) );
+
+        uint8_t seq  = body[4];
+        uint8_t ttl  = body[5];
+        uint8_t hops = body[6];
+        uint16_t age = body[7] | ( body[8] << 8 );
+
+        uint8_t seen = findBroadcastSeen( origin , seq );
+
+        if ( seen == BROADCAST_SEEN_COUNT ) {
+
+            // First time we got this one
+
+            seen = markBroadcastSeen( origin , seq );
+
+            // If they have not read the last one yet, then this one is not for them. We still pass it on.
+
+            if ( !broadcastInLen ) {
+
+                memcpy( broadcastInData , body + BROADCAST_HEADER_LEN , len );
+                broadcastInLen  = len;
+                broadcastInFace = f;
+                broadcastInHops = hops;
+                broadcastInAge  = age;
+
+            }
+
+        }
+
+        // Pass it on to everyone else if it can go further and we have not already. If we are still busy with
+        // the last one then it stays not passed on, so a copy that comes in later from another neighbor still can be.
+
+        if ( hops < ttl && !TBI( broadcastSeenForwarded , seen ) && !broadcastOutFaces ) {
+
+            queueBroadcast( origin , seq , ttl , hops + 1 , body + BROADCAST_HEADER_LEN , len , now - age , f );
+
+            SBI( broadcastSeenForwarded , seen );
+
+        }
+
+    }
+
+    boolean isBroadcastReady() {
+        return broadcastInLen;
+    }
+
+    byte getBroadcastLength() {
+        return broadcastInLen;
+    }
+
+    const byte *getBroadcast() {
+        return broadcastInData;
+    }
+
+    byte getBroadcastFace() {
+        return broadcastInFace;
+    }
+
+    byte getBroadcastHops() {
+        return broadcastInHops;
+    }
+
+    word getBroadcastAge() {
+        return broadcastInAge;
+    }
+
+    word getBroadcastHopLatency() {
+        return broadcastInHops ? broadcastInAge / broadcastInHops : 0;
+    }
+
+    void markBroadcastRead() {
+        broadcastInLen = 0;
+    }
+
+#endif
+
+#ifdef IR_TIME_SYNC
+
+    // Cluster time is our millis plus this. It only ever goes up, so clusterMillis() never goes backwards.
+
+    static millis_t clusterOffset;
+
+    unsigned long clusterMillis() {
+        return now + clusterOffset;
+    }
+
+    // Fill in the body of a time sync packet. This happens right before it goes out, so we use the millis from
+    // right now rather than the one from the start of the pass (the display update in between can take a while).
+
+    static void buildTimeSync( face_t *face , uint8_t *d ) {
+
+        millis_t m = currentMillis();
+        millis_t c = m + clusterOffset;
+
+        *d++ = c & 0xff;
+        *d++ = c >> 8;
+        *d++ = c >> 16;
+        *d++ = c >> 24;
+
+        *d++ = m & 0xff;
+        *d++ = m >> 8;
+
+        uint16_t held = TIME_SYNC_NO_ECHO;
+
+        if ( face->syncHaveEcho && m - face->syncEchoAt < TIME_SYNC_NO_ECHO ) {
+            held = m - face->syncEchoAt;
+        }
+
+        *d++ = face->syncEcho & 0xff;
+        *d++ = face->syncEcho >> 8;
+        *d++ = held & 0xff;
+        *d++ = held >> 8;
+
+    }
+
+    // We follow whoever is furthest ahead, so every tile ends up on the fastest clock in the cluster.
+    // To guess how long the packet took to get here, we take the round trip of the last stamp we sent them, minus
+    // the time they sat on it, and cut it in half.
+    // We have to be careful never to guess too long. That would make us think they are further ahead than they really
+    // are, then they would see us ahead of them, and the whole cluster would keep ratcheting faster and faster. So...
+    // 1. We only measure when they answered quickly, since they time how long they sat on it with their own clock,
+    //    which can be 10% off from ours.
+    // 2. We use the shortest one we have seen. A tile can be stuck sending on its other faces for a long time before it
+    //    gets to a packet, so most packets take a lot longer than that, but none can take less.
+
+    static void receiveTimeSync( face_t *face , const uint8_t *body ) {
+
+        millis_t theirs = body[0] | ( (millis_t) body[1] << 8 ) | ( (millis_t) body[2] << 16 ) | ( (millis_t) body[3] << 24 );
+
+        uint16_t echo = body[6] | ( body[7] << 8 );
+        uint16_t held = body[8] | ( body[9] << 8 );
+
+        if ( held < TIME_SYNC_QUICK_MS ) {
+
+            uint16_t rtt = (uint16_t) now - echo;
+
+            if ( rtt > held && rtt - held < 2 * TIME_SYNC_FLIGHT_UNKNOWN ) {
+
+                uint8_t flight = ( rtt - held - 1 ) / 2;       // Both times are rounded down to the ms, so take off one more to be safe
+
+                if ( flight < face->syncFlight ) {
+                    face->syncFlight = flight;
+                }
+
+            }
+
+        } else {
+
+            face->syncTime = 0;         // Answer on our next turn so they get a good round trip
+
+        }
+
+        if ( face->syncFlight != TIME_SYNC_FLIGHT_UNKNOWN ) {
+            theirs += face->syncFlight;
+        }
+
+        int32_t ahead = (int32_t) ( theirs - ( now + clusterOffset ) );
+
+        if ( ahead > TIME_SYNC_DEADBAND_MS ) {
+            clusterOffset += ahead;
+        }
+
+        face->syncEcho = body[4] | ( body[5] << 8 );
+        face->syncEchoAt = now;
+        face->syncHaveEcho = 1;
+
+    }
+
+#endif
+
+#ifdef IR_TREE
+
+    // Where we are in the tree. Level is depth+1, so 0 means we are not in a tree and 1 means we are the root.
+    // When we give up on a root we remember its serial number and sequence number so the beacons that are still
+    // going around about it do not pull us (or anyone we tell) right back in.
+
+    #ifdef IR_LEADER
+        static uint8_t  treeCandidate = 1;      // Everyone is in the running
+    #else
+        static uint8_t  treeCandidate;          // setTreeRoot()
+    #endif
+
+    static uint8_t  treeLevel;
+    static uint8_t  treeParent;                 // Face toward the root, only if treeLevel > 1
+    static uint8_t  treeRootSerial[ SERIAL_NUMBER_LEN ];
+    static uint8_t  treeSeq;                    // Newest sequence number we have from the root
+    static millis_t treeSeqTime;                // When that went up
+    static millis_t treeRootTime;               // When we started following this root (or became it)
+
+    static uint8_t  treeHaveDead;               // 1 if we gave up on a root
+    static uint8_t  treeDeadSerial[ SERIAL_NUMBER_LEN ];
+    static uint8_t  treeDeadSeq;
+
+    static uint8_t  treeRound;                  // Current query, handed down from the root
+    static uint8_t  treeOp;
+    static uint8_t  treeReported;               // 1 once treeResult has our whole subtree for treeRound
+    static uint32_t treeResult;
+    static word     treeValue;                  // setTreeValue()
+
+    static uint8_t  treeOutFaces;               // Bit for each face that needs to hear our new state
+    static millis_t treeRetryTime;              // Next time we poke children that have not answered
+
+    // Beacons are big (about 20ms on the air) so we only send them when something changes, and some changes only
+    // go to some faces. The wave from the root goes out on every face, which also fixes up anything that got lost.
+
+    static void markTreeChanged() {
+        treeOutFaces = IR_FACE_BITMASK;
+    }
+
+    // Everything the neighbors told us was about some other root
+
+    static void forgetTreeFaces() {
+
+        FOREACH_FACE(f) {
+            faces[f].treeLevel = 0;
+        }
+
+    }
+
+    static void becomeTreeRoot() {
+
+        for( uint8_t n=0; n < SERIAL_NUMBER_LEN ; n++ ) {
+            treeRootSerial[n] = getSerialNumberByte( n );
+        }
+
+        treeLevel = 1;
+        treeSeq++;
+        treeSeqTime = now;
+        treeRootTime = now;
+        treeReported = 0;
+
+        forgetTreeFaces();
+        markTreeChanged();
+
+    }
+
+    // Start out with whoever told us about it as our parent. updateTree() will find a better one if there is one.
+
+    static void followTreeRoot( uint8_t f , const uint8_t *serial , uint8_t seq , uint8_t level ) {
+
+        memcpy( treeRootSerial , serial , SERIAL_NUMBER_LEN );
+
+        if ( treeHaveDead && !memcmp( serial , treeDeadSerial , SERIAL_NUMBER_LEN ) ) {
+            treeHaveDead = 0;                   // It came back
+        }
+
+        treeLevel = level + 1;
+        treeParent = f;
+        treeSeq = seq;
+        treeSeqTime = now;
+        treeRootTime = now;
+        treeReported = 0;
+
+        forgetTreeFaces();
+        markTreeChanged();
+
+    }
+
+    static void dropTreeRoot() {
+
+        memcpy( treeDeadSerial , treeRootSerial , SERIAL_NUMBER_LEN );
+        treeDeadSeq = treeSeq;
+        treeHaveDead = 1;
+
+        treeLevel = 0;
+
+        forgetTreeFaces();
+        markTreeChanged();
+
+    }
+
+    static boolean isOwnSerial( const uint8_t *serial ) {
+
+        for( uint8_t n=0; n < SERIAL_NUMBER_LEN ; n++ ) {
+            if ( serial[n] != getSerialNumberByte( n ) ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static boolean isTreeFaceAlive( const face_t *face ) {
+        return face->expireTime + TREE_FACE_GRACE_MS >= now;
+    }
+
+    static boolean isTreeChild( const face_t *face ) {
+        return isTreeFaceAlive( face ) && face->treeLevel && ( face->treeFlags & TREE_FLAG_PARENT );
+    }
+
+    // True if this child still has not sent us their answer for the current query
+
+    static boolean isTreeChildWaiting( const face_t *face ) {
+        return face->treeRound != treeRound || !( face->treeFlags & TREE_FLAG_REPORTED );
+    }
+
+    static void buildTree( uint8_t f , uint8_t *d ) {
+
+        memcpy( d , treeRootSerial , SERIAL_NUMBER_LEN );
+        d += SERIAL_NUMBER_LEN;
+
+        *d++ = treeSeq;
+        *d++ = treeLevel;
+        uint8_t flags = treeOp << TREE_OP_SHIFT;
+
+        if ( treeLevel > 1 && f == treeParent ) {
+            flags |= TREE_FLAG_PARENT;
+        }
+
+        if ( treeReported ) {
+            flags |= TREE_FLAG_REPORTED;
+        } else if ( isTreeChild( &faces[f] ) && isTreeChildWaiting( &faces[f] ) ) {
+            flags |= TREE_FLAG_WAITING;
+        }
+
+        *d++ = flags;
+        *d++ = treeRound;
+        *d++ = treeResult & 0xff;
+        *d++ = treeResult >> 8;
+        *d++ = treeResult >> 16;
+        *d++ = treeResult >> 24;
+
+    }
+
+    // The root with the lowest serial number wins. We only listen to the root we are following, so anything we keep
+    // in face_t is always about that one.
+
+    static void receiveTree( uint8_t f , const uint8_t *body ) {
+
+        face_t *face = &faces[f];
+
+        const uint8_t *serial = body;
+        uint8_t seq   = body[ SERIAL_NUMBER_LEN ];
+        uint8_t level = body[ SERIAL_NUMBER_LEN + 1 ];
+
+        face->treeLevel = 0;
+
+        if ( !level || level == UINT8_MAX ) {
+
+            // They lost their root (or never had one), so tell them about ours
+
+            if ( treeLevel ) {
+                SBI( treeOutFaces , f );
+            }
+
+            return;
+        }
+
+        if ( !treeLevel && treeCandidate ) {
+            becomeTreeRoot();
+        }
+
+        if ( isOwnSerial( serial ) ) {
+
+            // This is about us. If we are not the root anymore then it is just old news.
+
+            if ( treeLevel != 1 ) {
+                return;
+            }
+
+            // If they have a newer sequence number than we do then we must have restarted, so jump past it
+
+            if ( (int8_t) ( seq - treeSeq ) > 0 ) {
+                treeSeq = seq + 1;
+                treeSeqTime = now;
+                markTreeChanged();
+            }
+
+        } else if ( treeHaveDead && !memcmp( serial , treeDeadSerial , SERIAL_NUMBER_LEN ) && (int8_t) ( seq - treeDeadSeq ) <= 0 ) {
+
+            return;                             // Old news about a root we gave up on
+
+        } else if ( treeLevel ) {
+
+            int c = memcmp( serial , treeRootSerial , SERIAL_NUMBER_LEN );
+
+            if ( c > 0 ) {                      // Worse than ours. They will come over once they hear about ours.
+                SBI( treeOutFaces , f );
+                return;
+            }
+
+            if ( c < 0 ) {
+                followTreeRoot( f , serial , seq , level );
+            }
+
+        } else {
+
+            followTreeRoot( f , serial , seq , level );
+
+        }
+
+        if ( (int8_t) ( seq - treeSeq ) > 0 ) {
+            treeSeq = seq;
+            treeSeqTime = now;
+            markTreeChanged();                  // Pass the new sequence number on down
+        }
+
+        face->treeLevel  = level;
+        face->treeSeq    = seq;
+        face->treeFlags  = body[ SERIAL_NUMBER_LEN + 2 ];
+        face->treeRound  = body[ SERIAL_NUMBER_LEN + 3 ];
+
+        // Our parent never got our answer, so send it again
+
+        if ( treeLevel > 1 && f == treeParent && treeReported && ( face->treeFlags & TREE_FLAG_WAITING ) && face->treeRound == treeRound ) {
+            SBI( treeOutFaces , f );
+        }
+
+        face->treeResult = body[ SERIAL_NUMBER_LEN + 4 ] | ( (uint32_t) body[ SERIAL_NUMBER_LEN + 5 ] << 8 ) | ( (uint32_t) body[ SERIAL_NUMBER_LEN + 6 ] << 16 ) | ( (uint32_t) body[ SERIAL_NUMBER_LEN + 7 ] << 24 );
+
+    }
+
+    static uint32_t combineTree( uint32_t a , uint32_t b ) {
+
+        switch ( treeOp ) {
+            case TREE_MIN: return b < a ? b : a;
+            case TREE_MAX: return b > a ? b : a;
+            default:       return a + b;
+        }
+
+    }
+
+    // Runs after every RX pass. Keeps the root ticking, picks our parent, and adds up our subtree once all
+    // of our children have reported.
+
+    static void updateTree() {
+
+        if ( treeLevel > 1 ) {
+
+            // Our parent is the neighbor closest to the root. A neighbor that is too far behind on sequence numbers
+            // might only think it is close because of old news that went around in a circle, so it does not count.
+            // We give it a few since the beacon that would have caught it up could just have gotten lost.
+            // Ties go to the parent we already have so the tree does not flap.
+
+            uint8_t best = FACE_COUNT;
+            uint8_t bestLevel = 0;
+
+            FOREACH_FACE(f) {
+
+                const face_t *face = &faces[f];
+
+                if ( isTreeFaceAlive( face ) && face->treeLevel && face->treeLevel < UINT8_MAX && !( face->treeFlags & TREE_FLAG_PARENT ) && (uint8_t) ( treeSeq - face->treeSeq ) <= TREE_SEQ_SLACK ) {
+
+                    if ( !bestLevel || face->treeLevel < bestLevel || ( face->treeLevel == bestLevel && f == treeParent ) ) {
+                        best = f;
+                        bestLevel = face->treeLevel;
+                    }
+
+                }
+
+            }
+
+            if ( now - treeSeqTime > TREE_ROOT_TIMEOUT_MS || best == FACE_COUNT ) {
+
+                // The root is gone, or we are cut off from it
+
+                dropTreeRoot();
+
+            } else {
+
+                if ( best != treeParent || bestLevel + 1 != treeLevel ) {
+                    treeParent = best;
+                    treeLevel = bestLevel + 1;
+                    markTreeChanged();
+                }
+
+                const face_t *parent = &faces[ treeParent ];
+                uint8_t parentOp = parent->treeFlags >> TREE_OP_SHIFT;
+
+                if ( parent->treeRound != treeRound || parentOp != treeOp ) {
+                    treeRound = parent->treeRound;
+                    treeOp = parentOp;
+                    treeReported = 0;
+                    treeOutFaces |= IR_FACE_BITMASK & ~( 1 << treeParent );     // Only the ones below us care about a new query
+                }
+
+            }
+
+        }
+
+        if ( !treeLevel ) {
+
+            if ( !treeCandidate ) {
+                return;
+            }
+
+            becomeTreeRoot();
+
+        }
+
+        if ( treeLevel == 1 && now - treeSeqTime >= TREE_SEQ_PERIOD_MS ) {
+            treeSeq++;
+            treeSeqTime = now;
+            markTreeChanged();
+        }
+
+        if ( !treeReported ) {
+
+            uint32_t result = ( treeOp == TREE_COUNT ) ? 1 : treeValue;
+            uint8_t waiting = 0;
+
+            FOREACH_FACE(f) {
+
+                const face_t *face = &faces[f];
+
+                if ( isTreeChild( face ) ) {
+
+                    if ( isTreeChildWaiting( face ) ) {
+                        SBI( waiting , f );
+                    } else {
+                        result = combineTree( result , face->treeResult );
+                    }
+
+                }
+
+            }
+
+            if ( waiting ) {
+
+                // Either they did not get the query or we did not get their answer. Poke them every so often to find out.
+
+                if ( treeRetryTime <= now ) {
+                    treeOutFaces |= waiting;
+                    treeRetryTime = now + TREE_RETRY_MS;
+                }
+
+                return;
+            }
+
+            treeResult = result;
+            treeReported = 1;
+
+            if ( treeLevel > 1 ) {
+                SBI( treeOutFaces , treeParent );      // Only our parent cares about our result
+            }
+
+        }
+
+    }
+
+    void setTreeRoot( boolean root ) {
+
+        treeCandidate = root;
+
+        if ( !root && treeLevel == 1 ) {
+            dropTreeRoot();                     // Everyone else will give up on us once our sequence number stops going up
+        }
+
+    }
+
+    boolean isTreeRoot() {
+        return treeLevel == 1;
+    }
+
+    boolean isInTree() {
+        return treeLevel;
+    }
+
+    byte getTreeRootSerialNumberByte( byte n ) {
+        return treeRootSerial[n];
+    }
+
+    byte getTreeDepth() {
+        return treeLevel ? treeLevel - 1 : TREE_NO_DEPTH;
+    }
+
+    byte getTreeParentFace() {
+        return treeLevel > 1 ? treeParent : FACE_COUNT;
+    }
+
+    boolean isTreeChildOnFace( byte face ) {
+        return treeLevel && isTreeChild( &faces[face] );
+    }
+
+    void setTreeValue( word value ) {
+        treeValue = value;
+    }
+
+    boolean startTreeQuery( byte op ) {
+
+        if ( treeLevel != 1 || op > TREE_MAX ) {
+            return false;
+        }
+
+        treeRound++;
+        treeOp = op;
+        treeReported = 0;
+        markTreeChanged();
+
+        return true;
+
+    }
+
+    boolean isTreeQueryDone() {
+        return treeLevel == 1 && treeReported;
+    }
+
+    unsigned long getTreeQueryResult() {
+        return treeResult;
+    }
+
+    #ifdef IR_LEADER
+
+        // The leader is just the root of the tree when everyone is a candidate
+
+        boolean isLeader() {
+            return treeLevel == 1;
+        }
+
+        boolean isLeaderSettled() {
+            return treeLevel && now - treeRootTime >= LEADER_SETTLE_MS;
+        }
+
+        byte getLeaderSerialNumberByte( byte n ) {
+            return treeRootSerial[n];
+        }
+
+        byte getLeaderFace() {
+            return getTreeParentFace();
+        }
+
+        byte getLeaderDistance() {
+            return getTreeDepth();
+        }
+
+    #endif
+
+#endif
+
+static void clear_packet_buffers() {
+
+    FOREACH_FACE(f) {
+
+        blinkbios_irdata_block.ir_rx_states[f].packetBufferReady = 0;
+
+        #ifdef IR_DATAGRAM_ZERO_COPY
+            faces[f].inDatagramCount = 0;       // Those were in the buffers we just threw out
+        #endif
+
+    }
+}
+
+// Set the color and display it immediately
+// for internal use where we do not want the loop buffering
+
+static void setColorNow( Color newColor ) {
+    
+    setColor( newColor );
+    BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
+        
+}
+
+
+Color dim( Color color, byte brightness) {
+    return MAKECOLOR_5BIT_RGB(
+        (GET_5BIT_R(color)*brightness)/MAX_BRIGHTNESS,
+        (GET_5BIT_G(color)*brightness)/MAX_BRIGHTNESS,
+        (GET_5BIT_B(color)*brightness)/MAX_BRIGHTNESS
+    );
+}
+
+Color lighten( Color color, byte brightness) {
+    return MAKECOLOR_5BIT_RGB(
+        (GET_5BIT_R(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_R(color)))*brightness)/MAX_BRIGHTNESS )),
+        (GET_5BIT_G(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_G(color)))*brightness)/MAX_BRIGHTNESS )),
+        (GET_5BIT_B(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_B(color)))*brightness)/MAX_BRIGHTNESS ))
+    );
+}
+
+// When will we warm sleep due to inactivity
+// reset by a button press or seeing a button press bit on
+// an incoming packet
+
+Timer warm_sleep_time;
+
+void reset_warm_sleep_timer() {
+
+    warm_sleep_time.set( WARM_SLEEP_TIMEOUT_MS );
+
+}
+
+// Remembers if we have woken from either a BIOS sleep or
+// a blinklib forced sleep.
+
+uint8_t hasWarmWokenFlag =0;
+
+// We need to save the pixel buffer when we warm sleep so we display our 
+// sleep and wake animations and then restore the original game pixels before restarting the game
+
+pixelColor_t savedPixelBuffer[PIXEL_COUNT];
+
+void savePixels() {
+   // Save game pixels
+   
+   FOREACH_FACE(f) {
+       
+       savedPixelBuffer[f] = blinkbios_pixel_block.pixelBuffer[f];
+       
+   }    
+}
+
+void restorePixels() {
+    // Save game pixels
+    
+    FOREACH_FACE(f) {
+        
+        blinkbios_pixel_block.pixelBuffer[f] = savedPixelBuffer[f];
+        
+    }
+}
+
+
+#define SLEEP_ANIMATION_DURATION_MS     300
+#define SLEEP_ANIMATION_MAX_BRIGHTNESS  200
+
+// A special warm sleep trigger packet has len 2 and the two bytes are both the special cookie value
+// Because it must be 2 long, this means that the cookie can still be a data value since that value would only have a 1 byte packet
+
+static uint8_t force_sleep_packet[2] = { TRIGGER_WARM_SLEEP_SPECIAL_VALUE , TRIGGER_WARM_SLEEP_SPECIAL_VALUE};
+
+// This packet does nothing except wake up our neighbors
+
+static uint8_t nop_wake_packet[2] = { NOP_SPECIAL_VALUE , NOP_SPECIAL_VALUE};
+
+
+#define SLEEP_PACKET_REPEAT_COUNT 5     // How many times do we send the sleep and wake packets for redunancy?
+
+static void warm_sleep_cycle() {
+    
+    BLINKBIOS_POSTPONE_SLEEP_VECTOR();      // Postpone cold sleep so we can warm sleep for a while
+    // The cold sleep will eventually kick in if we
+    // do not wake from warm sleep in time.
+        
+    // Save the games pixels so we can restore them on waking
+    // we need to do this because the sleep and wake animations
+    // will overwrite whatever is there. 
+            
+    savePixels(); 
+
+
+    // Ok, now we are virally sending FORCE_SLEEP out on all faces to spread the word
+    // and the pixels are off so the user is happy and we are saving power.
+
+    // First send the force sleep packet out to all our neighbors
+    // We are indiscriminate, just splat it 5 times everywhere.
+    // This is a brute force approach to make sure we get though even with collisions
+    // and long packets in flight.
+    
+    // We also show a little animation while transmitting the packets
+    
+    // Figure out how much brightness to animate on each packet
+        
+    const int animation_fade_step = SLEEP_ANIMATION_MAX_BRIGHTNESS / ( SLEEP_PACKET_REPEAT_COUNT * FACE_COUNT );
+    
+    uint8_t fade_brightness;
+    
+    // For the sleep animation we start bright and dim to 0 by the end
+
+    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0    
+    fade_brightness = SLEEP_ANIMATION_MAX_BRIGHTNESS;
+    
+    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+
+        FOREACH_FACE(f) {
+            
+            setColorNow( dim( BLUE, fade_brightness ) );
+            
+            fade_brightness -= animation_fade_step;
+
+            //while ( blinkbios_is_rx_in_progress( f ) );     // Wait to clear to send (no guarantee, but better than just blink sending)
+
+            blinkbios_irdata_send_packet( f , force_sleep_packet , sizeof( force_sleep_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+
+        }
+
+    }
+    
+    // Ensure that we end up completely off 
+    setColorNow( OFF );
+        
+    // We need to save the time now because it will keep ticking while we are in pre-sleep (where were can get
+    // woken back up by a packet). If we did not save it and then restore it later, then all the user timers
+    // would be expired when we woke.
+
+    // Save the time now so we can go back in time when we wake up
+    cli();
+    millis_t save_time = blinkbios_millis_block.millis;
+    sei();
+
+    // OK we now appear asleep
+    // We are not sending IR so some power savings
+    // For the next 2 hours will will wait for a wake up signal
+    // TODO: Make this even more power efficient by sleeping between checks for incoming IR.
+
+    blinkbios_button_block.bitflags=0;
+
+    // Here is wuld be nice to idle the CPU for a bit of power savings, but there is a potential
+    // race where the BIOS could put us into deep sleep mode and then our idle would be deep sleep.
+    // you'd think we could turn of ints and set out mode right before entering idle, but
+    // we needs ints on to wake form idle on AVR.
+
+    clear_packet_buffers();     // Clear out any left over packets that were there when we started this sleep cycle and might trigger us to wake unapropriately
+
+    uint8_t saw_packet_flag =0;
+
+    // Wait in idle mode until we either see a non-force-sleep packet or a button press or woke.
+    // Why woke? Because eventually the BIOS will make us powerdown sleep inside this loop
+    // When that happens, it will take a button press to wake us
+
+    blinkbios_button_block.wokeFlag = 1;    // // Set to 0 upon waking from sleep
+
+    while (!saw_packet_flag && !(blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED) && blinkbios_button_block.wokeFlag) {
+
+        BLINKBIOS_SPIN();
+
+        // TODO: This sleep mode currently uses about 2mA. We can get that way down by...
+        //       1. Adding a supporess_display_flag to pixel_block to skip all of the display code when in this mode
+        //       2. Adding a new_pack_recieved_flag to ir_block so we only scan when there is a new packet
+        // UPDATE: Tried all that and it only saved like 0.1-0.2mA and added dozens of bytes of code so not worth it.
+
+
+        ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+
+        FOREACH_FACE( f ) {
+
+            if (ir_rx_state->packetBufferReady) {
+
+                if (ir_rx_state->packetBuffer[1] != TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+
+                    saw_packet_flag =1;
+
+                }
+
+                ir_rx_state->packetBufferReady=0;
+
+            }
+
+            ir_rx_state++;
+        }
+
+    }
+
+    cli();
+    blinkbios_millis_block.millis = save_time;
+    BLINKBIOS_POSTPONE_SLEEP_VECTOR();              // It is ok top call like this to reset the inactivity timer
+    sei();
+
+    hasWarmWokenFlag = 1;           // Remember that we warm slept
+    reset_warm_sleep_timer();
+
+    // Forced sleep mode
+    // Really need button down detection in bios so we only wake on lift...
+    // BLINKBIOS_SLEEP_NOW_VECTOR();
+
+    // Clear out old packets (including any old FORCE_SLEEP packets so we don't go right back to bed)
+
+    clear_packet_buffers();
+            
+    // Show smooth wake animation
+    
+    // This loop empirically works out to be about the right delay.
+    // I know this hardcode is hackyish, but we need to save flash space
+
+    // For the wake animation we start off and dim to MAX by the end
+
+    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0
+    fade_brightness = 0;
+    
+    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+
+        FOREACH_FACE(f) {
+            
+            // INcrement first - they are already seeing OFF when we start
+            fade_brightness += animation_fade_step;                        
+            setColorNow( dim( WHITE, fade_brightness ) );
+            
+            blinkbios_irdata_send_packet( f ,  nop_wake_packet , sizeof( nop_wake_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+
+        }
+
+    }
+                       
+    // restore game pixels
+    
+    restorePixels();
+    
+}
+
+// Called anytime a the button is pressed or anytime we get a viral button press form a neighbor over IR
+// Note that we know that this can not become cyclical because of the lockout delay 
+
+void viralPostponeWarmSleep() {
+    
+    if (viralButtonPressLockoutTimer.isExpired()) {
+        
+        viralButtonPressLockoutTimer.set( VIRAL_BUTTON_PRESS_LOCKOUT_MS );
+        
+        viralButtonPressSendOnFaceBitflags = IR_FACE_BITMASK;
+
+        // Someone is handling the tiles, so new neighbors could show up anywhere
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+            resetProbeOnFace( &faces[f] );
+        }
+
+        // Prevent warm sleep
+        reset_warm_sleep_timer();
+                    
+    }    
+        
+}
+
+// #define PROFILE_NOINLINE to keep LTO from inlining the per-frame pieces of run() into it.
+// Then they show up as their own symbols in the ELF and the emulator in the `sim` folder can count
+// the cycles spent in each one. Costs a few bytes of flash and a couple of calls per frame.
+
+#ifdef PROFILE_NOINLINE
+    #define PROFILE_FUNCTION __attribute__((noinline))
+    void loop() PROFILE_FUNCTION;
+#else
+    #define PROFILE_FUNCTION
+#endif
+
+static void PROFILE_FUNCTION RX_IRFaces() {
+
+    //  Use these pointers to step though the arrays
+    face_t *face = faces;
+    volatile ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+
+    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+        #ifdef IR_DATAGRAM_ZERO_COPY
+
+            if ( face->inDatagramCount ) {
+
+                // The packet in the buffer is the datagram we are holding, so not new.
+                // Nothing else can come in until it is marked read. We do not touch expireTime, so if
+                // it is held for too long then the face expires just like the neighbor went quiet.
+
+                face++;
+                ir_rx_state++;
+
+                continue;
+
+            }
+
+        #endif
+
+            // Check for anything new coming in...
+
+        if ( ir_rx_state->packetBufferReady ) {
+
+            #ifdef IR_RELIABLE
+
+                // If we have not heard anything on this face for longer than the other side could possibly
+                // still be resending its last reliable datagram, then this could be a different neighbor, so
+                // forget what sequence number we last saw from the old one
+
+                if ( now > face->expireTime + RELIABLE_FORGET_MS ) {
+                    face->inReliableSeq = 0;
+                }
+
+            #endif
+
+            #ifdef IR_PROBE_BACKOFF_MAX_MS
+
+                // A new neighbor on this face could mean more on the faces next to it, so stop backing off there too
+
+                if ( face->expireTime < now ) {
+                    resetProbeOnFace( &faces[ f ? f-1 : FACE_COUNT-1 ] );
+                    resetProbeOnFace( &faces[ f < FACE_COUNT-1 ? f+1 : 0 ] );
+                }
+
+                face->probeInterval = 0;
+
+            #endif
+
+            #ifdef IR_TIME_SYNC
+
+                // Could be a different neighbor now, so start measuring the link over
+
+                if ( face->expireTime < now ) {
+                    face->syncHaveEcho = 0;
+                    face->syncFlight = TIME_SYNC_FLIGHT_UNKNOWN;
+                }
+
+            #endif
+
+            #ifdef IR_NEIGHBOR_FACES
+
+                // Could be a different neighbor (or the same one turned around) so forget which face they are touching us with,
+                // and tell them ours soon
+
+                if ( face->expireTime < now ) {
+                    face->inNeighborFace = 0;
+                    face->linkInfoCountdown = 0;
+                }
+
+            #endif
+
+            #ifdef IR_STATS
+
+                // Nobody was there to send us values, so only start counting the gap now
+
+                if ( face->expireTime < now ) {
+                    face->statsValueTime = now;
+                }
+
+            #endif
+
+            #ifdef IR_TREE
+
+                // New neighbor, so they need to hear where we are in the tree. We hang on to what they told us last time
+                // since it is usually the same neighbor after a couple of lost packets. If it really is someone new then
+                // we are new to them too, so they will send us theirs right away.
+
+                if ( face->expireTime < now ) {
+                    SBI( treeOutFaces , f );
+                }
+
+            #endif
+
+            // Got something, so we know there is someone out there
+            // TODO: Should we require the received packet to pass error checks?
+            face->expireTime = now + RX_EXPIRE_TIME_MS;
+
+            IR_STAT_INC( face , RX_PACKETS );
+
+            // This is slightly ugly. To save a buffer, we get the full packet with the BlinkBIOS IR packet type byte.                       
+
+            volatile const uint8_t *packetData = (ir_rx_state->packetBuffer);       
+            
+            if ( *packetData++ == IR_USER_DATA_HEADER_BYTE ) {        // We only process user data and ignore (and consume) anything else. This is ugly. Sorry. 
+            
+                uint8_t packetDataLen = (ir_rx_state->packetBufferLen)-1;               // deduct the BlinkBIOS packet type  byte 
+            
+                // blinkBIOS will only pass use packets with len >0 
+            
+                uint8_t irDataFirstByte = *packetData;                       
+
+                uint8_t irDataParityBits = irDataFirstByte;
+
+                // The parity bit on a 2 byte face value packet covers the second byte too
+
+                if ( packetDataLen == 2 && ( packetData[1] & ACK_MASK ) ) {
+
+                    irDataParityBits ^= packetData[1];
+
+                }
+                                                                   
+                if (irValueCheckValid( irDataParityBits )) {                                
+                
+                    // If we get here, then we know this is a valid packet
+                
+                    // Clear to send on this face immediately to ping-pong messages at max speed without collisions
+                    face->sendTime = 0;
+                                
+                    if (irValueDecodePostponeSleepFlag(irDataFirstByte )) {
+                    
+                        // The blink on on the other side of this connection is telling us that a button was pressed recently
+                        // Send the viral message to all neighbors.
+                                                                                
+                        viralPostponeWarmSleep();
+                   
+                        // We also need to extend hardware sleep
+                        // since we did not get a physical button press
+                        BLINKBIOS_POSTPONE_SLEEP_VECTOR();
+                                                           
+                    } 
+                
+
+                    uint8_t decodedByte = irValueDecodeData( irDataFirstByte );
+                
+                    if ( packetDataLen == 1 ) {         // normal user face value, One header byte + One data byte
+
+                        // We got a face value! Save it!
+
+                        face->inValue =decodedByte;
+
+                        statRxValueOnFace( face );
+
+
+                    } else if ( packetDataLen == 2 && IS_ACK( packetData[1] ) ) {   // Face value with an ACK riding along
+
+                        // With wide values we do not know the high bits of this one, so we just wait for the next
+
+                        #ifndef IR_WIDE_VALUES
+                            face->inValue =decodedByte;
+
+                            statRxValueOnFace( face );
+                        #endif
+
+                        #ifdef IR_RELIABLE
+                            processAck( face , ACK_ON_VALUE( packetData[1] , decodedByte ) );
+                        #endif
+
+                    } else if ( packetDataLen == 2 && IS_LINK_INFO( packetData[1] ) ) {     // Face value with link info riding along
+
+                        #ifndef IR_WIDE_VALUES
+                            face->inValue =decodedByte;
+
+                            statRxValueOnFace( face );
+                        #endif
+
+                        #ifdef IR_NEIGHBOR_FACES
+
+                            // Only 0-5 are faces, so we just ignore 6 or 7
+
+                            if ( ( packetData[1] & LINK_INFO_FACE_MASK ) < FACE_COUNT ) {
+                                face->inNeighborFace = ( packetData[1] & LINK_INFO_FACE_MASK ) + 1;
+                            }
+
+                        #endif
+
+                #ifdef IR_WIDE_VALUES
+
+                    } else if ( packetDataLen == 2 && IS_WIDE_VALUE( packetData[1] ) ) {     // Face value with high bits
+
+                        face->inValue = ( (face_value_t) ( ( packetData[1] ^ decodedByte ) & WIDE_VALUE_MASK ) << WIDE_VALUE_SHIFT ) | decodedByte;
+
+                        statRxValueOnFace( face );
+
+                #endif
+
+                    } else {        // (packetDataLen>1)  
+                    
+                
+                        if ( decodedByte == DATAGRAM_SPECIAL_VALUE) {
+                        
+                            uint8_t datagramPayloadLen = packetDataLen-2;           // We deduct 2 from he length to account for the header byte and the trailing checksum byte                        
+                            const uint8_t *datagramPayloadData = (const uint8_t *) packetData+1;    // Skip the packet header byte
+                        
+                            // Long packets are kind of a special case since we do not mark them read immediately
+                            if ( computePacketChecksum( datagramPayloadData , datagramPayloadLen )  ==  datagramPayloadData[ datagramPayloadLen ] ) {        // Run checksum on payload bytes after the header, compare that to the checksum at the end
+
+                                // Ok this packet checks out folks!
+
+                                receiveDatagram( face , datagramPayloadData , datagramPayloadLen );
+                                                                                    
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #ifdef IR_RELIABLE
+
+                        } else if ( decodedByte == RELIABLE_DATAGRAM_SPECIAL_VALUE && packetDataLen > 4 ) {   // Header, seq, ack, at least 1 payload byte, checksum
+
+                            uint8_t bodyLen = packetDataLen-2;                      // Seq + ack + payload, without the header byte and the trailing checksum byte
+                            const uint8_t *body = (const uint8_t *) packetData+1;
+
+                            if ( computePacketChecksum( body , bodyLen ) == body[ bodyLen ] ) {
+
+                                uint8_t seq = body[0] & ACK_SEQ_MASK;
+
+                                if ( IS_ACK( body[1] ) ) {
+                                    processAck( face , body[1] );
+                                }
+
+                                if ( face->inReliableSeq == ( ACK_FLAG | seq ) ) {
+
+                                    // We already got this one, so our ACK must have gotten lost. ACK it again.
+
+                                    face->outAck = ACK_FLAG | seq;
+
+                                    IR_STAT_INC( face , RX_DUPLICATES );
+
+                                } else if ( receiveDatagram( face , body+2 , bodyLen-2 ) ) {
+
+                                    face->inReliableSeq = ACK_FLAG | seq;
+                                    face->outAck = ACK_FLAG | seq;
+
+                                }
+
+                                // If it did not fit, then no ACK and they will send it again
+
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #endif
+
+                        #ifdef IR_TIME_SYNC
+
+                        } else if ( decodedByte == TIME_SYNC_SPECIAL_VALUE && packetDataLen == TIME_SYNC_BODY_LEN + 2 ) {     // Header byte, body, checksum
+
+                            const uint8_t *body = (const uint8_t *) packetData+1;
+
+                            if ( computePacketChecksum( body , TIME_SYNC_BODY_LEN ) == body[ TIME_SYNC_BODY_LEN ] ) {
+
+                                receiveTimeSync( face , body );
+
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #endif
+
+                        #ifdef IR_TREE
+
+                        } else if ( decodedByte == TREE_SPECIAL_VALUE && packetDataLen == TREE_BODY_LEN + 2 ) {     // Header byte, body, checksum
+
+                            const uint8_t *body = (const uint8_t *) packetData+1;
+
+                            if ( computePacketChecksum( body , TREE_BODY_LEN ) == body[ TREE_BODY_LEN ] ) {
+
+                                receiveTree( f , body );
+
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #endif
+
+                        #ifdef IR_BROADCAST
+
+                        } else if ( decodedByte == BROADCAST_SPECIAL_VALUE && packetDataLen > BROADCAST_HEADER_LEN + 2 ) {   // Header byte, header, at least 1 payload byte, checksum
+
+                            uint8_t bodyLen = packetDataLen-2;
+                            const uint8_t *body = (const uint8_t *) packetData+1;
+
+                            if ( computePacketChecksum( body , bodyLen ) == body[ bodyLen ] ) {
+
+                                receiveBroadcast( f , body , bodyLen );
+
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #endif
+
+                        #ifdef IR_TRANSFERS
+
+                        } else if ( decodedByte == TRANSFER_SPECIAL_VALUE && packetDataLen > 8 ) {   // Header, seq, ack, length, offset, at least 1 data byte, checksum
+
+                            uint8_t bodyLen = packetDataLen-2;
+                            const uint8_t *body = (const uint8_t *) packetData+1;
+
+                            if ( computePacketChecksum( body , bodyLen ) == body[ bodyLen ] ) {
+
+                                uint8_t seq = body[0] & ACK_SEQ_MASK;
+
+                                if ( IS_ACK( body[1] ) ) {
+                                    processAck( face , body[1] );
+                                }
+
+                                if ( face->inReliableSeq == ( ACK_FLAG | seq ) ) {
+
+                                    face->outAck = ACK_FLAG | seq;          // Resend of one we already have
+
+                                    IR_STAT_INC( face , RX_DUPLICATES );
+
+                                } else if ( receiveFragment( face , body[2] | ( body[3] << 8 ) , body[4] | ( body[5] << 8 ) , body+6 , bodyLen-6 ) ) {
+
+                                    face->inReliableSeq = ACK_FLAG | seq;
+                                    face->outAck = ACK_FLAG | seq;
+
+                                }
+
+                            } else {
+
+                                IR_STAT_INC( face , RX_CHECKSUM_ERRORS );
+
+                            }
+
+                        #endif
+
+                        } else {    // packetLen > 1 &&  decodedByte != LONG_DATA_SPECIAL_VALUE
+                            
+                            // Here is look for a magic packet that has 2 bytes of data and both are the special sleep trigger cookie
+                            
+                            if ( packetDataLen == 2 && decodedByte == TRIGGER_WARM_SLEEP_SPECIAL_VALUE && packetData[1] == TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+                                
+                                warm_sleep_cycle();                                
+                                
+                            }
+                            
+                        }  //  ( decodedByte == LONG_DATA_SPECIAL_VALUE)                     
+                    
+                    }    //  (packetDataLen>1)              
+
+                } else {
+                
+                    // Invalid packet received. No good way to show or log this. :/
+                    // (except to count it if IR_STATS is on)
+
+                    IR_STAT_INC( face , RX_PARITY_ERRORS );
+                
+                    //#warning
+                    //setColorNow( RED );                
+
+                }
+                
+            }                
+            
+            // No matter what, mark buffer as read so we can get next packet
+            // (unless we are holding onto a datagram in it)
+
+            #ifdef IR_DATAGRAM_ZERO_COPY
+                if ( !face->inDatagramCount )
+            #endif
+
+            ir_rx_state->packetBufferReady=0;
+                        
+        }  // if ( ir_data_buffer->ready_flag )
+
+        face++;
+        ir_rx_state++;
+
+    } // for( uint8_t f=0; f < FACE_COUNT ; f++ )
+
+    #ifdef IR_TREE
+        updateTree();
+    #endif
+
+}
+
+
+// Buffer to build outgoing IR packets that are not datagrams. Datagrams go out right from their
+// slot in face_t (see OUT_DATAGRAM_HEADROOM) so they never get copied.
+
+#if defined( IR_TRANSFERS )
+    static uint8_t ir_send_packet_buffer[ IR_RX_PACKET_SIZE ];      // Transfer fragments fill up the whole packet. The data belongs to the caller so we have to copy it.
+#elif defined( IR_TREE )
+    static uint8_t ir_send_packet_buffer[ TREE_BODY_LEN + 2 ];      // header byte + tree beacon + checksum. Bigger than time sync.
+#elif defined( IR_TIME_SYNC )
+    static uint8_t ir_send_packet_buffer[ TIME_SYNC_BODY_LEN + 2 ]; // header byte + time sync + checksum
+#else
+    static uint8_t ir_send_packet_buffer[ 2 ];                      // header byte + ACK
+#endif
+
+#ifdef IR_LISTEN_BEFORE_TALK
+
+    // The IR backoff gets its own random stream so that link traffic does not change the numbers the game gets from random().
+    // Seeded from the serial number so two tiles that step on each other do not keep picking the same waits.
+
+    static uint32_t backoff_rand_state;
+
+    // Something was coming in when we wanted to send on this face. Wait a random little while before trying again so
+    // two tiles that keep stepping on each other get out of sync. The window doubles each time in a row it happens.
+    // If the packet that was coming in makes it, we will answer it right away anyway since that clears sendTime.
+
+    static void backoffOnFace( face_t *face ) {
+
+        if ( !backoff_rand_state ) {
+            backoff_rand_state = serialNumberHash();
+        }
+
+        backoff_rand_state = xorshift32( backoff_rand_state );
+
+        if ( face->txBackoffExp < TX_BACKOFF_MAX_EXP ) {
+            face->txBackoffExp++;
+        }
+
+        face->sendTime = now + 1 + ( backoff_rand_state & ( ( 1 << face->txBackoffExp ) - 1 ) );
+
+        IR_STAT_INC( face , TX_BACKOFFS );
+
+    }
+
+#endif
+
+static void PROFILE_FUNCTION TX_IRFaces() {
+
+    //  Use these pointers to step though the arrays
+    face_t *face = faces;
+
+    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+        #ifdef IR_SHARED_DATAGRAMS
+
+            // If the neighbor left before the shared datagram went out to it, then forget that face
+            // so it does not hold up the next one forever
+
+            if ( face->expireTime < now ) {
+                CBI( sharedDatagramFaces , f );
+            }
+
+        #endif
+
+        #ifdef IR_LISTEN_BEFORE_TALK
+
+            // Listen before talk. If bits are coming in on this face right now then the BIOS would
+            // refuse to send anyway, or worse we would walk right over them.
+
+            if ( face->sendTime <= now && blinkbios_is_rx_in_progress( f ) ) {
+
+                IR_STAT_INC( face , TX_DEFERRED );
+
+                backoffOnFace( face );
+
+            }
+
+        #endif
+        
+        // Send one out too if it is time....
+
+        if ( face->sendTime <= now ) {        // Time to send on this face?
+                                              // Note that we do not use the rx_fresh flag here because we want the timeout
+                                              // to do automatic retries to kickstart things when a new neighbor shows up or
+                                              // when an IR message gets missed
+                   
+            uint8_t *outgoingPacket = ir_send_packet_buffer;     // Where the outgoing packet starts, header byte first
+            uint8_t outgoingPacketLen;              // Total length of the outgoing packet
+            uint8_t outgoiungPacketHeaderValue;     // Value to encode into first byte of outgoing IR packet before transmitting
+
+            #ifdef IR_RELIABLE
+
+                // If we already sent the reliable datagram at the head of the queue as many times as we are allowed
+                // and the answer to the last one still did not have the ACK, then give up on it.
+
+                if ( face->outReliableTries >= IR_RELIABLE_DATAGRAM_TRIES ) {
+
+                    IR_STAT_INC( face , TX_RELIABLE_FAILED );
+
+                    #ifdef IR_TRANSFERS
+
+                        if ( face->outTransferInFlight ) {
+
+                            // Same for a transfer fragment, which fails the whole transfer
+
+                            face->outTransferStatus = TRANSFER_FAILED;
+                            face->outTransferInFlight = 0;
+
+                            nextOutReliableSeq( face );
+
+                        } else
 
-static uint8_t force_sleep_packet[2] = { TRIGGER_WARM_SLEEP_SPECIAL_VALUE , TRIGGER_WARM_SLEEP_SPECIAL_VALUE};
+                    #endif
 
-// This packet does nothing except wake up our neighbors
+                    {
 
-static uint8_t nop_wake_packet[2] = { NOP_SPECIAL_VALUE , NOP_SPECIAL_VALUE};
+                        if ( face->outReliableFailed < UINT8_MAX ) {
+                            face->outReliableFailed++;
+                        }
 
+                        popOutReliableDatagram( face );
 
-#define SLEEP_PACKET_REPEAT_COUNT 5     // How many times do we send the sleep and wake packets for redunancy?
+                    }
 
-static void warm_sleep_cycle() {
-    
-    BLINKBIOS_POSTPONE_SLEEP_VECTOR();      // Postpone cold sleep so we can warm sleep for a while
-    // The cold sleep will eventually kick in if we
-    // do not wake from warm sleep in time.
-        
-    // Save the games pixels so we can restore them on waking
-    // we need to do this because the sleep and wake animations
-    // will overwrite whatever is there. 
-            
-    savePixels(); 
+                }
 
+            #endif
 
-    // Ok, now we are virally sending FORCE_SLEEP out on all faces to spread the word
-    // and the pixels are off so the user is happy and we are saving power.
+            uint8_t headLen = face->outDatagramCount ? face->outDatagramLen[ face->outDatagramHead ] : 0;    // Length and flags of the next datagram in line, 0 if none
+            uint8_t headReliable = 0;
 
-    // First send the force sleep packet out to all our neighbors
-    // We are indiscriminate, just splat it 5 times everywhere.
-    // This is a brute force approach to make sure we get though even with collisions
-    // and long packets in flight.
-    
-    // We also show a little animation while transmitting the packets
-    
-    // Figure out how much brightness to animate on each packet
-        
-    const int animation_fade_step = SLEEP_ANIMATION_MAX_BRIGHTNESS / ( SLEEP_PACKET_REPEAT_COUNT * FACE_COUNT );
-    
-    uint8_t fade_brightness;
-    
-    // For the sleep animation we start bright and dim to 0 by the end
+            #ifdef IR_RELIABLE
+                headReliable = headLen & DATAGRAM_RELIABLE_FLAG;
+            #endif
+                                                                      
+            // Ok, it is time to send something on this face
+            // Do we have a pending datagram? If so, datagrams get priority over face values.
+            // ...except an ACK we owe gets priority over a plain datagram, since a plain datagram has no room for it.
+            // Transfer fragments go when there are no datagrams waiting, but once one is out it has to
+            // keep going until it is ACKed since it has the sequence number.
 
-    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0    
-    fade_brightness = SLEEP_ANIMATION_MAX_BRIGHTNESS;
-    
-    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+            uint8_t fragmentLen = 0;
 
-        FOREACH_FACE(f) {
-            
-            setColorNow( dim( BLUE, fade_brightness ) );
-            
-            fade_brightness -= animation_fade_step;
+            #ifdef IR_TRANSFERS
 
-            //while ( blinkbios_is_rx_in_progress( f ) );     // Wait to clear to send (no guarantee, but better than just blink sending)
+                if ( face->outTransferInFlight || ( !headLen && face->outTransferStatus == TRANSFER_SENDING ) ) {
+                    fragmentLen = outFragmentLen( face );
+                    headLen = 0;
+                }
 
-            blinkbios_irdata_send_packet( f , force_sleep_packet , sizeof( force_sleep_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+            #endif
 
-        }
+            // A broadcast we are sending or passing along goes ahead of datagrams since it only goes out once
+            // per face and everyone downstream is waiting on it. Like a plain datagram it has no room for an ACK.
 
-    }
-    
-    // Ensure that we end up completely off 
-    setColorNow( OFF );
-        
-    // We need to save the time now because it will keep ticking while we are in pre-sleep (where were can get
-    // woken back up by a packet). If we did not save it and then restore it later, then all the user timers
-    // would be expired when we woke.
+            uint8_t broadcastLen = 0;
 
-    // Save the time now so we can go back in time when we wake up
-    cli();
-    millis_t save_time = blinkbios_millis_block.millis;
-    sei();
+            #ifdef IR_BROADCAST
 
-    // OK we now appear asleep
-    // We are not sending IR so some power savings
-    // For the next 2 hours will will wait for a wake up signal
-    // TODO: Make this even more power efficient by sleeping between checks for incoming IR.
+                if ( !fragmentLen && TBI( broadcastOutFaces , f ) && !outAckOnFace( face ) ) {
+                    broadcastLen = broadcastOutLen;
+                    headLen = 0;
+                    headReliable = 0;
+                }
 
-    blinkbios_button_block.bitflags=0;
+            #endif
 
-    // Here is wuld be nice to idle the CPU for a bit of power savings, but there is a potential
-    // race where the BIOS could put us into deep sleep mode and then our idle would be deep sleep.
-    // you'd think we could turn of ints and set out mode right before entering idle, but
-    // we needs ints on to wake form idle on AVR.
+            // Time sync goes every so often when there is a neighbor to hear it. It is small so it does not hold up datagrams for long.
 
-    clear_packet_buffers();     // Clear out any left over packets that were there when we started this sleep cycle and might trigger us to wake unapropriately
+            uint8_t syncDue = 0;
 
-    uint8_t saw_packet_flag =0;
+            #ifdef IR_TIME_SYNC
 
-    // Wait in idle mode until we either see a non-force-sleep packet or a button press or woke.
-    // Why woke? Because eventually the BIOS will make us powerdown sleep inside this loop
-    // When that happens, it will take a button press to wake us
+                if ( !fragmentLen && !broadcastLen && face->syncTime <= now && face->expireTime >= now && !outAckOnFace( face ) ) {
+                    syncDue = 1;
+                    headLen = 0;
+                    headReliable = 0;
+                }
 
-    blinkbios_button_block.wokeFlag = 1;    // // Set to 0 upon waking from sleep
+            #endif
 
-    while (!saw_packet_flag && !(blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED) && blinkbios_button_block.wokeFlag) {
+            // A tree beacon goes out when something about us changed. Also small.
 
-        // TODO: This sleep mode currently uses about 2mA. We can get that way down by...
-        //       1. Adding a supporess_display_flag to pixel_block to skip all of the display code when in this mode
-        //       2. Adding a new_pack_recieved_flag to ir_block so we only scan when there is a new packet
-        // UPDATE: Tried all that and it only saved like 0.1-0.2mA and added dozens of bytes of code so not worth it.
+            uint8_t treeDue = 0;
 
+            #ifdef IR_TREE
 
-        ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+                if ( !fragmentLen && !broadcastLen && !syncDue && TBI( treeOutFaces , f ) && face->expireTime >= now && !outAckOnFace( face ) ) {
+                    treeDue = 1;
+                    headLen = 0;
+                    headReliable = 0;
+                }
 
-        FOREACH_FACE( f ) {
+            #endif
 
-            if (ir_rx_state->packetBufferReady) {
+            // A shared datagram goes once the datagrams that were already waiting on this face when it was sent are gone.
+            // Anything queued on this face after it waits behind it, even when we owe an ACK and the shared one
+            // (which has no room for it) has to wait for the face value to carry it first.
 
-                if (ir_rx_state->packetBuffer[1] != TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+            uint8_t sharedLen = 0;
 
-                    saw_packet_flag =1;
+            #ifdef IR_SHARED_DATAGRAMS
+
+                if ( !fragmentLen && !broadcastLen && !syncDue && !treeDue && TBI( sharedDatagramFaces , f ) && !sharedDatagramAhead[f] ) {
+
+                    if ( !outAckOnFace( face ) ) {
+                        sharedLen = sharedDatagramLen;
+                    }
+
+                    headLen = 0;
+                    headReliable = 0;
 
                 }
 
-                ir_rx_state->packetBufferReady=0;
+            #endif
+
+            // If we already sent IR_VALUE_MAX_SKIPS other things in a row on this face, it is the face value's turn no matter what
 
+            if ( face->outValueSkips >= IR_VALUE_MAX_SKIPS ) {
+                fragmentLen = 0;
+                broadcastLen = 0;
+                syncDue = 0;
+                treeDue = 0;
+                sharedLen = 0;
+                headLen = 0;
+                headReliable = 0;
             }
 
-            ir_rx_state++;
-        }
+            if ( fragmentLen ) {
 
-    }
+                #ifdef IR_TRANSFERS
 
-    cli();
-    blinkbios_millis_block.millis = save_time;
-    BLINKBIOS_POSTPONE_SLEEP_VECTOR();              // It is ok top call like this to reset the inactivity timer
-    sei();
+                    outgoiungPacketHeaderValue = TRANSFER_SPECIAL_VALUE;
 
-    hasWarmWokenFlag = 1;           // Remember that we warm slept
-    reset_warm_sleep_timer();
+                    uint8_t *d = ir_send_packet_buffer+1;
 
-    // Forced sleep mode
-    // Really need button down detection in bios so we only wake on lift...
-    // BLINKBIOS_SLEEP_NOW_VECTOR();
+                    *d++ = face->outReliableSeq;
+                    *d++ = face->outAck;
+                    *d++ = face->outTransferLen & 0xff;
+                    *d++ = face->outTransferLen >> 8;
+                    *d++ = face->outTransferSent & 0xff;
+                    *d++ = face->outTransferSent >> 8;
 
-    // Clear out old packets (including any old FORCE_SLEEP packets so we don't go right back to bed)
+                    memcpy( d , face->outTransferData + face->outTransferSent , fragmentLen );
+                    d += fragmentLen;
 
-    clear_packet_buffers();
-            
-    // Show smooth wake animation
-    
-    // This loop empirically works out to be about the right delay.
-    // I know this hardcode is hackyish, but we need to save flash space
+                    *d = computePacketChecksum( ir_send_packet_buffer+1 , d - (ir_send_packet_buffer+1) );
 
-    // For the wake animation we start off and dim to MAX by the end
+                    outgoingPacketLen = d - ir_send_packet_buffer + 1;
 
-    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0
-    fade_brightness = 0;
-    
-    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+                #endif
+                                    
+            } else if ( broadcastLen ) {
 
-        FOREACH_FACE(f) {
-            
-            // INcrement first - they are already seeing OFF when we start
-            fade_brightness += animation_fade_step;                        
-            setColorNow( dim( WHITE, fade_brightness ) );
-            
-            blinkbios_irdata_send_packet( f ,  nop_wake_packet , sizeof( nop_wake_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+                #ifdef IR_BROADCAST
 
-        }
+                    outgoiungPacketHeaderValue = BROADCAST_SPECIAL_VALUE;
 
-    }
-                       
-    // restore game pixels
-    
-    restorePixels();
-    
-}
+                    // Stamp how old it is right as it goes out, so the time it sat here waiting counts
 
-// Called anytime a the button is pressed or anytime we get a viral button press form a neighbor over IR
-// Note that we know that this can not become cyclical because of the lockout delay 
+                    millis_t age = now - broadcastOutBorn;
 
-void viralPostponeWarmSleep() {
-    
-    if (viralButtonPressLockoutTimer.isExpired()) {
-        
-        viralButtonPressLockoutTimer.set( VIRAL_BUTTON_PRESS_LOCKOUT_MS );
-        
-        viralButtonPressSendOnFaceBitflags = IR_FACE_BITMASK;
+                    if ( age > UINT16_MAX ) {
+                        age = UINT16_MAX;
+                    }
 
-        // Prevent warm sleep
-        reset_warm_sleep_timer();
-                    
-    }    
-        
-}
+                    broadcastOutPacket[8] = age & 0xff;
+                    broadcastOutPacket[9] = age >> 8;
 
-static void RX_IRFaces() {
+                    uint8_t bodyLen = BROADCAST_HEADER_LEN + broadcastLen;
 
-    //  Use these pointers to step though the arrays
-    face_t *face = faces;
-    volatile ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+                    broadcastOutPacket[ 1 + bodyLen ] = computePacketChecksum( broadcastOutPacket + 1 , bodyLen );
 
-    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+                    outgoingPacket = broadcastOutPacket;
+                    outgoingPacketLen = bodyLen + 2;
 
-            // Check for anything new coming in...
+                #endif
 
-        if ( ir_rx_state->packetBufferReady ) {
+            } else if ( syncDue ) {
 
-            // Got something, so we know there is someone out there
-            // TODO: Should we require the received packet to pass error checks?
-            face->expireTime = now + RX_EXPIRE_TIME_MS;
+                #ifdef IR_TIME_SYNC
 
-            // This is slightly ugly. To save a buffer, we get the full packet with the BlinkBIOS IR packet type byte.                       
+                    outgoiungPacketHeaderValue = TIME_SYNC_SPECIAL_VALUE;
 
-            volatile const uint8_t *packetData = (ir_rx_state->packetBuffer);       
-            
-            if ( *packetData++ == IR_USER_DATA_HEADER_BYTE ) {        // We only process user data and ignore (and consume) anything else. This is ugly. Sorry. 
-            
-                uint8_t packetDataLen = (ir_rx_state->packetBufferLen)-1;               // deduct the BlinkBIOS packet type  byte 
-            
-                // blinkBIOS will only pass use packets with len >0 
-            
-                uint8_t irDataFirstByte = *packetData;                       
-                                                                   
-                if (irValueCheckValid( irDataFirstByte )) {                                
-                
-                    // If we get here, then we know this is a valid packet
+                    buildTimeSync( face , ir_send_packet_buffer+1 );
+
+                    ir_send_packet_buffer[ 1 + TIME_SYNC_BODY_LEN ] = computePacketChecksum( ir_send_packet_buffer+1 , TIME_SYNC_BODY_LEN );
+
+                    outgoingPacketLen = TIME_SYNC_BODY_LEN + 2;
+
+                #endif
+
+            } else if ( treeDue ) {
+
+                #ifdef IR_TREE
+
+                    outgoiungPacketHeaderValue = TREE_SPECIAL_VALUE;
+
+                    buildTree( f , ir_send_packet_buffer+1 );
+
+                    ir_send_packet_buffer[ 1 + TREE_BODY_LEN ] = computePacketChecksum( ir_send_packet_buffer+1 , TREE_BODY_LEN );
+
+                    outgoingPacketLen = TREE_BODY_LEN + 2;
+
+                #endif
+
+            } else if ( sharedLen ) {
+
+                #ifdef IR_SHARED_DATAGRAMS
+
+                    outgoiungPacketHeaderValue = DATAGRAM_SPECIAL_VALUE;
+
+                    outgoingPacket = sharedDatagramPacket;
+                    outgoingPacketLen = sharedLen + 2;
+
+                #endif
+
+            } else if ( headLen && ( headReliable || !outAckOnFace( face ) ) ) {
                 
-                    // Clear to send on this face immediately to ping-pong messages at max speed without collisions
-                    face->sendTime = 0;
+                // Fill in the headroom in front of the datagram's slot and the checksum after it,
+                // so the slot itself is the packet. Oldest one goes first.
                                 
-                    if (irValueDecodePostponeSleepFlag(irDataFirstByte )) {
-                    
-                        // The blink on on the other side of this connection is telling us that a button was pressed recently
-                        // Send the viral message to all neighbors.
-                                                                                
-                        viralPostponeWarmSleep();
-                   
-                        // We also need to extend hardware sleep
-                        // since we did not get a physical button press
-                        BLINKBIOS_POSTPONE_SLEEP_VECTOR();
-                                                           
-                    } 
-                
+                uint8_t *payload = face->outDatagramData[ face->outDatagramHead ] + OUT_DATAGRAM_HEADROOM;
+                uint8_t datagramPayloadLen  = headLen & ~DATAGRAM_RELIABLE_FLAG;
 
-                    uint8_t decodedByte = irValueDecodeData( irDataFirstByte );
-                
-                    if ( packetDataLen == 1 ) {         // normal user face value, One header byte + One data byte
+                uint8_t *d = payload;                   // Start of the body, which is everything after the header byte
+                uint8_t bodyLen = datagramPayloadLen;
 
-                        // We got a face value! Save it!
+                #ifdef IR_RELIABLE
 
-                        face->inValue =decodedByte;
+                    if ( headReliable ) {
 
+                        outgoiungPacketHeaderValue = RELIABLE_DATAGRAM_SPECIAL_VALUE;
 
-                    } else {        // (packetDataLen>1)  
-                    
-                
-                        if ( decodedByte == DATAGRAM_SPECIAL_VALUE) {
-                        
-                            uint8_t datagramPayloadLen = packetDataLen-2;           // We deduct 2 from he length to account for the header byte and the trailing checksum byte                        
-                            const uint8_t *datagramPayloadData =   packetData+1;    // Skip the packet header byte
-                        
-                            // Long packets are kind of a special case since we do not mark them read immediately
-                            if ( computePacketChecksum( datagramPayloadData , datagramPayloadLen )  ==  datagramPayloadData[ datagramPayloadLen ] ) {        // Run checksum on payload bytes after the header, compare that to the checksum at the end
+                        *--d = face->outAck;
+                        *--d = face->outReliableSeq;
+                        bodyLen += 2;
 
-                                // Ok this packet checks out folks!
-                            
-                                if ( face->inDatagramLen == 0 && !(datagramPayloadLen > IR_DATAGRAM_LEN) ) {        // Check if buffer free and datagram not too long
+                    } else
 
-                                    face->inDatagramLen = datagramPayloadLen;
-                                
-                                    memcpy( face->inDatagramData  , datagramPayloadData , datagramPayloadLen);       // Skip the header bytes
-                                    
-                                }
-                                                                                    
-                            }
+                #endif
 
-                        } else {    // packetLen > 1 &&  decodedByte != LONG_DATA_SPECIAL_VALUE
-                            
-                            // Here is look for a magic packet that has 2 bytes of data and both are the special sleep trigger cookie
-                            
-                            if ( packetDataLen == 2 && decodedByte == TRIGGER_WARM_SLEEP_SPECIAL_VALUE && packetData[1] == TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
-                                
-                                warm_sleep_cycle();                                
-                                
-                            }
-                            
-                        }  //  ( decodedByte == LONG_DATA_SPECIAL_VALUE)                     
-                    
-                    }    //  (packetDataLen>1)              
+                {
 
-                } else {
-                
-                    // Invalid packet received. No good way to show or log this. :/
-                
-                    //#warning
-                    //setColorNow( RED );                
+                    outgoiungPacketHeaderValue = DATAGRAM_SPECIAL_VALUE;
 
                 }
+
+                outgoingPacket = d - 1;                 // The header byte goes right before the body
+
+                payload[ datagramPayloadLen ] = computePacketChecksum( d , bodyLen );
+
+                outgoingPacketLen = bodyLen + 2;       // include header byte + body + checksum
+                                
+                // Note that the outgoing datagram buffer will be cleared below if the IR send succeeds
                 
-            }                
-            
-            // No matter what, mark buffer as read so we can get next packet
-            ir_rx_state->packetBufferReady=0;
-                        
-        }  // if ( ir_data_buffer->ready_flag )
+            } else {    
+                
+                // Just send a normal face value, with an ACK tacked on if we owe one
+                outgoiungPacketHeaderValue = face->outValue & WIDE_VALUE_MASK;      // Just the low bits if it is wide
+                outgoingPacketLen=1;
+
+                if ( outAckOnFace( face ) ) {
+
+                    ir_send_packet_buffer[1] = ACK_ON_VALUE( outAckOnFace( face ) , outgoiungPacketHeaderValue );
+                    outgoingPacketLen=2;
 
-        face++;
-        ir_rx_state++;
+                } else {
 
-    } // for( uint8_t f=0; f < FACE_COUNT ; f++ )
+                    #ifdef IR_NEIGHBOR_FACES
 
-}
+                        // ...or which face this is, if it is time to remind them
 
+                        if ( face->linkInfoCountdown ) {
 
-// Buffer to build each outgoing IR packet
-// This is the easy way to do this, but uses RAM unnecessarily.
-// TODO: Make a scatter version of this to save RAM & time
+                            face->linkInfoCountdown--;
 
-static uint8_t ir_send_packet_buffer[ IR_DATAGRAM_LEN + 2 ];    // header byte + Datagram payload  + checksum byte
+                        } else {
 
-static void TX_IRFaces() {
+                            ir_send_packet_buffer[1] = LINK_INFO_FLAG | f;
+                            outgoingPacketLen=2;
 
-    //  Use these pointers to step though the arrays
-    face_t *face = faces;
+                            face->linkInfoCountdown = LINK_INFO_EVERY;
 
-    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
-        
-        // Send one out too if it is time....
+                        }
 
-        if ( face->sendTime <= now ) {        // Time to send on this face?
-                                              // Note that we do not use the rx_fresh flag here because we want the timeout
-                                              // to do automatic retries to kickstart things when a new neighbor shows up or
-                                              // when an IR message gets missed
-                   
-            uint8_t outgoingPacketLen;              // Total length of the outgoing packet in ir_send_packet_buffer
-            uint8_t outgoiungPacketHeaderValue;     // Value to encode into first byte of outgoing IR packet before transmitting
-                                                                      
-            // Ok, it is time to send something on this face
-            // Do we have a pending datagram? If so, datagrams get priority over face values
-                                    
-            if (face->outDatagramLen) {
-                
-                outgoiungPacketHeaderValue = DATAGRAM_SPECIAL_VALUE;
+                    #endif
 
-                // Build a datagram into the outgoing buffer including checksum
-                                
-                uint8_t *d = ir_send_packet_buffer+1;           // Data goes after the 1st byte header            
-                const uint8_t *s = face->outDatagramData ;      // Just to convert from void to uint8_t
+                    #ifdef IR_WIDE_VALUES
 
-                uint8_t datagramPayloadLen  = face->outDatagramLen;
-                                
-                memcpy( d, s , datagramPayloadLen );
-                                                
-                // First header, then payload, when checksum 
-                 ir_send_packet_buffer[1+datagramPayloadLen] = computePacketChecksum( s , datagramPayloadLen );
+                        // ...otherwise the high bits, if there are any
 
-                outgoingPacketLen = 1 + datagramPayloadLen +1;       // include header byte + payload + checksum (header added below)
-                                
-                // Note that the outgoing datagram buffer will be cleared below if the IR send succeeds
-                
-            } else {    
-                
-                // Just send a normal face value                                
-                outgoiungPacketHeaderValue = face->outValue;
-                outgoingPacketLen=1;
+                        if ( outgoingPacketLen == 1 && face->outValue > IR_DATA_VALUE_MAX ) {
+
+                            ir_send_packet_buffer[1] = WIDE_VALUE_FLAG | ( ( ( face->outValue >> WIDE_VALUE_SHIFT ) ^ face->outValue ) & WIDE_VALUE_MASK );
+                            outgoingPacketLen=2;
+
+                        }
+
+                    #endif
+
+                }
+
+                headLen = 0;                        // So we know below that no datagram went out
                                 
             }       
 
@@ -732,9 +2936,19 @@ static void TX_IRFaces() {
                 
             }
             
-            ir_send_packet_buffer[0] = encodedIrValue;  // store the encoded header into the outgoing buffer
+            // The parity bit on a 2 byte face value packet covers the second byte too
+
+            if ( outgoingPacketLen == 2 && oddParity( outgoingPacket[1] ) ) {
+
+                encodedIrValue ^= 0b10000000;
+
+            }
+
+            *outgoingPacket = encodedIrValue;  // store the encoded header into the outgoing packet
+
+            IR_STAT_INC( face , TX_ATTEMPTS );
 
-            if (blinkbios_irdata_send_packet( f , ir_send_packet_buffer  , outgoingPacketLen ) ) {
+            if (blinkbios_irdata_send_packet( f , outgoingPacket  , outgoingPacketLen ) ) {
                 
                 // Here we set a timeout to keep periodically probing on this face, but
                 // if there is a neighbor, they will send back to us as soon as they get what we
@@ -749,14 +2963,138 @@ static void TX_IRFaces() {
 				// pass thugh loop() every time when there are no neighbors.
                 
 				 
-                face->sendTime = now + TX_PROBE_TIME_MS + f;	
+                #ifdef IR_PROBE_BACKOFF_MAX_MS
+
+                    // Nobody has been there for a while, so wait twice as long next time
+
+                    if ( face->expireTime + PROBE_BACKOFF_AFTER_MS < now ) {
+
+                        uint16_t interval = face->probeInterval ? face->probeInterval : TX_PROBE_TIME_MS;
+
+                        face->probeInterval = ( interval < IR_PROBE_BACKOFF_MAX_MS / 2 ) ? interval * 2 : IR_PROBE_BACKOFF_MAX_MS;
+
+                    }
+
+                    face->sendTime = now + ( face->probeInterval ? face->probeInterval : TX_PROBE_TIME_MS ) + f;
+
+                #else
+
+                    face->sendTime = now + TX_PROBE_TIME_MS + f;
+
+                #endif
+
+                #ifdef IR_LISTEN_BEFORE_TALK
+                    face->txBackoffExp = 0;
+                #endif
+
+                if ( face->expireTime < now ) {
+                    IR_STAT_INC( face , TX_PROBES );
+                }
                 
                 
-                // Mark any pending datagram as sent
-                // safe to do this blindly because datagram always gets priority so it would have been 
-                // what was just sent if there was one pending
-                face->outDatagramLen = 0;
+                #ifdef IR_BROADCAST
+
+                    if ( broadcastLen ) {
+                        CBI( broadcastOutFaces , f );
+                    }
+
+                #endif
+
+                #ifdef IR_TIME_SYNC
+
+                    if ( syncDue ) {
+                        face->syncTime = now + TIME_SYNC_PERIOD_MS;
+                    }
+
+                #endif
+
+                #ifdef IR_TREE
+
+                    if ( treeDue ) {
+                        CBI( treeOutFaces , f );
+                    }
+
+                #endif
+
+                #ifdef IR_SHARED_DATAGRAMS
+
+                    if ( sharedLen ) {
+                        CBI( sharedDatagramFaces , f );
+                    }
+
+                #endif
+
+                // Face value packets are the only ones shorter than 3 bytes
+
+                if ( outgoingPacketLen <= 2 ) {
+                    face->outValueSkips = 0;
+                } else {
+                    face->outValueSkips++;
+                }
+
+                #ifdef IR_RELIABLE
+
+                    // Any ACK we owed just went out, either with the face value or in the reliable datagram or fragment
+
+                    if ( outgoingPacketLen == 2 || headReliable || fragmentLen ) {
+                        face->outAck = 0;
+                    }
+
+                #endif
+
+                #ifdef IR_TRANSFERS
+
+                    if ( fragmentLen ) {
+
+                        if ( face->outReliableTries ) {
+                            IR_STAT_INC( face , TX_RELIABLE_RETRIES );
+                        }
+
+                        face->outReliableTries++;
+                        face->outTransferInFlight = 1;
+
+                    }
+
+                #endif
+
+                // Mark any plain datagram as sent. The next one in line goes out on
+                // our next turn, which is as soon as the neighbor answers.
+                // A reliable datagram stays at the head of the queue until it is ACKed, so if
+                // the answer does not have the ACK then it goes out again on our next turn.
+
+                if ( headLen ) {
+
+                    #ifdef IR_RELIABLE
+
+                        if ( headReliable ) {
+
+                            if ( face->outReliableTries ) {
+                                IR_STAT_INC( face , TX_RELIABLE_RETRIES );
+                            }
+
+                            face->outReliableTries++;
+
+                        } else
+
+                    #endif
+
+                    {
+
+                        popOutDatagram( face );
+
+                    }
+                }
                 
+            } else {
+
+                // The BIOS saw something start coming in on this face (after we checked, with IR_LISTEN_BEFORE_TALK)
+
+                IR_STAT_INC( face , TX_REFUSED );
+
+                #ifdef IR_LISTEN_BEFORE_TALK
+                    backoffOnFace( face );
+                #endif
+
             }
 
         } // if ( face->sendTime <= now )
@@ -768,6 +3106,38 @@ static void TX_IRFaces() {
 }
 
 
+#ifdef IR_NEIGHBOR_FACES
+
+byte getNeighborFaceOnFace( byte face ) {
+
+    const face_t *f = &faces[face];
+
+    if ( f->inNeighborFace && !isValueReceivedOnFaceExpired( face ) ) {
+        return f->inNeighborFace - 1;
+    }
+
+    return FACE_COUNT;
+
+}
+
+byte getNeighborRotationOnFace( byte face ) {
+
+    byte theirs = getNeighborFaceOnFace( face );
+
+    if ( theirs == FACE_COUNT ) {
+        return FACE_COUNT;
+    }
+
+    // If they were turned the same way as us, our face touches their face straight across
+
+    byte straightAcross = face + ( FACE_COUNT / 2 );
+
+    return ( theirs + FACE_COUNT + FACE_COUNT - straightAcross ) % FACE_COUNT;
+
+}
+
+#endif
+
 // Returns the last received state on the indicated face
 // Remember that getNeighborState() starts at 0 on powerup.
 // so returns 0 if no neighbor ever seen on this face since power-up
@@ -776,19 +3146,39 @@ static void TX_IRFaces() {
 
 byte getLastValueReceivedOnFace( byte face ) {
 
+    #ifdef IR_WIDE_VALUES
+
+        // Same as if they had sent it with setValueSentOnFace()
+
+        if ( faces[face].inValue > IR_DATA_VALUE_MAX ) {
+            return IR_DATA_VALUE_MAX;
+        }
+
+    #endif
+
     return faces[face].inValue;
 
 }
 
+#ifdef IR_WIDE_VALUES
+
+    word getLastWideValueReceivedOnFace( byte face ) {
+
+        return faces[face].inValue;
+
+    }
+
+#endif
+
 // Did the neighborState value on this face change since the
 // last time we checked?
 // Remember that getNeighborState starts at 0 on powerup.
 // Note the a face expiring has no effect on the getNeighborState()
 
 byte didValueOnFaceChange( byte face ) {
-    static byte prevState[FACE_COUNT];
+    static face_value_t prevState[FACE_COUNT];
 
-    byte curState = getLastValueReceivedOnFace(face);
+    face_value_t curState = faces[face].inValue;
 
     if ( curState == prevState[face] ) {
         return false;
@@ -807,6 +3197,75 @@ byte isValueReceivedOnFaceExpired( byte face ) {
 
 }
 
+#ifdef IR_FACE_EVENTS
+
+    static FaceEvents faceEvents;
+    static face_value_t faceEventsLastValue[FACE_COUNT];    // inValue as of the last snapshot, to see what changed
+    static face_value_t faceEventsChangedBits[FACE_COUNT];  // ...and which bits of it changed, for getFaceEventsChangedIn()
+
+    // Called from run() once per pass, after RX_IRFaces()
+
+    static void updateFaceEvents() {
+
+        byte present = 0;
+        byte changed = 0;
+        byte datagram = 0;
+
+        const face_t *face = faces;
+
+        for( uint8_t f=0 , bit=1 ; f < FACE_COUNT ; f++ , bit <<= 1 ) {
+
+            if ( face->expireTime >= now ) {
+                present |= bit;
+            }
+
+            face_value_t changedBits = face->inValue ^ faceEventsLastValue[f];
+
+            faceEventsChangedBits[f] = changedBits;
+
+            if ( changedBits ) {
+                faceEventsLastValue[f] = face->inValue;
+                changed |= bit;
+            }
+
+            if ( face->inDatagramCount ) {
+                datagram |= bit;
+            }
+
+            face++;
+
+        }
+
+        faceEvents.appeared = present & ~faceEvents.present;
+        faceEvents.expired  = faceEvents.present & ~present;
+        faceEvents.present  = present;
+        faceEvents.changed  = changed;
+        faceEvents.datagram = datagram;
+
+    }
+
+    FaceEvents getFaceEvents() {
+        return faceEvents;
+    }
+
+    byte getFaceEventsChangedIn( word bits ) {
+
+        byte changed = 0;
+
+        for( uint8_t f=0 , bit=1 ; f < FACE_COUNT ; f++ , bit <<= 1 ) {
+
+            if ( faceEventsChangedBits[f] & bits ) {
+                changed |= bit;
+            }
+
+        }
+
+        return changed;
+
+    }
+
+#endif
+
 // Returns false if their has been a neighbor seen recently on any face, true otherwise.
 
 bool isAlone() {
@@ -861,6 +3320,38 @@ void setValueSentOnFace( byte value , byte face ) {
 
 }
 
+#ifdef IR_WIDE_VALUES
+
+    void setWideValueSentOnAllFaces( word value ) {
+
+        if (value > IR_WIDE_VALUE_MAX ) {
+
+            value = IR_WIDE_VALUE_MAX;
+
+        }
+
+        FOREACH_FACE(f) {
+
+            faces[f].outValue = value;
+
+        }
+
+    }
+
+    void setWideValueSentOnFace( word value , byte face ) {
+
+        if (value > IR_WIDE_VALUE_MAX ) {
+
+            value = IR_WIDE_VALUE_MAX;
+
+        }
+
+        faces[face].outValue = value;
+
+    }
+
+#endif
+
 
 
 // --------------Button code
@@ -1014,7 +3505,7 @@ void randomize() {
     for( uint8_t bit=32; bit; bit-- ) {
                                
         blinkbios_pixel_block.capturedEntropy=0;                                                          // Clear this so we can check to see when it gets set in the background               
-        while (blinkbios_pixel_block.capturedEntropy==0 || blinkbios_pixel_block.capturedEntropy==1  );   // Wait for this to get set in the background when the WDT ISR fires
+        while (blinkbios_pixel_block.capturedEntropy==0 || blinkbios_pixel_block.capturedEntropy==1  ) BLINKBIOS_SPIN();   // Wait for this to get set in the background when the WDT ISR fires
                                                                                                           // We also ignore 1 to stay balanced since 0 is a valid possible TCNT value that we will ignore                               
         rand_state <<=1;
         rand_state |= blinkbios_pixel_block.capturedEntropy & 0x01;            // Grab just the bottom bit each time to try and maximum entropy
@@ -1030,13 +3521,8 @@ void randomize() {
 
 static uint32_t nextrand32()
 {
-	// Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" 
-	uint32_t x = rand_state;
-	x ^= x << 13;
-	x ^= x >> 17;
-	x ^= x << 5;
-	rand_state = x;
-	return x;
+	rand_state = xorshift32( rand_state );
+	return rand_state;
 }
 
 
@@ -1053,7 +3539,7 @@ word randomWord(void) {
 // return a random number between 0 and limit inclusive.
 // https://stackoverflow.com/a/2999130/3152071
 
-word random( uint16_t limit ) {
+word random( word limit ) {
 
     word divisor = GETNEXTRANDUINT_MAX/(limit+1);
     word retval;
@@ -1132,7 +3618,19 @@ word map(word x, word in_min, word in_max, word out_min, word out_max)
 // As per "13.6.8.1. SNOBRx - Serial Number Byte 8 to 0"
 
 
-const byte * const serialno_addr = ( const byte *)   0xF0;
+#ifdef BLINKLIB_HOST
+
+    // No SNOBRx registers on the host, so the simulated BIOS hands us a serial number instead
+
+    extern byte blinkbios_sim_serialno[];
+
+    const byte * const serialno_addr = blinkbios_sim_serialno;
+
+#else
+
+    const byte * const serialno_addr = ( const byte *)   0xF0;
+
+#endif
 
 
 // Read the unique serial number for this blink tile
@@ -1320,6 +3818,150 @@ byte sin8_C( byte theta)
     
     
 
+#endif
+
+// #define PROFILE_PHASES to time each part of the frame inside run() and print a report out the service port
+// every PROFILE_PHASES_REPORT_FRAMES frames. Times are in 8us steps from the BIOS millis counter, so anything
+// shorter than that mostly shows up as 0 or 1 step.
+// Costs about 150 bytes of RAM and some flash. Compiles away to nothing when not defined.
+
+#ifdef PROFILE_PHASES
+
+    #include "Serial.h"
+
+    #ifndef PROFILE_PHASES_REPORT_FRAMES
+        #define PROFILE_PHASES_REPORT_FRAMES 500
+    #endif
+
+    #define PROFILE_PHASE_UPDATENOW     0
+    #define PROFILE_PHASE_RX            1
+    #define PROFILE_PHASE_BUTTON        2
+    #define PROFILE_PHASE_LOOP          3
+    #define PROFILE_PHASE_DISPLAY       4
+    #define PROFILE_PHASE_TX            5
+    #define PROFILE_PHASE_COUNT         6
+
+    // Histogram bucket n counts times with n significant bits, so 0 steps, 1 step, 2-3 steps, 4-7 steps...
+    // The last bucket gets everything 64 steps (512us) and up.
+
+    #define PROFILE_BUCKET_COUNT        8
+
+    struct profile_phase_t {
+        uint16_t min;
+        uint16_t max;
+        uint32_t sum;
+        uint16_t buckets[PROFILE_BUCKET_COUNT];
+    };
+
+    static profile_phase_t profile_phases[PROFILE_PHASE_COUNT];
+    static uint16_t profile_frames;
+    static uint16_t profile_start;
+
+    static const char profile_phase_names[PROFILE_PHASE_COUNT][4] PROGMEM = { "now" , "rx" , "btn" , "lop" , "dsp" , "tx" };
+
+    static ServicePortSerial profile_sp;
+
+    // Time in 8us steps. Only the bottom 16 bits, which is good for about half a second.
+
+    static uint16_t profile_now() {
+
+        cli();
+        uint16_t t = ( (uint16_t) blinkbios_millis_block.millis * 125 ) + blinkbios_millis_block.step_8us;
+        sei();
+
+        return t;
+    }
+
+    static void profile_reset() {
+
+        memset( profile_phases , 0 , sizeof( profile_phases ) );
+
+        for( uint8_t p=0; p < PROFILE_PHASE_COUNT ; p++ ) {
+            profile_phases[p].min = UINT16_MAX;
+        }
+
+        profile_frames = 0;
+
+    }
+
+    static void profile_init() {
+        profile_sp.begin();
+        profile_reset();
+    }
+
+    static void profile_begin() {
+        profile_start = profile_now();
+    }
+
+    static void profile_end( uint8_t phase ) {
+
+        uint16_t steps = profile_now() - profile_start;
+
+        profile_phase_t *p = &profile_phases[phase];
+
+        if ( steps < p->min ) p->min = steps;
+        if ( steps > p->max ) p->max = steps;
+        p->sum += steps;
+
+        uint8_t bucket = 0;
+
+        while ( steps && bucket < PROFILE_BUCKET_COUNT-1 ) {
+            steps >>= 1;
+            bucket++;
+        }
+
+        p->buckets[bucket]++;
+
+    }
+
+    // Called once at the end of every frame. The report takes a few milliseconds to go out at 1Mbd, but
+    // that lands between frames so it does not show up in any of the phases.
+
+    static void profile_frame() {
+
+        if ( ++profile_frames < PROFILE_PHASES_REPORT_FRAMES ) return;
+
+        profile_sp.print( F("phase min mean max (8us) | 0 1 2 4 8 16 32 64+ frames=") );
+        profile_sp.println( profile_frames );
+
+        for( uint8_t p=0; p < PROFILE_PHASE_COUNT ; p++ ) {
+
+            const profile_phase_t *s = &profile_phases[p];
+
+            profile_sp.print( FPSTR( profile_phase_names[p] ) );
+            profile_sp.print( ' ' );
+            profile_sp.print( s->min );
+            profile_sp.print( ' ' );
+            profile_sp.print( s->sum / profile_frames );
+            profile_sp.print( ' ' );
+            profile_sp.print( s->max );
+            profile_sp.print( F(" |") );
+
+            for( uint8_t b=0; b < PROFILE_BUCKET_COUNT ; b++ ) {
+                profile_sp.print( ' ' );
+                profile_sp.print( s->buckets[b] );
+            }
+
+            profile_sp.println();
+
+        }
+
+        profile_reset();
+
+    }
+
+    #define PROFILE_INIT()          profile_init()
+    #define PROFILE_BEGIN()         profile_begin()
+    #define PROFILE_END(phase)      profile_end( PROFILE_PHASE_##phase )
+    #define PROFILE_FRAME()         profile_frame()
+
+#else
+
+    #define PROFILE_INIT()
+    #define PROFILE_BEGIN()
+    #define PROFILE_END(phase)
+    #define PROFILE_FRAME()
+
 #endif
 
 uint8_t __attribute__((weak)) sterileFlag = 0;             // Set to 1 to make this game sterile. Hopefully LTO will compile this away for us? (update: Whooha yes! )
@@ -1341,6 +3983,8 @@ void __attribute__((noreturn)) run(void)  {
     
     statckwatcher_init();   // Set up the sentinel byte at the top of RAM used by variables so we can tell if stack clobbered it
 
+    PROFILE_INIT();
+
     setup();
 
     while (1) {
@@ -1417,7 +4061,9 @@ void __attribute__((noreturn)) run(void)  {
         // Used by millis() and Timer thus functions
         // This comes after the possible button holding to enter seed mode
        
+        PROFILE_BEGIN();
         updateNow();
+        PROFILE_END(UPDATENOW);
                 
         if ( blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED  ) {  // Any button press resets the warm sleep timeout
             viralPostponeWarmSleep();
@@ -1425,25 +4071,40 @@ void __attribute__((noreturn)) run(void)  {
 
 	// Update the IR RX state
         // Receive any pending packets
+        PROFILE_BEGIN();
         RX_IRFaces();
+        #ifdef IR_FACE_EVENTS
+            updateFaceEvents();
+        #endif
+        PROFILE_END(RX);
 
+        PROFILE_BEGIN();
         cli();
         buttonSnapshotDown       = blinkbios_button_block.down;
         buttonSnapshotBitflags  |= blinkbios_button_block.bitflags;     // Or any new flags into the ones we got
         blinkbios_button_block.bitflags=0;                              // Clear out the flags now that we have them
         buttonSnapshotClickcount = blinkbios_button_block.clickcount;
         sei();
+        PROFILE_END(BUTTON);
 
 
+        PROFILE_BEGIN();
         loop();
+        PROFILE_END(LOOP);
 
         // Update the pixels to match our buffer
 
+        PROFILE_BEGIN();
         BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
+        PROFILE_END(DISPLAY);
 
         // Transmit any IR packets waiting to go out
         // Note that we do this after loop had a chance to update them.
+        PROFILE_BEGIN();
         TX_IRFaces();
+        PROFILE_END(TX);
+
+        PROFILE_FRAME();
 
         if (warm_sleep_time.isExpired()) {
 
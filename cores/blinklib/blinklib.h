@@ -58,6 +58,54 @@ byte isValueReceivedOnFaceExpired( byte face );
 // Returns false if their has been a neighbor seen recently on any face, returns true otherwise.
 bool isAlone();
 
+// A snapshot of what is going on with all of the faces at once, taken each time through right after the IR packets come
+// in and before loop() is called. Each field has bit f set for face f. Instead of calling the functions above for every
+// face every time, you can check whole fields against 0 and only walk the faces that have something going on...
+//
+//   FaceEvents e = getFaceEvents();
+//   FOREACH_FACE_IN( f , e.changed ) { ... }
+//
+// It does not change during loop(), so marking a datagram read does not clear its bit until next time.
+// Only there if blinklib is compiled with IR_FACE_EVENTS defined, since taking it costs a pass over the faces every time
+// through and 17 bytes of RAM (29 with IR_WIDE_VALUES).
+
+#ifdef IR_FACE_EVENTS
+
+    struct FaceEvents {
+        byte present;       // Faces with a neighbor (the ones where isValueReceivedOnFaceExpired() is false)
+        byte changed;       // Faces where the last value received is different than it was last time through
+        byte appeared;      // Faces with a neighbor now that did not have one last time through
+        byte expired;       // Faces that had a neighbor last time through and do not now
+        byte datagram;      // Faces with a datagram ready
+    };
+
+    FaceEvents getFaceEvents();
+
+    // Like the `changed` field of getFaceEvents(), but only the faces where at least one of `bits` changed in the value.
+    // Handy if you pack a few things into the value and only care about one of them (see FaceValueLayout.h).
+
+    byte getFaceEventsChangedIn( word bits );
+
+#endif
+
+// Neighbor faces let a blink find out how the neighbors are turned compared to it. Every so often a face value
+// goes out with a second byte on it that says which face it came out of. #define IR_NEIGHBOR_FACES to turn this on.
+// Both sides need it for it to work, but a blink without it still gets the face values from one that has it.
+
+#ifdef IR_NEIGHBOR_FACES
+
+    // Which of the neighbor's faces (0-5) is touching this face. Returns FACE_COUNT if there is no neighbor there
+    // or it has not told us yet (that takes one face value after it shows up). Needs nothing from the game.
+
+    byte getNeighborFaceOnFace( byte face );
+
+    // How many faces the neighbor on this face is turned compared to us (0-5), or FACE_COUNT if we do not know.
+    // 0 means it is sitting the same way we are. Their face n points the same way as our face (n - rotation + 6) % 6.
+
+    byte getNeighborRotationOnFace( byte face );
+
+#endif
+
 // Set value that will be continuously broadcast on specified face.
 // Value should be between 0 and IR_DATA_VALUE_MAX inclusive.
 // If a value greater than IR_DATA_VALUE_MAX is specified, IR_DATA_VALUE_MAX will be sent.
@@ -69,45 +117,398 @@ void setValueSentOnFace( byte value , byte face );
 
 void setValueSentOnAllFaces( byte value );
 
+// Wide values go up to 4095 instead of 63, so you can send a few fields at once without packing them into 6 bits
+// or switching to datagrams. They go out the same way as normal values, just with a second byte on the end when the
+// value is over IR_DATA_VALUE_MAX. That makes each of those packets take 33 bit times on the air instead of 23 (including
+// the sync and the BIOS type byte). In blinkcluster with -e on a default build, a link where both sides have wide values
+// swaps about 18% fewer packets, and so gets about 18% fewer values across.
+// A face value packet only has one second byte. In a default build the high bits are the only thing that goes there.
+// With IR_RELIABLE, a pending ACK goes there instead. With IR_NEIGHBOR_FACES, the occasional link info does too. A packet
+// carrying either one has no room for the high bits, so it does not count as a wide value and you get a few less of them.
+// The parity bit still covers every bit of a wide value, so one flipped bit gets the packet thrown out like always.
+// The normal functions above still work. If a wide value over IR_DATA_VALUE_MAX comes in, they just say IR_DATA_VALUE_MAX.
+// Only there if blinklib is compiled with IR_WIDE_VALUES defined (costs 12-24 bytes of RAM). All of the tiles have to have it.
+
+#ifdef IR_WIDE_VALUES
+
+    #define IR_WIDE_VALUE_MAX 4095
+
+    // Between 0 and IR_WIDE_VALUE_MAX inclusive
+
+    word getLastWideValueReceivedOnFace( byte face );
+
+    // If a value greater than IR_WIDE_VALUE_MAX is specified, IR_WIDE_VALUE_MAX will be sent.
+
+    void setWideValueSentOnFace( word value , byte face );
+
+    void setWideValueSentOnAllFaces( word value );
+
+#endif
+
 /* --- Datagram processing */
 
 // A datagram is a set of 1-IR_DATAGRAM_MAX_LEN bytes that are atomically sent over the IR link
 // The datagram is sent immediately on a best efforts basis. If it is not received by the other side then
 // it is lost forever. Each datagram sent is received at most 1 time. Once you have processed a received datagram
-// then you must mark it as read before you can receive the next one on that face. 
+// then you must mark it as read to free up its slot for the next one on that face. 
 
 // Must be smaller than IR_RX_PACKET_SIZE
 
 #define IR_DATAGRAM_LEN 16
 
-// Returns the number of bytes waiting in the data buffer, or 0 if no packet ready.
+// How many received datagrams can wait on each face before new ones get thrown out.
+// Each extra slot costs IR_DATAGRAM_LEN+1 bytes of RAM per face. Define it to something
+// else when compiling blinklib to change it.
+
+#ifndef IR_DATAGRAM_RX_QUEUE_DEPTH
+    #define IR_DATAGRAM_RX_QUEUE_DEPTH 1
+#endif
+
+// Same for datagrams waiting to be sent. They go out in order, one per ping-pong turn.
+
+#ifndef IR_DATAGRAM_TX_QUEUE_DEPTH
+    #define IR_DATAGRAM_TX_QUEUE_DEPTH 1
+#endif
+
+// Datagrams (and broadcasts, transfer fragments, and the rest of the longer packets) go out ahead of the face value,
+// but after IR_VALUE_MAX_SKIPS of them in a row on a face, the face value gets a turn anyway. That way the neighbor's
+// getLastValueReceivedOnFace() does not go stale while we are sending datagrams as fast as we can.
+// Make it bigger to give datagrams more of the link. Compile with IR_STATS to see how long the neighbor really
+// waits between values (IR_STAT_RX_VALUE_GAP_MAX).
+
+#ifndef IR_VALUE_MAX_SKIPS
+    #define IR_VALUE_MAX_SKIPS 3
+#endif
+
+// Compile blinklib with IR_DATAGRAM_ZERO_COPY defined to have getDatagramOnFace() point right into the
+// BIOS receive buffer instead of a copy. Saves RAM, but nothing else can be received on that face until you call
+// markDatagramReadOnFace(), so do that as soon as you can. Only works with one slot.
+
+// Returns the number of bytes in the oldest waiting datagram, or 0 if no packet ready.
 byte getDatagramLengthOnFace( uint8_t face );
 
 // Returns true if a packet is available in the buffer
 boolean isDatagramReadyOnFace( uint8_t face );
 
+// Returns how many datagrams are waiting to be read on this face (at most IR_DATAGRAM_RX_QUEUE_DEPTH)
+byte getDatagramCountOnFace( uint8_t face );
+
  // Returns a pointer to the actual received datagram data
  // This should really be a (void *) so it can be assigned to any pointer type,
  // but in C++ you can not cast a (void *) into something else so it doesn't really work there
  // and I think too ugly to have these functions that are inverses of each other to take/return different types.
  // Thanks, Stroustrup.
+ // Returns NULL if there is no datagram waiting on this face.
 const byte *getDatagramOnFace( uint8_t face );
 
-// Frees up the buffer holding the datagram data. Do this as soon as possible after you have
+// Frees up the buffer holding the oldest datagram. Do this as soon as possible after you have
 // processed the datagram to free up the slot for the next incoming datagram on this face.
-// If a new datagram is recieved on a face before markDatagramReadOnFace() is called then
-// the new datagram is siliently discarded. 
+// If a new datagram is recieved on a face when all IR_DATAGRAM_RX_QUEUE_DEPTH slots are full then
+// the new datagram is discarded. 
+// With IR_DATAGRAM_ZERO_COPY nothing else comes in on the face until you call this, so the face value stays the
+// same until then. Expiry does not wait, so a face can show as expired if you hold the datagram for too long.
 
 void markDatagramReadOnFace( uint8_t face );
 
+// Look at waiting datagrams without marking them read. n=0 is the oldest (same as getDatagramOnFace()),
+// up to getDatagramCountOnFace()-1. If there is no datagram n, the length is 0 and the pointer is NULL.
+
+byte peekDatagramLengthOnFace( byte n , uint8_t face );
+const byte *peekDatagramOnFace( byte n , uint8_t face );
+
+// Returns how many datagrams were thrown out on this face because the slots were all full
+// since the last time you checked. Tops out at 255.
+
+byte getDatagramOverflowCountOnFace( uint8_t face );
+
 // Send a datagram.  
 // Datagram is sent as soon as possible and takes priority over sending a value on face.
-// If you call sendDatagramOnFace() and there is already a pending datagram, the older pending
-// one will be replaced with the new one. 
+// It gets added to the end of the send queue for the face. If there are already IR_DATAGRAM_TX_QUEUE_DEPTH
+// datagrams waiting to go out on that face then the new one is not sent and this returns false,
+// so you can try again later. Returns true if the datagram was queued.
+
+// Note that if the len>IR_DATAGRAM_LEN (or len is 0) then packet will never be sent or recieved (and this returns false)
+
+boolean sendDatagramOnFace(  const void *data, byte len , byte face );
+
+// Returns true if there is room for sendDatagramOnFace() to take another datagram on this face
+
+boolean canSendDatagramOnFace( byte face );
+
+// Send the same datagram out of every face with its bit set in faceMask (bit 0 is face 0), or out of all of them.
+// Instead of a copy in the send queue of each face there is just one shared copy, and the checksum only gets figured once.
+// On each face it keeps its place in line with sendDatagramOnFace(). It goes out after anything that was already waiting
+// there, and anything you send on that face after it waits for it. There is only one shared copy, so this returns false if the last one still has not gone out on all of its faces (or if len is 0 or more than IR_DATAGRAM_LEN).
+// Faces with nobody there are skipped, and so is a face whose neighbor leaves before it gets there.
+// On the other side it is just a datagram.
+// Only there if blinklib is compiled with IR_SHARED_DATAGRAMS defined (costs IR_DATAGRAM_LEN + 10 bytes of RAM).
+
+#ifdef IR_SHARED_DATAGRAMS
+
+    boolean sendDatagramOnFaces( const void *data , byte len , byte faceMask );
+    boolean sendDatagramOnAllFaces( const void *data , byte len );
+
+    // Returns true if sendDatagramOnFaces() would take a new one right now
+
+    boolean canSendDatagramOnFaces();
+
+#endif
+
+// Same as sendDatagramOnFace(), but the neighbor ACKs it and we keep resending it on each of our turns
+// until it does (up to IR_RELIABLE_DATAGRAM_TRIES times). The neighbor throws out any repeats, so it
+// shows up in their getDatagramOnFace() exactly once. It takes up a spot in the send queue until it is ACKed
+// or we give up, and anything queued behind it waits. Uses the same send and receive queues as plain datagrams.
+// Only there if blinklib is compiled with IR_RELIABLE defined (costs about 40 bytes of RAM).
+// Both sides need it. IR_TRANSFERS turns this on too since fragments go out the same way.
+
+#if defined( IR_TRANSFERS ) && !defined( IR_RELIABLE )
+    #define IR_RELIABLE
+#endif
+
+#ifdef IR_RELIABLE
+
+    #ifndef IR_RELIABLE_DATAGRAM_TRIES
+        #define IR_RELIABLE_DATAGRAM_TRIES 10
+    #endif
+
+    boolean sendReliableDatagramOnFace( const void *data, byte len , byte face );
+
+    // Returns how many reliable datagrams on this face we gave up on since the last time you checked. Tops out at 255.
+
+    byte getReliableDatagramFailCountOnFace( byte face );
+
+#endif
+
+/* --- Transfers */
+
+// A transfer moves a buffer bigger than a datagram (up to 64K) to the neighbor on a face. It gets chopped up into
+// fragments that fill up whole IR packets, and each fragment is sent reliably in order, so the other side ends up
+// with an exact copy or the send fails. Fragments only go out when there are no datagrams waiting on that face.
+// Only there if blinklib is compiled with IR_TRANSFERS defined, since the bookkeeping costs about 100 bytes of RAM.
+
+#ifdef IR_TRANSFERS
+
+    #define TRANSFER_IDLE       0   // Never sent anything
+    #define TRANSFER_SENDING    1
+    #define TRANSFER_DONE       2   // Neighbor got all of it
+    #define TRANSFER_FAILED     3   // Neighbor stopped answering, or was not ready to receive it
+
+    // Start sending `len` bytes from `data`. The data is read as it goes out, so do not change it until the
+    // transfer is done or failed. Returns false if there is already a transfer being sent on this face.
+
+    boolean sendTransferOnFace( const void *data , uint16_t len , byte face );
+
+    // TRANSFER_* for the last transfer sent on this face
+
+    byte getTransferSendStatusOnFace( byte face );
+
+    // How many bytes of the transfer the neighbor has gotten so far
+
+    uint16_t getTransferSentOnFace( byte face );
+
+    // Get ready to receive a transfer on this face into `buffer`. A transfer longer than `maxLen` is refused,
+    // which makes it fail on the sending side. Once a transfer is complete, call this again to receive the next one.
+    // Pass NULL to stop receiving.
+
+    void receiveTransferOnFace( void *buffer , uint16_t maxLen , byte face );
+
+    // Total length of the transfer coming in, or 0 if it has not started yet
+
+    uint16_t getTransferLengthOnFace( byte face );
+
+    // How many bytes have come in so far
+
+    uint16_t getTransferReceivedOnFace( byte face );
+
+    boolean isTransferCompleteOnFace( byte face );
+
+#endif
+
+/* --- Broadcasts */
+
+// A broadcast floods a small message out across the whole cluster. Each tile that gets it passes it on out all of its
+// other faces (once, no matter how many neighbors it hears it from) until it has gone `ttl` hops. Handy for the kind of
+// GO/RESOLVE waves that games usually build out of face values.
+// It goes out like a plain datagram, so if a link drops it, the tiles past that link only get it some other way around.
+// Each tile has one outgoing broadcast buffer, so a new broadcast that comes in while we are still passing along the
+// last one is not passed on right then. If another copy of it comes in later once we are free, that one gets passed on.
+// Each broadcast is tagged with a 32-bit fold of the whole serial number of the tile that sent it, so two tiles are very
+// unlikely to get mixed up.
+// Only there if blinklib is compiled with IR_BROADCAST defined (costs about 100 bytes of RAM).
+
+#ifdef IR_BROADCAST
+
+    #define IR_BROADCAST_LEN IR_DATAGRAM_LEN
+
+    // Start a broadcast. `ttl` is how many hops it goes, so 1 is just our neighbors. Returns false if we are still
+    // sending the last one, or len is 0 or more than IR_BROADCAST_LEN.
+
+    boolean sendBroadcast( const void *data , byte len , byte ttl );
 
-// Note that if the len>IR_DATAGRAM_LEN then packet will never be sent or recieved
+    // True if sendBroadcast() would take a new one right now
 
-void sendDatagramOnFace(  const void *data, byte len , byte face );
+    boolean canSendBroadcast();
+
+    // Most recent broadcast we got. Later ones are not saved (but still passed along) until you mark it read.
+    // We never get our own broadcasts back.
+
+    boolean isBroadcastReady();
+    byte getBroadcastLength();
+    const byte *getBroadcast();
+
+    // The face it came in on, and how many hops it took to get here (1 means from the tile that started it)
+
+    byte getBroadcastFace();
+    byte getBroadcastHops();
+
+    // How many ms ago it was started. This adds up the time it waited on each tile along the way, but not time on the air.
+
+    word getBroadcastAge();
+
+    // getBroadcastAge() / getBroadcastHops()
+
+    word getBroadcastHopLatency();
+
+    void markBroadcastRead();
+
+#endif
+
+/* --- Spanning tree */
+
+// Builds a tree over the whole cluster with one tile as the root, and lets the root add things up over every tile in it.
+// Each tile sends a short beacon to its neighbors whenever its place in the tree changes, and the root sends a new
+// wave down about once a second so everyone knows it is still there. Each tile picks the neighbor closest to the root
+// as its parent. When tiles are pulled off, the ones below them pick a new parent on their own. If the root is pulled
+// off, everyone gives up on it after a few seconds.
+// Only there if blinklib is compiled with IR_TREE defined (costs about 100 bytes of RAM).
+
+// IR_LEADER turns this on too, see below
+
+#if defined( IR_LEADER ) && !defined( IR_TREE )
+    #define IR_TREE
+#endif
+
+#ifdef IR_TREE
+
+    // Make this tile a root (or stop). If more than one tile is a root, the one with the lowest serial number
+    // (byte 0 first) wins and the others join its tree.
+
+    void setTreeRoot( boolean root );
+
+    boolean isTreeRoot();
+
+    // True if we are in a tree, including if we are the root
+
+    boolean isInTree();
+
+    // Serial number of the root we are following (or our own if we are the root). Only means anything if isInTree().
+
+    byte getTreeRootSerialNumberByte( byte n );
+
+    // How many hops we are from the root, or TREE_NO_DEPTH if we are not in a tree
+
+    #define TREE_NO_DEPTH 255
+
+    byte getTreeDepth();
+
+    // The face toward the root, or FACE_COUNT if we are the root or not in a tree
+
+    byte getTreeParentFace();
+
+    // True if the neighbor on this face is one of our children in the tree
+
+    boolean isTreeChildOnFace( byte face );
+
+    // Queries. The root starts one, it goes down the tree, and then each tile sends the result for its whole subtree
+    // (its own value plus whatever its children sent) up to its parent once all of its children have answered, so it
+    // takes about two trips across the cluster. TREE_COUNT ignores the values and counts tiles.
+    // A byte value works just as well as a word. Sums are 32 bits so they do not overflow.
+    // If the tree changes while a query is going, tiles that moved can get missed or counted twice, so ask again if that matters.
+
+    #define TREE_COUNT  0
+    #define TREE_SUM    1
+    #define TREE_MIN    2
+    #define TREE_MAX    3
+
+    // This tile's value for queries
+
+    void setTreeValue( word value );
+
+    // Start a new query. Only works on the root. Returns false if we are not the root.
+
+    boolean startTreeQuery( byte op );
+
+    // True on the root once the answer is in for the last query
+
+    boolean isTreeQueryDone();
+
+    unsigned long getTreeQueryResult();
+
+#endif
+
+/* --- Leader election */
+
+// Picks exactly one tile in each connected cluster to be the leader: the one with the lowest serial number (byte 0
+// first). This is the tree above with every tile as a candidate root, so each tile only ever compares the best serial
+// number it knows of against the one its neighbors tell it about, and the winner spreads out one hop at a time. Takes
+// about one trip across the cluster. If the leader is pulled off, everyone notices after a few seconds and the next
+// lowest takes over. Nothing blocks, just check from loop().
+// Only there if blinklib is compiled with IR_LEADER defined. The tree queries work too, with the leader as the root.
+
+#ifdef IR_LEADER
+
+    boolean isLeader();
+
+    // True once we have had the same leader for a couple of seconds. Before that, the one we know about
+    // might just be the best one that has reached us so far.
+
+    boolean isLeaderSettled();
+
+    // Serial number of the leader (our own if we are the leader)
+
+    byte getLeaderSerialNumberByte( byte n );
+
+    // The face toward the leader, or FACE_COUNT if we are the leader
+
+    byte getLeaderFace();
+
+    // Hops to the leader
+
+    byte getLeaderDistance();
+
+#endif
+
+/* --- IR link statistics */
+
+// Per-face counters for how the IR link is doing. Only kept if blinklib is compiled with IR_STATS
+// defined (they cost 180 bytes of RAM), otherwise getIRStatOnFace() always returns 0.
+// It also returns 0 for a stat that is not one of the IR_STAT_* below.
+// Counters wrap at 65535, so read them often or clear them if you care.
+
+#define IR_STAT_RX_PACKETS              0   // Packets we got from the BIOS, good or bad
+#define IR_STAT_RX_VALUES               1   // Face values received
+#define IR_STAT_RX_DATAGRAMS            2   // Datagrams received and put into the buffer
+#define IR_STAT_RX_PARITY_ERRORS        3   // Packets thrown out because the header byte failed the parity check
+#define IR_STAT_RX_CHECKSUM_ERRORS      4   // Datagrams thrown out because the checksum did not match
+#define IR_STAT_RX_DATAGRAMS_DROPPED    5   // Good datagrams thrown out because all the receive slots were full (or too long)
+#define IR_STAT_TX_DATAGRAMS_REJECTED   6   // Datagrams sendDatagramOnFace() turned away because the send queue was full
+#define IR_STAT_TX_ATTEMPTS             7   // Times we tried to send a packet
+#define IR_STAT_TX_REFUSED              8   // ...and the BIOS would not because something was coming in on that face
+#define IR_STAT_RX_DUPLICATES           9   // Reliable datagrams we already had, so thrown out (and ACKed again)
+#define IR_STAT_TX_RELIABLE_RETRIES     10  // Times we sent a reliable datagram again because no ACK came back
+#define IR_STAT_TX_RELIABLE_FAILED      11  // Reliable datagrams we gave up on
+#define IR_STAT_TX_PROBES               12  // Packets sent on a face with no neighbor there
+#define IR_STAT_TX_DEFERRED             13  // Times we did not even try to send because something was coming in on that face (IR_LISTEN_BEFORE_TALK)
+#define IR_STAT_TX_BACKOFFS             14  // Times we waited a random bit after a deferred or refused send (IR_LISTEN_BEFORE_TALK)
+#define IR_STAT_RX_VALUE_GAP_MAX        15  // Not a count. Longest we went between face values (in ms, tops out at 65535) since the neighbor showed up
+
+#define IR_STAT_COUNT                   16
+
+word getIRStatOnFace( byte stat , byte face );
+
+// Reset all of the counters on a face back to 0
+
+void clearIRStatsOnFace( byte face );
 
 
 /*
@@ -262,6 +663,18 @@ void setFaceColor(  byte face, Color newColor );
 
 unsigned long millis(void);
 
+// Cluster time. Tiles compiled with IR_TIME_SYNC swap time stamps with their neighbors every 100ms and all move
+// their clocks up to match whoever is furthest ahead, so every tile in a connected cluster ends up on the same clock
+// (to within a few ms per hop). Use it for effects that have to line up across tiles.
+// It only ever goes forward, but it can jump ahead when we first hear from a neighbor that is further along.
+// A tile that is alone just runs on its own millis().
+
+#ifdef IR_TIME_SYNC
+
+    unsigned long clusterMillis(void);
+
+#endif
+
 class Timer {
 
 	private:
@@ -284,6 +697,35 @@ class Timer {
 
 };
 
+#ifdef IR_TIME_SYNC
+
+    // Just like Timer, but runs on clusterMillis(). Since everyone agrees on cluster time, tiles that setAt()
+    // the same time will all expire together.
+
+    class ClusterTimer {
+
+        private:
+
+            uint32_t m_expireTime;
+
+        public:
+
+            ClusterTimer() {};
+
+            bool isExpired();
+
+            uint32_t getRemaining();
+
+            void set( uint32_t ms );            // Expire ms milliseconds from now
+
+            void setAt( uint32_t clusterTime ); // Expire when clusterMillis() gets past this
+
+            void never(void);
+
+    };
+
+#endif
+
 
 /*
 
@@ -404,6 +846,10 @@ void loop();
 // TODO: Yuck, gcc expands this loop index to a word, which costs a load, a compare, and a multiply. :/
 #define FOREACH_FACE(x) for(uint8_t x = 0; x < FACE_COUNT ; ++ x)       // Pretend this is a real language with iterators
 
+// Same, but only the faces with their bit set in `mask` (like the fields of getFaceEvents()). Stops once there are no more bits.
+// Ends in a whole if/else so an `else` after it goes with your own `if`, not with the one in here.
+#define FOREACH_FACE_IN(x,mask) for(uint8_t x = 0 , x##_left = (mask) ; x##_left ; x##_left >>= 1 , ++ x ) if ( !( x##_left & 1 ) ) {} else
+
 // Get the number of elements in an array.
 #define COUNT_OF(x) ((sizeof(x)/sizeof(x[0])))
 
@@ -295,9 +295,17 @@ void communicationReceiverLoop() {
     if (isDatagramReadyOnFace(masterFace)) {//is there a packet?
       if (getDatagramLengthOnFace(masterFace) == 6) {//is it the right length?
         byte *data = (byte *) getDatagramOnFace(masterFace);//grab the data
+        //the colors are in the master's face order, so turn them to match how we are sitting next to it
+        byte rotation = 0;
+#ifdef IR_NEIGHBOR_FACES
+        rotation = getNeighborRotationOnFace(masterFace);
+        if (rotation == FACE_COUNT) {//master has not told us yet, so keep its order
+          rotation = 0;
+        }
+#endif
         //fill our array with this data
         FOREACH_FACE(f) {
-          faceColors[f] = data[f];
+          faceColors[(f + 6 - rotation) % 6] = data[f];
         }
         //let them know we heard them
         gameMode = PACKETRECEIVED;
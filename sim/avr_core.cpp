@@ -0,0 +1,2207 @@
+/*
+ * avr_core.cpp
+ *
+ * The ATmega168PB emulator. See avr_core.h for the big picture.
+ *
+ * Time is kept three ways...
+ *
+ *   ticks      Real time in periods of the undivided 8MHz RC oscillator. Keeps going in sleep. The WDT runs off this.
+ *   io_clock   clk_IO after the CLKPR prescaler. Stops in power down. The timers, ADC, and USART run off this.
+ *   cycles     CPU cycles actually executed. Stops in any sleep. This is what you want for profiling.
+ *
+ * Peripherals are lazy. We only bring a timer up to date when someone looks at it or when it is due to
+ * set a flag, so in the normal case the per-instruction overhead is a single compare.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "avr_core.h"
+
+#define NEVER   UINT64_MAX
+
+// SREG bits
+
+#define SREG_C  0
+#define SREG_Z  1
+#define SREG_N  2
+#define SREG_V  3
+#define SREG_S  4
+#define SREG_H  5
+#define SREG_T  6
+#define SREG_I  7
+
+#define SREG    avr->data[ AVR_SREG ]
+#define R       avr->data             // Registers r0-r31 are the first 32 bytes of data space
+
+// --- Instruction decoding
+
+enum {
+    OP_BAD = 0,
+    OP_NOP, OP_MOVW, OP_MULS, OP_MULSU, OP_FMUL, OP_FMULS, OP_FMULSU,
+    OP_CPC, OP_SBC, OP_ADD, OP_CPSE, OP_CP, OP_SUB, OP_ADC, OP_AND, OP_EOR, OP_OR, OP_MOV,
+    OP_CPI, OP_SBCI, OP_SUBI, OP_ORI, OP_ANDI,
+    OP_LDD_Y, OP_LDD_Z, OP_STD_Y, OP_STD_Z,
+    OP_LDS, OP_STS,
+    OP_LD_ZP, OP_LD_MZ, OP_LD_YP, OP_LD_MY, OP_LD_X, OP_LD_XP, OP_LD_MX,
+    OP_ST_ZP, OP_ST_MZ, OP_ST_YP, OP_ST_MY, OP_ST_X, OP_ST_XP, OP_ST_MX,
+    OP_LPM_Z, OP_LPM_ZP, OP_LPM_R0,
+    OP_POP, OP_PUSH,
+    OP_COM, OP_NEG, OP_SWAP, OP_INC, OP_ASR, OP_LSR, OP_ROR, OP_DEC,
+    OP_BSET, OP_BCLR,
+    OP_RET, OP_RETI, OP_SLEEP, OP_BREAK, OP_WDR, OP_SPM,
+    OP_IJMP, OP_ICALL, OP_JMP, OP_CALL,
+    OP_ADIW, OP_SBIW,
+    OP_CBI, OP_SBIC, OP_SBI, OP_SBIS,
+    OP_MUL, OP_IN, OP_OUT,
+    OP_RJMP, OP_RCALL, OP_LDI,
+    OP_BRBS, OP_BRBC, OP_BLD, OP_BST, OP_SBRC, OP_SBRS,
+};
+
+static uint16_t flash_word( const avr_t *avr , uint16_t word ) {
+
+    uint16_t addr = ( word * 2 ) & ( AVR_FLASH_SIZE - 1 );
+    return avr->flash[ addr ] | ( avr->flash[ addr + 1 ] << 8 );
+
+}
+
+static void decode( avr_t *avr , uint16_t word ) {
+
+    avr_t::op_t *op = &avr->ops[ word ];
+
+    uint16_t x = flash_word( avr , word );
+    uint16_t next = flash_word( avr , word + 1 );
+
+    uint8_t d5 = ( x >> 4 ) & 0x1f;                         // Rd in most 2 register ops
+    uint8_t r5 = ( ( x >> 5 ) & 0x10 ) | ( x & 0x0f );      // Rr in most 2 register ops
+    uint8_t d4 = 16 + ( ( x >> 4 ) & 0x0f );                // Rd in immediate ops (r16-r31)
+    uint8_t k8 = ( ( x >> 4 ) & 0xf0 ) | ( x & 0x0f );      // 8 bit immediate
+    uint8_t q6 = ( ( x >> 8 ) & 0x20 ) | ( ( x >> 7 ) & 0x18 ) | ( x & 0x07 );    // LDD/STD displacement
+
+    op->kind = OP_BAD;
+    op->a = d5;
+    op->b = r5;
+    op->k = 0;
+
+    switch ( x >> 12 ) {
+
+        case 0x0:
+
+            if ( x == 0x0000 ) {
+                op->kind = OP_NOP;
+            } else if ( ( x & 0xff00 ) == 0x0100 ) {
+                op->kind = OP_MOVW;
+                op->a = ( ( x >> 4 ) & 0x0f ) * 2;
+                op->b = ( x & 0x0f ) * 2;
+            } else if ( ( x & 0xff00 ) == 0x0200 ) {
+                op->kind = OP_MULS;
+                op->a = 16 + ( ( x >> 4 ) & 0x0f );
+                op->b = 16 + ( x & 0x0f );
+            } else if ( ( x & 0xff00 ) == 0x0300 ) {
+                op->a = 16 + ( ( x >> 4 ) & 0x07 );
+                op->b = 16 + ( x & 0x07 );
+                switch ( x & 0x88 ) {
+                    case 0x00: op->kind = OP_MULSU; break;
+                    case 0x08: op->kind = OP_FMUL; break;
+                    case 0x80: op->kind = OP_FMULS; break;
+                    case 0x88: op->kind = OP_FMULSU; break;
+                }
+            } else {
+                static const uint8_t kinds[] = { 0 , OP_CPC , OP_SBC , OP_ADD };
+                op->kind = kinds[ ( x >> 10 ) & 3 ];
+            }
+            break;
+
+        case 0x1: {
+            static const uint8_t kinds[] = { OP_CPSE , OP_CP , OP_SUB , OP_ADC };
+            op->kind = kinds[ ( x >> 10 ) & 3 ];
+            break;
+        }
+
+        case 0x2: {
+            static const uint8_t kinds[] = { OP_AND , OP_EOR , OP_OR , OP_MOV };
+            op->kind = kinds[ ( x >> 10 ) & 3 ];
+            break;
+        }
+
+        case 0x3: op->kind = OP_CPI;  op->a = d4; op->k = k8; break;
+        case 0x4: op->kind = OP_SBCI; op->a = d4; op->k = k8; break;
+        case 0x5: op->kind = OP_SUBI; op->a = d4; op->k = k8; break;
+        case 0x6: op->kind = OP_ORI;  op->a = d4; op->k = k8; break;
+        case 0x7: op->kind = OP_ANDI; op->a = d4; op->k = k8; break;
+
+        case 0x8:
+        case 0xa:
+
+            op->k = q6;
+
+            if ( x & 0x0200 ) {
+                op->kind = ( x & 0x0008 ) ? OP_STD_Y : OP_STD_Z;
+            } else {
+                op->kind = ( x & 0x0008 ) ? OP_LDD_Y : OP_LDD_Z;
+            }
+            break;
+
+        case 0x9:
+
+            if ( ( x & 0xfe00 ) == 0x9000 || ( x & 0xfe00 ) == 0x9200 ) {
+
+                uint8_t store = ( x & 0x0200 ) != 0;
+
+                switch ( x & 0x000f ) {
+                    case 0x0: op->kind = store ? OP_STS   : OP_LDS;    op->k = next; break;
+                    case 0x1: op->kind = store ? OP_ST_ZP : OP_LD_ZP;  break;
+                    case 0x2: op->kind = store ? OP_ST_MZ : OP_LD_MZ;  break;
+                    case 0x4: op->kind = store ? OP_BAD   : OP_LPM_Z;  break;
+                    case 0x5: op->kind = store ? OP_BAD   : OP_LPM_ZP; break;
+                    case 0x9: op->kind = store ? OP_ST_YP : OP_LD_YP;  break;
+                    case 0xa: op->kind = store ? OP_ST_MY : OP_LD_MY;  break;
+                    case 0xc: op->kind = store ? OP_ST_X  : OP_LD_X;   break;
+                    case 0xd: op->kind = store ? OP_ST_XP : OP_LD_XP;  break;
+                    case 0xe: op->kind = store ? OP_ST_MX : OP_LD_MX;  break;
+                    case 0xf: op->kind = store ? OP_PUSH  : OP_POP;    break;
+                    default:  op->kind = OP_BAD;                       break;     // ELPM, XCH, LAS and friends are not on the 168
+                }
+
+            } else if ( ( x & 0xfe08 ) == 0x9400 ) {
+
+                static const uint8_t kinds[] = { OP_COM , OP_NEG , OP_SWAP , OP_INC , OP_BAD , OP_ASR , OP_LSR , OP_ROR };
+                op->kind = kinds[ x & 0x07 ];
+
+            } else if ( ( x & 0xff0f ) == 0x9408 ) {
+
+                op->kind = ( x & 0x0080 ) ? OP_BCLR : OP_BSET;
+                op->a = ( x >> 4 ) & 0x07;
+
+            } else if ( ( x & 0xfe0f ) == 0x940a ) {
+
+                op->kind = OP_DEC;
+
+            } else if ( ( x & 0xfe0e ) == 0x940c || ( x & 0xfe0e ) == 0x940e ) {
+
+                op->kind = ( x & 0x0002 ) ? OP_CALL : OP_JMP;
+                op->k = next;       // The top bits of the 22 bit address are always 0 on a 16K part
+
+            } else {
+
+                switch ( x ) {
+                    case 0x9508: op->kind = OP_RET;    break;
+                    case 0x9518: op->kind = OP_RETI;   break;
+                    case 0x9588: op->kind = OP_SLEEP;  break;
+                    case 0x9598: op->kind = OP_BREAK;  break;
+                    case 0x95a8: op->kind = OP_WDR;    break;
+                    case 0x95c8: op->kind = OP_LPM_R0; break;
+                    case 0x95e8: op->kind = OP_SPM;    break;
+                    case 0x9409: op->kind = OP_IJMP;   break;
+                    case 0x9509: op->kind = OP_ICALL;  break;
+                    default:
+
+                        if ( ( x & 0xff00 ) == 0x9600 || ( x & 0xff00 ) == 0x9700 ) {
+
+                            op->kind = ( x & 0x0100 ) ? OP_SBIW : OP_ADIW;
+                            op->a = 24 + ( ( x >> 3 ) & 0x06 );
+                            op->k = ( ( x >> 2 ) & 0x30 ) | ( x & 0x0f );
+
+                        } else if ( ( x & 0xfc00 ) == 0x9800 ) {
+
+                            static const uint8_t kinds[] = { OP_CBI , OP_SBIC , OP_SBI , OP_SBIS };
+                            op->kind = kinds[ ( x >> 8 ) & 3 ];
+                            op->a = 0x20 + ( ( x >> 3 ) & 0x1f );       // Data space address
+                            op->b = x & 0x07;
+
+                        } else if ( ( x & 0xfc00 ) == 0x9c00 ) {
+
+                            op->kind = OP_MUL;
+
+                        }
+                        break;
+                }
+
+            }
+            break;
+
+        case 0xb:
+
+            op->kind = ( x & 0x0800 ) ? OP_OUT : OP_IN;
+            op->k = 0x20 + ( ( ( x >> 5 ) & 0x30 ) | ( x & 0x0f ) );    // Data space address
+            break;
+
+        case 0xc:
+        case 0xd: {
+
+            int16_t k = x & 0x0fff;
+            if ( k & 0x0800 ) k -= 0x1000;
+
+            op->kind = ( x & 0x1000 ) ? OP_RCALL : OP_RJMP;
+            op->k = (uint16_t) k;
+            break;
+        }
+
+        case 0xe: op->kind = OP_LDI; op->a = d4; op->k = k8; break;
+
+        case 0xf:
+
+            if ( ( x & 0xf800 ) == 0xf000 ) {
+
+                int16_t k = ( x >> 3 ) & 0x7f;
+                if ( k & 0x40 ) k -= 0x80;
+
+                op->kind = ( x & 0x0400 ) ? OP_BRBC : OP_BRBS;
+                op->b = x & 0x07;
+                op->k = (uint16_t) k;
+
+            } else if ( ( x & 0xfe08 ) == 0xf800 ) {
+
+                op->kind = OP_BLD;
+                op->b = x & 0x07;
+
+            } else if ( ( x & 0xfe08 ) == 0xfa00 ) {
+
+                op->kind = OP_BST;
+                op->b = x & 0x07;
+
+            } else if ( ( x & 0xfc08 ) == 0xfc00 ) {
+
+                op->kind = ( x & 0x0200 ) ? OP_SBRS : OP_SBRC;
+                op->b = x & 0x07;
+
+            }
+            break;
+
+    }
+
+}
+
+void avr_flash_changed( avr_t *avr , uint16_t addr , uint16_t len ) {
+
+    // Changing a word can also change how the word before it decodes (the second word of a 2 word instruction)
+
+    uint16_t first = addr / 2;
+    uint16_t last = ( addr + len + 1 ) / 2;
+
+    if ( first ) first--;
+
+    for( uint16_t w = first ; w < last && w < AVR_FLASH_SIZE / 2 ; w++ ) {
+        decode( avr , w );
+    }
+
+}
+
+static uint8_t is_two_words( const avr_t *avr , uint16_t word ) {
+
+    uint8_t kind = avr->ops[ word & ( AVR_FLASH_SIZE / 2 - 1 ) ].kind;
+    return kind == OP_LDS || kind == OP_STS || kind == OP_JMP || kind == OP_CALL;
+
+}
+
+// --- Timers
+
+// Where each timer keeps its registers
+
+struct timer_regs_t {
+    uint8_t tccra, tccrb, tcnt, ocra, ocrb, tifr, timsk;
+    uint8_t wide;
+};
+
+static const timer_regs_t timer_regs[3] = {
+    { AVR_TCCR0A , AVR_TCCR0B , AVR_TCNT0  , AVR_OCR0A  , AVR_OCR0B  , AVR_TIFR0 , AVR_TIMSK0 , 0 } ,
+    { AVR_TCCR1A , AVR_TCCR1B , AVR_TCNT1L , AVR_OCR1AL , AVR_OCR1BL , AVR_TIFR1 , AVR_TIMSK1 , 1 } ,
+    { AVR_TCCR2A , AVR_TCCR2B , AVR_TCNT2  , AVR_OCR2A  , AVR_OCR2B  , AVR_TIFR2 , AVR_TIMSK2 , 0 } ,
+};
+
+// TIFR/TIMSK bits, same for all three
+
+#define TOV     0
+#define OCFA    1
+#define OCFB    2
+#define ICF     5
+
+#define GTCCR_TSM       7
+#define GTCCR_PSRASY    1
+#define GTCCR_PSRSYNC   0
+
+static uint16_t reg16( const avr_t *avr , uint8_t addr ) {
+    return avr->data[ addr ] | ( avr->data[ addr + 1 ] << 8 );
+}
+
+static uint16_t timer_count( const avr_t *avr , uint8_t n ) {
+    const timer_regs_t *r = &timer_regs[n];
+    return r->wide ? reg16( avr , r->tcnt ) : avr->data[ r->tcnt ];
+}
+
+static void set_timer_count( avr_t *avr , uint8_t n , uint16_t v ) {
+
+    const timer_regs_t *r = &timer_regs[n];
+
+    avr->data[ r->tcnt ] = (uint8_t) v;
+
+    if ( r->wide ) {
+        avr->data[ r->tcnt + 1 ] = v >> 8;
+    }
+
+}
+
+static uint16_t timer_prescale( const avr_t *avr , uint8_t n ) {
+
+    uint8_t cs = avr->data[ timer_regs[n].tccrb ] & 0x07;
+
+    uint8_t gtccr = avr->data[ AVR_GTCCR ];
+
+    if ( gtccr & _BV_( GTCCR_TSM ) ) {
+
+        // Timer sync mode holds the prescaler in reset
+
+        if ( n == 2 && ( gtccr & _BV_( GTCCR_PSRASY ) ) ) return 0;
+        if ( n != 2 && ( gtccr & _BV_( GTCCR_PSRSYNC ) ) ) return 0;
+
+    }
+
+    if ( n == 2 ) {
+        static const uint16_t div2[8] = { 0 , 1 , 8 , 32 , 64 , 128 , 256 , 1024 };
+        return div2[ cs ];
+    }
+
+    static const uint16_t div[8] = { 0 , 1 , 8 , 64 , 256 , 1024 , 0 , 0 };       // We do not do external clocks on T0/T1
+    return div[ cs ];
+
+}
+
+// Waveform generation modes, boiled down to what we need to count
+
+#define WAVE_NORMAL     0
+#define WAVE_CTC        1
+#define WAVE_FAST       2
+#define WAVE_PHASE      3
+
+static void timer_mode( const avr_t *avr , uint8_t n , uint8_t *wave , uint16_t *top ) {
+
+    const timer_regs_t *r = &timer_regs[n];
+
+    uint8_t a = avr->data[ r->tccra ];
+    uint8_t b = avr->data[ r->tccrb ];
+
+    if ( !r->wide ) {
+
+        uint8_t wgm = ( a & 0x03 ) | ( ( b >> 1 ) & 0x04 );
+        uint16_t ocra = avr->timer[n].ocr[0];
+
+        switch ( wgm ) {
+            case 1:  *wave = WAVE_PHASE;  *top = 0xff; break;
+            case 2:  *wave = WAVE_CTC;    *top = ocra; break;
+            case 3:  *wave = WAVE_FAST;   *top = 0xff; break;
+            case 5:  *wave = WAVE_PHASE;  *top = ocra; break;
+            case 7:  *wave = WAVE_FAST;   *top = ocra; break;
+            default: *wave = WAVE_NORMAL; *top = 0xff; break;
+        }
+
+        return;
+    }
+
+    uint8_t wgm = ( a & 0x03 ) | ( ( b >> 1 ) & 0x0c );
+    uint16_t ocra = avr->timer[n].ocr[0];
+    uint16_t icr = reg16( avr , AVR_ICR1L );
+
+    switch ( wgm ) {
+        case 1:  *wave = WAVE_PHASE;  *top = 0x00ff; break;
+        case 2:  *wave = WAVE_PHASE;  *top = 0x01ff; break;
+        case 3:  *wave = WAVE_PHASE;  *top = 0x03ff; break;
+        case 4:  *wave = WAVE_CTC;    *top = ocra;   break;
+        case 5:  *wave = WAVE_FAST;   *top = 0x00ff; break;
+        case 6:  *wave = WAVE_FAST;   *top = 0x01ff; break;
+        case 7:  *wave = WAVE_FAST;   *top = 0x03ff; break;
+        case 8:  *wave = WAVE_PHASE;  *top = icr;    break;
+        case 9:  *wave = WAVE_PHASE;  *top = ocra;   break;
+        case 10: *wave = WAVE_PHASE;  *top = icr;    break;
+        case 11: *wave = WAVE_PHASE;  *top = ocra;   break;
+        case 12: *wave = WAVE_CTC;    *top = icr;    break;
+        case 14: *wave = WAVE_FAST;   *top = icr;    break;
+        case 15: *wave = WAVE_FAST;   *top = ocra;   break;
+        default: *wave = WAVE_NORMAL; *top = 0xffff; break;
+    }
+
+}
+
+// In the PWM modes, writes to OCR go into a buffer that only gets picked up at TOP (or BOTTOM)
+
+static void timer_update_ocr( avr_t *avr , uint8_t n ) {
+
+    const timer_regs_t *r = &timer_regs[n];
+
+    if ( r->wide ) {
+        avr->timer[n].ocr[0] = reg16( avr , r->ocra );
+        avr->timer[n].ocr[1] = reg16( avr , r->ocrb );
+    } else {
+        avr->timer[n].ocr[0] = avr->data[ r->ocra ];
+        avr->timer[n].ocr[1] = avr->data[ r->ocrb ];
+    }
+
+}
+
+// How many timer clocks until the count hits something that could set a flag. Always at least 1.
+
+static uint32_t timer_distance( const avr_t *avr , uint8_t n , uint16_t top ) {
+
+    const avr_timer_t *t = &avr->timer[n];
+
+    uint16_t cnt = timer_count( avr , n );
+    uint16_t max = timer_regs[n].wide ? 0xffff : 0xff;
+
+    uint32_t best;
+
+    if ( t->down ) {
+
+        best = cnt ? cnt : 1;
+
+        for( uint8_t i=0; i < 2 ; i++ ) {
+            if ( t->ocr[i] < cnt && (uint32_t) ( cnt - t->ocr[i] ) < best ) best = cnt - t->ocr[i];
+        }
+
+        return best;
+    }
+
+    // Counting up. Past TOP (someone wrote TCNT) we just run to MAX and wrap.
+
+    uint16_t end = ( cnt > top ) ? max : top;
+
+    best = (uint32_t) ( end - cnt ) + 1;
+
+    for( uint8_t i=0; i < 2 ; i++ ) {
+        if ( t->ocr[i] > cnt && t->ocr[i] <= end && (uint32_t) ( t->ocr[i] - cnt ) < best ) best = t->ocr[i] - cnt;
+    }
+
+    return best;
+
+}
+
+static void timer_flag( avr_t *avr , uint8_t n , uint8_t bit ) {
+
+    avr->data[ timer_regs[n].tifr ] |= _BV_( bit );
+    avr->irq_dirty = 1;
+
+}
+
+// One clock of the timer, with all the flags that go with it
+
+static void timer_clock( avr_t *avr , uint8_t n , uint8_t wave , uint16_t top ) {
+
+    avr_timer_t *t = &avr->timer[n];
+
+    uint16_t cnt = timer_count( avr , n );
+    uint16_t max = timer_regs[n].wide ? 0xffff : 0xff;
+
+    if ( t->down ) {
+
+        if ( cnt == 0 ) {
+            t->down = 0;
+            cnt = 1;
+        } else {
+            cnt--;
+        }
+
+        if ( cnt == 0 ) {
+            timer_flag( avr , n , TOV );
+            timer_update_ocr( avr , n );        // Phase and frequency correct updates at BOTTOM. Close enough for the rest.
+        }
+
+    } else if ( cnt == top && wave != WAVE_NORMAL ) {
+
+        if ( wave == WAVE_PHASE ) {
+
+            t->down = 1;
+            cnt = top ? top - 1 : 0;
+            timer_update_ocr( avr , n );
+
+        } else {
+
+            cnt = 0;
+
+            if ( wave == WAVE_FAST ) {
+                timer_flag( avr , n , TOV );
+                timer_update_ocr( avr , n );
+            }
+
+            if ( wave == WAVE_CTC && n == 1 && ( ( avr->data[ AVR_TCCR1B ] >> 3 ) & 0x03 ) == 3 ) {
+                timer_flag( avr , n , ICF );    // CTC with TOP=ICR1 sets ICF1 at TOP
+            }
+
+        }
+
+    } else if ( cnt == max ) {
+
+        cnt = 0;
+        timer_flag( avr , n , TOV );
+
+    } else {
+
+        cnt++;
+
+    }
+
+    set_timer_count( avr , n , cnt );
+
+    if ( cnt == t->ocr[0] ) timer_flag( avr , n , OCFA );
+    if ( cnt == t->ocr[1] ) timer_flag( avr , n , OCFB );
+
+}
+
+// Bring timer `n` up to io_clock and work out when it next needs attention
+
+static void sync_timer( avr_t *avr , uint8_t n ) {
+
+    avr_timer_t *t = &avr->timer[n];
+
+    uint64_t elapsed = avr->io_clock - t->last_io;
+    t->last_io = avr->io_clock;
+
+    uint16_t div = timer_prescale( avr , n );
+
+    if ( !div ) {
+        t->next_io = NEVER;
+        return;
+    }
+
+    uint8_t wave;
+    uint16_t top;
+
+    uint64_t total = t->prescale_count + elapsed;
+    uint64_t clocks = total / div;
+    t->prescale_count = total % div;
+
+    while ( clocks ) {
+
+        timer_mode( avr , n , &wave , &top );
+
+        uint32_t d = timer_distance( avr , n , top );
+
+        if ( clocks < d ) {
+
+            // Nothing happens along the way, so just jump ahead
+
+            uint16_t cnt = timer_count( avr , n );
+            set_timer_count( avr , n , t->down ? cnt - clocks : cnt + clocks );
+            break;
+
+        }
+
+        uint16_t cnt = timer_count( avr , n );
+        set_timer_count( avr , n , t->down ? cnt - ( d - 1 ) : cnt + ( d - 1 ) );
+
+        timer_clock( avr , n , wave , top );
+
+        clocks -= d;
+
+    }
+
+    timer_mode( avr , n , &wave , &top );
+
+    t->next_io = avr->io_clock + (uint64_t) timer_distance( avr , n , top ) * div - t->prescale_count;
+
+}
+
+void avr_sync_timers( avr_t *avr ) {
+
+    for( uint8_t n=0; n < 3 ; n++ ) {
+        sync_timer( avr , n );
+    }
+
+}
+
+// --- Everything else that runs in the background
+
+#define WDTCSR_WDIF     7
+#define WDTCSR_WDIE     6
+#define WDTCSR_WDP3     5
+#define WDTCSR_WDCE     4
+#define WDTCSR_WDE      3
+
+#define WDT_BASE_TICKS  128000      // 2K cycles of the 128KHz oscillator, in 8MHz ticks
+
+static uint64_t wdt_period( const avr_t *avr ) {
+
+    uint8_t w = avr->data[ AVR_WDTCSR ];
+    uint8_t wdp = ( ( w >> 2 ) & 0x08 ) | ( w & 0x07 );
+
+    if ( wdp > 9 ) wdp = 9;
+
+    return (uint64_t) ( WDT_BASE_TICKS * avr->wdt_scale ) << wdp;
+
+}
+
+static void restart_wdt( avr_t *avr ) {
+
+    if ( avr->data[ AVR_WDTCSR ] & ( _BV_( WDTCSR_WDIE ) | _BV_( WDTCSR_WDE ) ) ) {
+        avr->wdt_due = avr->ticks + wdt_period( avr );
+    } else {
+        avr->wdt_due = NEVER;
+    }
+
+}
+
+#define ADCSRA_ADEN     7
+#define ADCSRA_ADSC     6
+#define ADCSRA_ADIF     4
+#define ADCSRA_ADIE     3
+#define ADMUX_ADLAR     5
+
+#define UCSR0A_RXC      7
+#define UCSR0A_TXC      6
+#define UCSR0A_UDRE     5
+#define UCSR0A_U2X      1
+#define UCSR0B_RXCIE    7
+#define UCSR0B_TXCIE    6
+#define UCSR0B_UDRIE    5
+#define UCSR0B_TXEN     3
+
+static void update_next_event( avr_t *avr ) {
+
+    uint64_t next = avr->adc_due;
+
+    if ( avr->usart_due < next ) next = avr->usart_due;
+
+    for( uint8_t n=0; n < 3 ; n++ ) {
+        if ( avr->timer[n].next_io < next ) next = avr->timer[n].next_io;
+    }
+
+    avr->next_io_event = next;
+
+}
+
+static uint32_t usart_frame_clocks( const avr_t *avr ) {
+
+    uint16_t ubrr = reg16( avr , AVR_UBRR0L ) & 0x0fff;
+    uint8_t per_bit = ( avr->data[ AVR_UCSR0A ] & _BV_( UCSR0A_U2X ) ) ? 8 : 16;
+
+    return 10UL * per_bit * ( ubrr + 1 );       // start + 8 data + stop
+
+}
+
+static void usart_start( avr_t *avr , uint8_t b ) {
+
+    avr->usart_shift = b;
+    avr->usart_due = avr->io_clock + usart_frame_clocks( avr );
+
+}
+
+static void do_reset( avr_t *avr , uint8_t reason );
+
+static void service_peripherals( avr_t *avr ) {
+
+    avr_sync_timers( avr );
+
+    if ( avr->io_clock >= avr->adc_due ) {
+
+        uint16_t v = avr->adc_value & 0x03ff;
+
+        if ( avr->data[ AVR_ADMUX ] & _BV_( ADMUX_ADLAR ) ) v <<= 6;
+
+        avr->data[ AVR_ADCL ] = (uint8_t) v;
+        avr->data[ AVR_ADCH ] = v >> 8;
+
+        avr->data[ AVR_ADCSRA ] &= ~_BV_( ADCSRA_ADSC );
+        avr->data[ AVR_ADCSRA ] |= _BV_( ADCSRA_ADIF );
+
+        avr->adc_due = NEVER;
+        avr->irq_dirty = 1;
+
+    }
+
+    if ( avr->io_clock >= avr->usart_due ) {
+
+        if ( avr->hooks.serial_tx ) {
+            avr->hooks.serial_tx( avr->hooks.ctx , avr , avr->usart_shift );
+        }
+
+        avr->usart_due = NEVER;
+
+        if ( !( avr->data[ AVR_UCSR0A ] & _BV_( UCSR0A_UDRE ) ) ) {
+
+            // Next byte was waiting in UDR
+
+            usart_start( avr , avr->usart_pending );
+            avr->data[ AVR_UCSR0A ] |= _BV_( UCSR0A_UDRE );
+
+        } else {
+
+            avr->data[ AVR_UCSR0A ] |= _BV_( UCSR0A_TXC );
+
+        }
+
+        avr->irq_dirty = 1;
+
+    }
+
+    if ( avr->ticks >= avr->wdt_due ) {
+
+        uint8_t w = avr->data[ AVR_WDTCSR ];
+
+        if ( w & _BV_( WDTCSR_WDIE ) ) {
+
+            avr->data[ AVR_WDTCSR ] |= _BV_( WDTCSR_WDIF );
+            avr->irq_dirty = 1;
+
+        } else if ( w & _BV_( WDTCSR_WDE ) ) {
+
+            do_reset( avr , 3 );        // WDRF
+            return;
+
+        }
+
+        avr->wdt_due += wdt_period( avr );
+
+    }
+
+    update_next_event( avr );
+
+}
+
+// --- Pins
+
+#define PCICR_PCIE0     0
+
+static uint8_t pin_levels( const avr_t *avr , uint8_t port ) {
+
+    uint8_t ddr = avr->data[ AVR_DDRB + port * 3 ];
+    uint8_t out = avr->data[ AVR_PORTB + port * 3 ];
+
+    return ( out & ddr ) | ( avr->pin_input[ port ] & ~ddr );
+
+}
+
+static void check_pin_change( avr_t *avr ) {
+
+    for( uint8_t p=0; p < 3 ; p++ ) {
+
+        uint8_t now = pin_levels( avr , p );
+        uint8_t changed = ( now ^ avr->pc_last[p] ) & avr->data[ AVR_PCMSK0 + p ];
+
+        avr->pc_last[p] = now;
+
+        if ( changed ) {
+            avr->data[ AVR_PCIFR ] |= _BV_( p );
+            avr->irq_dirty = 1;
+        }
+
+    }
+
+}
+
+void avr_set_pins( avr_t *avr , uint8_t port , uint8_t levels ) {
+
+    avr->pin_input[ port ] = levels;
+    check_pin_change( avr );
+
+}
+
+// --- Data space
+
+static uint8_t io_read( avr_t *avr , uint16_t addr ) {
+
+    switch ( addr ) {
+
+        case AVR_PINB: return pin_levels( avr , 0 );
+        case AVR_PINC: return pin_levels( avr , 1 );
+        case AVR_PIND: return pin_levels( avr , 2 );
+        case AVR_PINE: return pin_levels( avr , 3 ) & 0x0f;
+
+        case AVR_TCNT0:
+            sync_timer( avr , 0 );
+            update_next_event( avr );
+            break;
+
+        case AVR_TCNT2:
+            sync_timer( avr , 2 );
+            update_next_event( avr );
+            break;
+
+        case AVR_TCNT1L:
+            sync_timer( avr , 1 );
+            update_next_event( avr );
+            avr->temp16 = avr->data[ AVR_TCNT1H ];
+            break;
+
+        case AVR_ICR1L:
+            avr->temp16 = avr->data[ AVR_ICR1H ];
+            break;
+
+        case AVR_TCNT1H:
+        case AVR_ICR1H:
+            return avr->temp16;
+
+        case AVR_UDR0:
+            avr->data[ AVR_UCSR0A ] &= ~_BV_( UCSR0A_RXC );     // Nothing ever comes in
+            return 0;
+
+    }
+
+    if ( addr >= AVR_SNOBR0 && addr < AVR_SNOBR0 + AVR_SERIALNO_LEN ) {
+        return avr->serialno[ addr - AVR_SNOBR0 ];
+    }
+
+    return avr->data[ addr ];
+
+}
+
+#define MCUCR_IVSEL     1
+#define MCUCR_IVCE      0
+
+#define CLKPR_CLKPCE    7
+
+#define SPMCSR_SPMIE    7
+#define SPMCSR_RWWSB    6
+#define SPMCSR_RWWSRE   4
+#define SPMCSR_PGWRT    2
+#define SPMCSR_PGERS    1
+#define SPMCSR_SPMEN    0
+
+#define EECR_EERIE      3
+#define EECR_EEMPE      2
+#define EECR_EEPE       1
+#define EECR_EERE       0
+
+static void port_written( avr_t *avr , uint16_t addr ) {
+
+    check_pin_change( avr );
+
+    if ( avr->hooks.port_write ) {
+        avr->hooks.port_write( avr->hooks.ctx , avr , addr , avr->data[ addr ] );
+    }
+
+}
+
+static void timer_written( avr_t *avr , uint8_t n ) {
+
+    // Outside of the PWM modes, OCR writes take effect right away
+
+    uint8_t wave;
+    uint16_t top;
+
+    timer_mode( avr , n , &wave , &top );
+
+    if ( wave == WAVE_NORMAL || wave == WAVE_CTC ) {
+        timer_update_ocr( avr , n );
+    }
+
+    sync_timer( avr , n );      // Work out when it next needs attention with the new settings
+    update_next_event( avr );
+
+}
+
+static void io_write( avr_t *avr , uint16_t addr , uint8_t v ) {
+
+    // Anything touching a timer needs it brought up to date with the old settings first
+
+    switch ( addr ) {
+        case AVR_TCCR0A: case AVR_TCCR0B: case AVR_TCNT0: case AVR_OCR0A: case AVR_OCR0B:
+            sync_timer( avr , 0 );
+            break;
+        case AVR_TCCR1A: case AVR_TCCR1B: case AVR_TCNT1L: case AVR_OCR1AL: case AVR_OCR1BL: case AVR_ICR1L:
+            sync_timer( avr , 1 );
+            break;
+        case AVR_TCCR2A: case AVR_TCCR2B: case AVR_TCNT2: case AVR_OCR2A: case AVR_OCR2B:
+            sync_timer( avr , 2 );
+            break;
+        case AVR_GTCCR:
+            avr_sync_timers( avr );
+            break;
+    }
+
+    avr->irq_dirty = 1;
+
+    switch ( addr ) {
+
+        case AVR_PINB: case AVR_PINC: case AVR_PIND: case AVR_PINE:
+
+            // Writing a 1 to PINx toggles the PORTx bit
+
+            avr->data[ addr + 2 ] ^= v;
+            port_written( avr , addr + 2 );
+            return;
+
+        case AVR_DDRB: case AVR_PORTB: case AVR_DDRC: case AVR_PORTC:
+        case AVR_DDRD: case AVR_PORTD: case AVR_DDRE: case AVR_PORTE:
+
+            avr->data[ addr ] = v;
+            port_written( avr , addr );
+            return;
+
+        case AVR_TIFR0: case AVR_TIFR1: case AVR_TIFR2: case AVR_PCIFR: case AVR_EIFR:
+
+            avr->data[ addr ] &= ~v;       // Flags are cleared by writing a 1
+            return;
+
+        case AVR_PCMSK0: case AVR_PCMSK1: case AVR_PCMSK2:
+
+            avr->data[ addr ] = v;
+            avr->pc_last[ addr - AVR_PCMSK0 ] = pin_levels( avr , addr - AVR_PCMSK0 );
+            return;
+
+        case AVR_TCNT0: case AVR_TCNT2:
+
+            avr->data[ addr ] = v;
+            timer_written( avr , addr == AVR_TCNT0 ? 0 : 2 );
+            return;
+
+        case AVR_TCCR0A: case AVR_TCCR0B: case AVR_OCR0A: case AVR_OCR0B:
+
+            avr->data[ addr ] = v;
+            timer_written( avr , 0 );
+            return;
+
+        case AVR_TCCR2A: case AVR_TCCR2B: case AVR_OCR2A: case AVR_OCR2B:
+
+            avr->data[ addr ] = v;
+            timer_written( avr , 2 );
+            return;
+
+        case AVR_TCCR1A: case AVR_TCCR1B:
+
+            avr->data[ addr ] = v;
+            timer_written( avr , 1 );
+            return;
+
+        // 16 bit registers go through TEMP. High byte first, then writing the low byte writes both.
+
+        case AVR_TCNT1H: case AVR_OCR1AH: case AVR_OCR1BH: case AVR_ICR1H:
+
+            avr->temp16 = v;
+            return;
+
+        case AVR_TCNT1L: case AVR_OCR1AL: case AVR_OCR1BL: case AVR_ICR1L:
+
+            avr->data[ addr ] = v;
+            avr->data[ addr + 1 ] = avr->temp16;
+            timer_written( avr , 1 );
+            return;
+
+        case AVR_GTCCR:
+
+            avr->data[ addr ] = v;
+
+            if ( v & _BV_( GTCCR_PSRSYNC ) ) {
+                avr->timer[0].prescale_count = 0;
+                avr->timer[1].prescale_count = 0;
+            }
+
+            if ( v & _BV_( GTCCR_PSRASY ) ) {
+                avr->timer[2].prescale_count = 0;
+            }
+
+            if ( !( v & _BV_( GTCCR_TSM ) ) ) {
+                avr->data[ addr ] &= ~( _BV_( GTCCR_PSRSYNC ) | _BV_( GTCCR_PSRASY ) );      // Self clearing unless TSM holds them
+            }
+
+            avr_sync_timers( avr );
+            update_next_event( avr );
+            return;
+
+        case AVR_WDTCSR: {
+
+            uint8_t old = avr->data[ addr ];
+
+            uint8_t keep = old & ~( _BV_( WDTCSR_WDIF ) | _BV_( WDTCSR_WDIE ) );
+            uint8_t next = ( old & _BV_( WDTCSR_WDIF ) & ~v ) | ( v & _BV_( WDTCSR_WDIE ) );
+
+            if ( avr->wdt_change ) {
+
+                // Inside the timed sequence, we can change anything
+
+                keep = v & ~( _BV_( WDTCSR_WDIF ) | _BV_( WDTCSR_WDIE ) | _BV_( WDTCSR_WDCE ) );
+                avr->wdt_change = 0;
+
+            } else if ( ( v & _BV_( WDTCSR_WDCE ) ) && ( v & _BV_( WDTCSR_WDE ) ) ) {
+
+                avr->wdt_change = 4;
+                keep |= _BV_( WDTCSR_WDCE );
+
+            }
+
+            // WDRF in MCUSR forces the WDE on
+
+            if ( avr->data[ AVR_MCUSR ] & 0x08 ) keep |= _BV_( WDTCSR_WDE );
+
+            avr->data[ addr ] = keep | next;
+
+            if ( ( old ^ avr->data[ addr ] ) & ~( _BV_( WDTCSR_WDIF ) | _BV_( WDTCSR_WDCE ) ) ) {
+                restart_wdt( avr );
+            }
+
+            return;
+
+        }
+
+        case AVR_CLKPR:
+
+            if ( v & _BV_( CLKPR_CLKPCE ) ) {
+
+                avr->clkpr_change = 4;
+
+            } else if ( avr->clkpr_change ) {
+
+                avr->data[ addr ] = v & 0x0f;
+                avr->clock_shift = ( v & 0x0f ) > 8 ? 8 : ( v & 0x0f );
+                avr->clkpr_change = 0;
+
+            }
+            return;
+
+        case AVR_MCUCR:
+
+            if ( v & _BV_( MCUCR_IVCE ) ) {
+
+                avr->ivce_change = 4;
+                avr->data[ addr ] = v;
+
+            } else {
+
+                uint8_t ivsel = avr->data[ addr ] & _BV_( MCUCR_IVSEL );
+
+                if ( avr->ivce_change ) {
+                    ivsel = v & _BV_( MCUCR_IVSEL );
+                    avr->ivce_change = 0;
+                }
+
+                avr->data[ addr ] = ( v & ~( _BV_( MCUCR_IVSEL ) | _BV_( MCUCR_IVCE ) ) ) | ivsel;
+
+            }
+            return;
+
+        case AVR_MCUSR:
+
+            avr->data[ addr ] &= v;        // Reset flags can only be cleared
+            return;
+
+        case AVR_SPMCSR:
+
+            avr->data[ addr ] = ( avr->data[ addr ] & _BV_( SPMCSR_RWWSB ) ) | ( v & ~_BV_( SPMCSR_RWWSB ) );
+
+            if ( v & _BV_( SPMCSR_SPMEN ) ) {
+                avr->spm_armed = 4;
+            }
+            return;
+
+        case AVR_EECR:
+
+            if ( v & _BV_( EECR_EERE ) ) {
+
+                avr->data[ AVR_EEDR ] = avr->eeprom[ reg16( avr , AVR_EEARL ) & ( AVR_EEPROM_SIZE - 1 ) ];
+
+            } else if ( ( v & _BV_( EECR_EEPE ) ) && ( avr->data[ addr ] & _BV_( EECR_EEMPE ) ) ) {
+
+                // We pretend the 3.4ms write happens instantly
+
+                avr->eeprom[ reg16( avr , AVR_EEARL ) & ( AVR_EEPROM_SIZE - 1 ) ] = avr->data[ AVR_EEDR ];
+
+            }
+
+            avr->data[ addr ] = v & ( _BV_( EECR_EERIE ) | _BV_( EECR_EEMPE ) );
+            return;
+
+        case AVR_ADCSRA:
+
+            service_peripherals( avr );
+
+            avr->data[ addr ] = ( v & ~_BV_( ADCSRA_ADIF ) ) | ( avr->data[ addr ] & _BV_( ADCSRA_ADIF ) & ~v );
+
+            if ( ( v & _BV_( ADCSRA_ADSC ) ) && ( v & _BV_( ADCSRA_ADEN ) ) && avr->adc_due == NEVER ) {
+
+                static const uint8_t div[8] = { 2 , 2 , 4 , 8 , 16 , 32 , 64 , 128 };
+
+                avr->adc_due = avr->io_clock + 13UL * div[ v & 0x07 ];
+                update_next_event( avr );
+
+            }
+            return;
+
+        case AVR_UDR0:
+
+            if ( !( avr->data[ AVR_UCSR0B ] & _BV_( UCSR0B_TXEN ) ) ) return;
+
+            service_peripherals( avr );
+
+            avr->data[ AVR_UCSR0A ] &= ~_BV_( UCSR0A_TXC );
+
+            if ( avr->usart_due == NEVER ) {
+                usart_start( avr , v );
+            } else {
+                avr->usart_pending = v;
+                avr->data[ AVR_UCSR0A ] &= ~_BV_( UCSR0A_UDRE );
+            }
+
+            update_next_event( avr );
+            return;
+
+        case AVR_UCSR0A:
+
+            // TXC is cleared by writing a 1. RXC and UDRE are read only.
+
+            avr->data[ addr ] = ( avr->data[ addr ] & ( _BV_( UCSR0A_RXC ) | _BV_( UCSR0A_UDRE ) ) ) |
+                                ( avr->data[ addr ] & _BV_( UCSR0A_TXC ) & ~v ) |
+                                ( v & ~( _BV_( UCSR0A_RXC ) | _BV_( UCSR0A_UDRE ) | _BV_( UCSR0A_TXC ) ) );
+            return;
+
+    }
+
+    if ( addr >= AVR_SNOBR0 && addr < AVR_SNOBR0 + AVR_SERIALNO_LEN ) {
+        return;     // Read only
+    }
+
+    avr->data[ addr ] = v;
+
+}
+
+static inline uint8_t read_data( avr_t *avr , uint16_t addr ) {
+
+    if ( addr >= 0x100 ) {
+        return addr < AVR_DATA_SIZE ? avr->data[ addr ] : 0;
+    }
+
+    if ( addr < 0x20 ) return avr->data[ addr ];
+
+    return io_read( avr , addr );
+
+}
+
+static inline void write_data( avr_t *avr , uint16_t addr , uint8_t v ) {
+
+    if ( addr >= 0x100 ) {
+        if ( addr < AVR_DATA_SIZE ) avr->data[ addr ] = v;
+        return;
+    }
+
+    if ( addr < 0x20 || addr == AVR_SPL || addr == AVR_SPH ) {
+        avr->data[ addr ] = v;
+        return;
+    }
+
+    if ( addr == AVR_SREG ) {
+        avr->data[ addr ] = v;
+        avr->irq_dirty = 1;
+        return;
+    }
+
+    io_write( avr , addr , v );
+
+}
+
+// --- Interrupts
+
+// Find the highest priority interrupt that is both flagged and enabled, or 0 if none
+
+static uint8_t find_irq( const avr_t *avr ) {
+
+    const uint8_t *d = avr->data;
+
+    if ( d[ AVR_EIFR ] & d[ AVR_EIMSK ] & 0x01 ) return AVR_VECTOR_INT0;
+    if ( d[ AVR_EIFR ] & d[ AVR_EIMSK ] & 0x02 ) return AVR_VECTOR_INT1;
+
+    uint8_t pc = d[ AVR_PCIFR ] & d[ AVR_PCICR ];
+
+    if ( pc & 0x01 ) return AVR_VECTOR_PCINT0;
+    if ( pc & 0x02 ) return AVR_VECTOR_PCINT1;
+    if ( pc & 0x04 ) return AVR_VECTOR_PCINT2;
+
+    if ( ( d[ AVR_WDTCSR ] & _BV_( WDTCSR_WDIF ) ) && ( d[ AVR_WDTCSR ] & _BV_( WDTCSR_WDIE ) ) ) return AVR_VECTOR_WDT;
+
+    uint8_t t2 = d[ AVR_TIFR2 ] & d[ AVR_TIMSK2 ];
+
+    if ( t2 & _BV_( OCFA ) ) return AVR_VECTOR_TIMER2_COMPA;
+    if ( t2 & _BV_( OCFB ) ) return AVR_VECTOR_TIMER2_COMPB;
+    if ( t2 & _BV_( TOV ) )  return AVR_VECTOR_TIMER2_OVF;
+
+    uint8_t t1 = d[ AVR_TIFR1 ] & d[ AVR_TIMSK1 ];
+
+    if ( t1 & _BV_( ICF ) )  return AVR_VECTOR_TIMER1_CAPT;
+    if ( t1 & _BV_( OCFA ) ) return AVR_VECTOR_TIMER1_COMPA;
+    if ( t1 & _BV_( OCFB ) ) return AVR_VECTOR_TIMER1_COMPB;
+    if ( t1 & _BV_( TOV ) )  return AVR_VECTOR_TIMER1_OVF;
+
+    uint8_t t0 = d[ AVR_TIFR0 ] & d[ AVR_TIMSK0 ];
+
+    if ( t0 & _BV_( OCFA ) ) return AVR_VECTOR_TIMER0_COMPA;
+    if ( t0 & _BV_( OCFB ) ) return AVR_VECTOR_TIMER0_COMPB;
+    if ( t0 & _BV_( TOV ) )  return AVR_VECTOR_TIMER0_OVF;
+
+    uint8_t ua = d[ AVR_UCSR0A ];
+    uint8_t ub = d[ AVR_UCSR0B ];
+
+    if ( ( ua & _BV_( UCSR0A_RXC ) )  && ( ub & _BV_( UCSR0B_RXCIE ) ) ) return AVR_VECTOR_USART_RX;
+    if ( ( ua & _BV_( UCSR0A_UDRE ) ) && ( ub & _BV_( UCSR0B_UDRIE ) ) ) return AVR_VECTOR_USART_UDRE;
+    if ( ( ua & _BV_( UCSR0A_TXC ) )  && ( ub & _BV_( UCSR0B_TXCIE ) ) ) return AVR_VECTOR_USART_TX;
+
+    if ( ( d[ AVR_ADCSRA ] & _BV_( ADCSRA_ADIF ) ) && ( d[ AVR_ADCSRA ] & _BV_( ADCSRA_ADIE ) ) ) return AVR_VECTOR_ADC;
+
+    if ( d[ AVR_EECR ] & _BV_( EECR_EERIE ) ) return AVR_VECTOR_EE_READY;       // EEPROM is always ready here
+
+    if ( d[ AVR_SPMCSR ] & _BV_( SPMCSR_SPMIE ) ) return AVR_VECTOR_SPM_READY;   // So is the flash
+
+    return 0;
+
+}
+
+// The flags that the hardware clears for us when it jumps to the vector
+
+static void clear_irq_flag( avr_t *avr , uint8_t vector ) {
+
+    uint8_t *d = avr->data;
+
+    switch ( vector ) {
+        case AVR_VECTOR_INT0:           d[ AVR_EIFR ] &= ~0x01; break;
+        case AVR_VECTOR_INT1:           d[ AVR_EIFR ] &= ~0x02; break;
+        case AVR_VECTOR_PCINT0:         d[ AVR_PCIFR ] &= ~0x01; break;
+        case AVR_VECTOR_PCINT1:         d[ AVR_PCIFR ] &= ~0x02; break;
+        case AVR_VECTOR_PCINT2:         d[ AVR_PCIFR ] &= ~0x04; break;
+        case AVR_VECTOR_TIMER2_COMPA:   d[ AVR_TIFR2 ] &= ~_BV_( OCFA ); break;
+        case AVR_VECTOR_TIMER2_COMPB:   d[ AVR_TIFR2 ] &= ~_BV_( OCFB ); break;
+        case AVR_VECTOR_TIMER2_OVF:     d[ AVR_TIFR2 ] &= ~_BV_( TOV ); break;
+        case AVR_VECTOR_TIMER1_CAPT:    d[ AVR_TIFR1 ] &= ~_BV_( ICF ); break;
+        case AVR_VECTOR_TIMER1_COMPA:   d[ AVR_TIFR1 ] &= ~_BV_( OCFA ); break;
+        case AVR_VECTOR_TIMER1_COMPB:   d[ AVR_TIFR1 ] &= ~_BV_( OCFB ); break;
+        case AVR_VECTOR_TIMER1_OVF:     d[ AVR_TIFR1 ] &= ~_BV_( TOV ); break;
+        case AVR_VECTOR_TIMER0_COMPA:   d[ AVR_TIFR0 ] &= ~_BV_( OCFA ); break;
+        case AVR_VECTOR_TIMER0_COMPB:   d[ AVR_TIFR0 ] &= ~_BV_( OCFB ); break;
+        case AVR_VECTOR_TIMER0_OVF:     d[ AVR_TIFR0 ] &= ~_BV_( TOV ); break;
+        case AVR_VECTOR_USART_TX:       d[ AVR_UCSR0A ] &= ~_BV_( UCSR0A_TXC ); break;
+        case AVR_VECTOR_ADC:            d[ AVR_ADCSRA ] &= ~_BV_( ADCSRA_ADIF ); break;
+
+        case AVR_VECTOR_WDT:
+
+            d[ AVR_WDTCSR ] &= ~_BV_( WDTCSR_WDIF );
+
+            // In interrupt and reset mode, the first timeout is an interrupt and the next is a reset
+
+            if ( d[ AVR_WDTCSR ] & _BV_( WDTCSR_WDE ) ) d[ AVR_WDTCSR ] &= ~_BV_( WDTCSR_WDIE );
+            break;
+    }
+
+}
+
+static void push( avr_t *avr , uint8_t v ) {
+
+    uint16_t sp = avr_sp( avr );
+
+    write_data( avr , sp , v );
+
+    sp--;
+    avr->data[ AVR_SPL ] = (uint8_t) sp;
+    avr->data[ AVR_SPH ] = sp >> 8;
+
+}
+
+static uint8_t pop( avr_t *avr ) {
+
+    uint16_t sp = avr_sp( avr ) + 1;
+
+    avr->data[ AVR_SPL ] = (uint8_t) sp;
+    avr->data[ AVR_SPH ] = sp >> 8;
+
+    return read_data( avr , sp );
+
+}
+
+static void push_pc( avr_t *avr , uint16_t pc ) {
+
+    push( avr , (uint8_t) pc );
+    push( avr , pc >> 8 );
+
+}
+
+static uint16_t pop_pc( avr_t *avr ) {
+
+    uint16_t hi = pop( avr );
+    uint16_t lo = pop( avr );
+
+    return ( ( hi << 8 ) | lo ) & ( AVR_FLASH_SIZE / 2 - 1 );
+
+}
+
+static uint16_t vector_base( const avr_t *avr ) {
+    return ( avr->data[ AVR_MCUCR ] & _BV_( MCUCR_IVSEL ) ) ? AVR_BOOT_START / 2 : 0;
+}
+
+// Returns the number of cycles used
+
+static uint8_t take_irq( avr_t *avr , uint8_t vector ) {
+
+    clear_irq_flag( avr , vector );
+
+    push_pc( avr , avr->pc );
+
+    SREG &= ~_BV_( SREG_I );
+
+    avr->pc = vector_base( avr ) + vector * 2;
+    avr->irq_dirty = 1;
+
+    if ( avr->hooks.irq ) {
+        avr->hooks.irq( avr->hooks.ctx , avr , vector );
+    }
+
+    return 4;
+
+}
+
+// --- Reset
+
+static void do_reset( avr_t *avr , uint8_t reason ) {
+
+    // Registers and RAM keep whatever they had. IO registers go back to their reset values.
+
+    memset( avr->data + 0x20 , 0 , 0x100 - 0x20 );
+
+    avr->data[ AVR_MCUSR ] = _BV_( reason );
+
+    uint16_t sp = AVR_DATA_SIZE - 1;
+    avr->data[ AVR_SPL ] = (uint8_t) sp;
+    avr->data[ AVR_SPH ] = sp >> 8;
+
+    avr->data[ AVR_UCSR0A ] = _BV_( UCSR0A_UDRE );
+    avr->data[ AVR_UCSR0C ] = 0x06;
+
+    for( uint8_t n=0; n < 3 ; n++ ) {
+        avr->timer[n].last_io = avr->io_clock;
+        avr->timer[n].prescale_count = 0;
+        avr->timer[n].down = 0;
+        avr->timer[n].ocr[0] = 0;
+        avr->timer[n].ocr[1] = 0;
+        avr->timer[n].next_io = NEVER;
+    }
+
+    avr->clock_shift = 0;
+    avr->sleeping = 0;
+    avr->irq_delay = 0;
+    avr->wdt_change = 0;
+    avr->clkpr_change = 0;
+    avr->ivce_change = 0;
+    avr->spm_armed = 0;
+
+    avr->adc_due = NEVER;
+    avr->usart_due = NEVER;
+
+    // WDRF keeps the watchdog on in reset mode at the shortest timeout
+
+    if ( reason == 3 ) {
+        avr->data[ AVR_WDTCSR ] = _BV_( WDTCSR_WDE );
+    }
+
+    restart_wdt( avr );
+    update_next_event( avr );
+
+    // BOOTRST is programmed on a blink, so we always start in the bootloader
+
+    avr->pc = AVR_BOOT_START / 2;
+
+    for( uint8_t p=0; p < 3 ; p++ ) {
+        avr->pc_last[p] = pin_levels( avr , p );
+    }
+
+    avr->irq_dirty = 1;
+    avr->resets++;
+
+}
+
+void avr_reset( avr_t *avr ) {
+
+    do_reset( avr , 1 );       // EXTRF
+
+}
+
+void avr_init( avr_t *avr ) {
+
+    memset( avr , 0 , sizeof( *avr ) );
+
+    memset( avr->flash , 0xff , sizeof( avr->flash ) );
+    memset( avr->eeprom , 0xff , sizeof( avr->eeprom ) );
+    memset( avr->spm_buffer , 0xff , sizeof( avr->spm_buffer ) );
+    memset( avr->pin_input , 0xff , sizeof( avr->pin_input ) );
+
+    avr->adc_value = 375;      // 1.1V bandgap against a 3V battery
+    avr->wdt_scale = 1.0;
+    avr->break_addr = 0xffff;
+
+    avr_flash_changed( avr , 0 , AVR_FLASH_SIZE );
+
+    do_reset( avr , 0 );        // PORF
+    avr->resets = 0;
+
+}
+
+// --- SPM
+
+static uint8_t do_spm( avr_t *avr ) {
+
+    if ( !avr->spm_armed ) return 1;
+
+    uint8_t mode = avr->data[ AVR_SPMCSR ];
+    uint16_t z = R[30] | ( R[31] << 8 );
+
+    uint16_t page = z & ~( AVR_PAGE_SIZE - 1 ) & ( AVR_FLASH_SIZE - 1 );
+
+    avr->data[ AVR_SPMCSR ] &= ~( _BV_( SPMCSR_SPMEN ) | _BV_( SPMCSR_PGERS ) | _BV_( SPMCSR_PGWRT ) | _BV_( SPMCSR_RWWSRE ) );
+    avr->spm_armed = 0;
+
+    if ( mode & _BV_( SPMCSR_PGERS ) ) {
+
+        memset( avr->flash + page , 0xff , AVR_PAGE_SIZE );
+        avr_flash_changed( avr , page , AVR_PAGE_SIZE );
+
+        return 0;
+
+    } else if ( mode & _BV_( SPMCSR_PGWRT ) ) {
+
+        for( uint16_t i=0; i < AVR_PAGE_SIZE ; i++ ) {
+            avr->flash[ page + i ] &= avr->spm_buffer[i];       // Programming can only clear bits
+        }
+
+        memset( avr->spm_buffer , 0xff , sizeof( avr->spm_buffer ) );
+        avr_flash_changed( avr , page , AVR_PAGE_SIZE );
+
+        return 0;
+
+    } else if ( mode & _BV_( SPMCSR_RWWSRE ) ) {
+
+        avr->data[ AVR_SPMCSR ] &= ~_BV_( SPMCSR_RWWSB );
+
+    } else if ( !( mode & 0x3e ) ) {
+
+        uint8_t offset = z & ( AVR_PAGE_SIZE - 2 );
+
+        avr->spm_buffer[ offset ] = R[0];
+        avr->spm_buffer[ offset + 1 ] = R[1];
+
+    }
+
+    return 1;
+
+}
+
+// Page erase and write take about 4ms with the CPU stopped (the BIOS runs out of the NRWW section)
+
+#define SPM_STALL_CYCLES    ( 4 * 8000 )
+
+// --- The main loop
+
+#define FLAG( bit , cond )  do { if ( cond ) s |= _BV_( bit ); else s &= ~_BV_( bit ); } while (0)
+
+static inline uint16_t reg_pair( const avr_t *avr , uint8_t r ) {
+    return avr->data[ r ] | ( avr->data[ r + 1 ] << 8 );
+}
+
+static inline void set_reg_pair( avr_t *avr , uint8_t r , uint16_t v ) {
+    avr->data[ r ] = (uint8_t) v;
+    avr->data[ r + 1 ] = v >> 8;
+}
+
+// Flags after an 8 bit add or subtract. `carry_in` is already folded into `res`.
+
+static inline uint8_t flags_add( uint8_t s , uint8_t d , uint8_t r , uint8_t res ) {
+
+    uint8_t c = ( d & r ) | ( r & ~res ) | ( ~res & d );
+    uint8_t v = ( d & r & ~res ) | ( ~d & ~r & res );
+
+    s &= ~( _BV_( SREG_H ) | _BV_( SREG_V ) | _BV_( SREG_N ) | _BV_( SREG_C ) | _BV_( SREG_S ) | _BV_( SREG_Z ) );
+
+    if ( c & 0x08 ) s |= _BV_( SREG_H );
+    if ( c & 0x80 ) s |= _BV_( SREG_C );
+    if ( v & 0x80 ) s |= _BV_( SREG_V );
+    if ( res & 0x80 ) s |= _BV_( SREG_N );
+    if ( !res ) s |= _BV_( SREG_Z );
+    if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S );
+
+    return s;
+
+}
+
+// For SBC/SBCI/CPC, Z is only ever cleared so multi-byte compares work
+
+static inline uint8_t flags_sub( uint8_t s , uint8_t d , uint8_t r , uint8_t res , uint8_t keep_z ) {
+
+    uint8_t c = ( ~d & r ) | ( r & res ) | ( res & ~d );
+    uint8_t v = ( d & ~r & ~res ) | ( ~d & r & res );
+
+    uint8_t z = keep_z ? ( s & _BV_( SREG_Z ) ) : _BV_( SREG_Z );
+
+    s &= ~( _BV_( SREG_H ) | _BV_( SREG_V ) | _BV_( SREG_N ) | _BV_( SREG_C ) | _BV_( SREG_S ) | _BV_( SREG_Z ) );
+
+    if ( c & 0x08 ) s |= _BV_( SREG_H );
+    if ( c & 0x80 ) s |= _BV_( SREG_C );
+    if ( v & 0x80 ) s |= _BV_( SREG_V );
+    if ( res & 0x80 ) s |= _BV_( SREG_N );
+    if ( !res ) s |= z;
+    if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S );
+
+    return s;
+
+}
+
+// Flags after AND, OR, EOR, COM and friends. V is cleared.
+
+static inline uint8_t flags_logic( uint8_t s , uint8_t res ) {
+
+    s &= ~( _BV_( SREG_V ) | _BV_( SREG_N ) | _BV_( SREG_S ) | _BV_( SREG_Z ) );
+
+    if ( res & 0x80 ) s |= _BV_( SREG_N ) | _BV_( SREG_S );
+    if ( !res ) s |= _BV_( SREG_Z );
+
+    return s;
+
+}
+
+// Flags after a right shift. C is the bit that fell off.
+
+static inline uint8_t flags_shift( uint8_t s , uint8_t res , uint8_t c ) {
+
+    s &= ~( _BV_( SREG_V ) | _BV_( SREG_N ) | _BV_( SREG_C ) | _BV_( SREG_S ) | _BV_( SREG_Z ) );
+
+    if ( c ) s |= _BV_( SREG_C );
+    if ( res & 0x80 ) s |= _BV_( SREG_N );
+    if ( !res ) s |= _BV_( SREG_Z );
+    if ( ( ( s >> SREG_N ) ^ c ) & 1 ) s |= _BV_( SREG_V );
+    if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S );
+
+    return s;
+
+}
+
+static inline uint8_t flags_mul( uint8_t s , uint16_t res , uint8_t c ) {
+
+    s &= ~( _BV_( SREG_C ) | _BV_( SREG_Z ) );
+
+    if ( c ) s |= _BV_( SREG_C );
+    if ( !res ) s |= _BV_( SREG_Z );
+
+    return s;
+
+}
+
+// Execute one instruction. Returns the number of cycles it took.
+
+static uint8_t step( avr_t *avr ) {
+
+    uint16_t pc = avr->pc;
+    const avr_t::op_t *op = &avr->ops[ pc ];
+
+    uint8_t *r = avr->data;
+    uint8_t s = SREG;
+
+    uint8_t a = op->a;
+    uint8_t b = op->b;
+
+    uint8_t cycles = 1;
+
+    avr->pc = ( pc + 1 ) & ( AVR_FLASH_SIZE / 2 - 1 );
+
+    switch ( op->kind ) {
+
+        case OP_NOP:
+            break;
+
+        case OP_MOVW:
+            r[a] = r[b];
+            r[a+1] = r[b+1];
+            break;
+
+        case OP_MUL: {
+            uint16_t res = r[a] * r[b];
+            set_reg_pair( avr , 0 , res );
+            s = flags_mul( s , res , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_MULS: {
+            uint16_t res = (uint16_t) ( (int8_t) r[a] * (int8_t) r[b] );
+            set_reg_pair( avr , 0 , res );
+            s = flags_mul( s , res , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_MULSU: {
+            uint16_t res = (uint16_t) ( (int8_t) r[a] * (uint8_t) r[b] );
+            set_reg_pair( avr , 0 , res );
+            s = flags_mul( s , res , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_FMUL: {
+            uint16_t res = r[a] * r[b];
+            set_reg_pair( avr , 0 , res << 1 );
+            s = flags_mul( s , (uint16_t) ( res << 1 ) , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_FMULS: {
+            uint16_t res = (uint16_t) ( (int8_t) r[a] * (int8_t) r[b] );
+            set_reg_pair( avr , 0 , res << 1 );
+            s = flags_mul( s , (uint16_t) ( res << 1 ) , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_FMULSU: {
+            uint16_t res = (uint16_t) ( (int8_t) r[a] * (uint8_t) r[b] );
+            set_reg_pair( avr , 0 , res << 1 );
+            s = flags_mul( s , (uint16_t) ( res << 1 ) , res >> 15 );
+            cycles = 2;
+            break;
+        }
+
+        case OP_ADD: {
+            uint8_t res = r[a] + r[b];
+            s = flags_add( s , r[a] , r[b] , res );
+            r[a] = res;
+            break;
+        }
+
+        case OP_ADC: {
+            uint8_t res = r[a] + r[b] + ( s & 1 );
+            s = flags_add( s , r[a] , r[b] , res );
+            r[a] = res;
+            break;
+        }
+
+        case OP_SUB: {
+            uint8_t res = r[a] - r[b];
+            s = flags_sub( s , r[a] , r[b] , res , 0 );
+            r[a] = res;
+            break;
+        }
+
+        case OP_SBC: {
+            uint8_t res = r[a] - r[b] - ( s & 1 );
+            s = flags_sub( s , r[a] , r[b] , res , 1 );
+            r[a] = res;
+            break;
+        }
+
+        case OP_CP: {
+            uint8_t res = r[a] - r[b];
+            s = flags_sub( s , r[a] , r[b] , res , 0 );
+            break;
+        }
+
+        case OP_CPC: {
+            uint8_t res = r[a] - r[b] - ( s & 1 );
+            s = flags_sub( s , r[a] , r[b] , res , 1 );
+            break;
+        }
+
+        case OP_SUBI: {
+            uint8_t k = op->k;
+            uint8_t res = r[a] - k;
+            s = flags_sub( s , r[a] , k , res , 0 );
+            r[a] = res;
+            break;
+        }
+
+        case OP_SBCI: {
+            uint8_t k = op->k;
+            uint8_t res = r[a] - k - ( s & 1 );
+            s = flags_sub( s , r[a] , k , res , 1 );
+            r[a] = res;
+            break;
+        }
+
+        case OP_CPI: {
+            uint8_t k = op->k;
+            uint8_t res = r[a] - k;
+            s = flags_sub( s , r[a] , k , res , 0 );
+            break;
+        }
+
+        case OP_AND:  r[a] &= r[b];           s = flags_logic( s , r[a] ); break;
+        case OP_OR:   r[a] |= r[b];           s = flags_logic( s , r[a] ); break;
+        case OP_EOR:  r[a] ^= r[b];           s = flags_logic( s , r[a] ); break;
+        case OP_ANDI: r[a] &= (uint8_t) op->k; s = flags_logic( s , r[a] ); break;
+        case OP_ORI:  r[a] |= (uint8_t) op->k; s = flags_logic( s , r[a] ); break;
+
+        case OP_MOV:  r[a] = r[b]; break;
+        case OP_LDI:  r[a] = (uint8_t) op->k; break;
+
+        case OP_CPSE:
+
+            if ( r[a] == r[b] ) {
+                cycles += is_two_words( avr , avr->pc ) ? 2 : 1;
+                avr->pc += is_two_words( avr , avr->pc ) ? 2 : 1;
+            }
+            break;
+
+        case OP_SBRC:
+        case OP_SBRS:
+
+            if ( ( ( r[a] >> b ) & 1 ) == ( op->kind == OP_SBRS ) ) {
+                cycles += is_two_words( avr , avr->pc ) ? 2 : 1;
+                avr->pc += is_two_words( avr , avr->pc ) ? 2 : 1;
+            }
+            break;
+
+        case OP_SBIC:
+        case OP_SBIS:
+
+            if ( ( ( read_data( avr , a ) >> b ) & 1 ) == ( op->kind == OP_SBIS ) ) {
+                cycles += is_two_words( avr , avr->pc ) ? 2 : 1;
+                avr->pc += is_two_words( avr , avr->pc ) ? 2 : 1;
+            }
+            break;
+
+        case OP_CBI:
+            write_data( avr , a , read_data( avr , a ) & ~_BV_( b ) );
+            cycles = 2;
+            break;
+
+        case OP_SBI:
+
+            if ( a >= AVR_PINB && a <= AVR_PINE && ( a - AVR_PINB ) % 3 == 0 ) {
+                write_data( avr , a , _BV_( b ) );         // SBI on a PIN register toggles just that one bit
+            } else {
+                write_data( avr , a , read_data( avr , a ) | _BV_( b ) );
+            }
+            cycles = 2;
+            break;
+
+        case OP_IN:
+            r[a] = read_data( avr , op->k );
+            break;
+
+        case OP_OUT:
+            write_data( avr , op->k , r[a] );
+            s = SREG;       // We might have just written SREG
+            break;
+
+        case OP_COM:
+            r[a] = ~r[a];
+            s = flags_logic( s , r[a] ) | _BV_( SREG_C );
+            break;
+
+        case OP_NEG: {
+            uint8_t res = 0 - r[a];
+            s = flags_sub( s , 0 , r[a] , res , 0 );
+            r[a] = res;
+            break;
+        }
+
+        case OP_SWAP:
+            r[a] = ( r[a] << 4 ) | ( r[a] >> 4 );
+            break;
+
+        case OP_INC: {
+            uint8_t res = r[a] + 1;
+            s = flags_logic( s , res );
+            if ( res == 0x80 ) s |= _BV_( SREG_V );
+            if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S ); else s &= ~_BV_( SREG_S );
+            r[a] = res;
+            break;
+        }
+
+        case OP_DEC: {
+            uint8_t res = r[a] - 1;
+            s = flags_logic( s , res );
+            if ( res == 0x7f ) s |= _BV_( SREG_V );
+            if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S ); else s &= ~_BV_( SREG_S );
+            r[a] = res;
+            break;
+        }
+
+        case OP_ASR: {
+            uint8_t c = r[a] & 1;
+            r[a] = ( r[a] >> 1 ) | ( r[a] & 0x80 );
+            s = flags_shift( s , r[a] , c );
+            break;
+        }
+
+        case OP_LSR: {
+            uint8_t c = r[a] & 1;
+            r[a] >>= 1;
+            s = flags_shift( s , r[a] , c );
+            break;
+        }
+
+        case OP_ROR: {
+            uint8_t c = r[a] & 1;
+            r[a] = ( r[a] >> 1 ) | ( ( s & 1 ) << 7 );
+            s = flags_shift( s , r[a] , c );
+            break;
+        }
+
+        case OP_BSET:
+            s |= _BV_( a );
+            if ( a == SREG_I ) {
+                avr->irq_delay = 1;        // The instruction after SEI always runs first
+                avr->irq_dirty = 1;
+            }
+            break;
+
+        case OP_BCLR:
+            s &= ~_BV_( a );
+            break;
+
+        case OP_BST:
+            if ( ( r[a] >> b ) & 1 ) s |= _BV_( SREG_T ); else s &= ~_BV_( SREG_T );
+            break;
+
+        case OP_BLD:
+            if ( s & _BV_( SREG_T ) ) r[a] |= _BV_( b ); else r[a] &= ~_BV_( b );
+            break;
+
+        case OP_ADIW:
+        case OP_SBIW: {
+
+            uint16_t d = reg_pair( avr , a );
+            uint16_t res = ( op->kind == OP_ADIW ) ? d + op->k : d - op->k;
+
+            set_reg_pair( avr , a , res );
+
+            s &= ~( _BV_( SREG_V ) | _BV_( SREG_N ) | _BV_( SREG_C ) | _BV_( SREG_S ) | _BV_( SREG_Z ) );
+
+            if ( op->kind == OP_ADIW ) {
+                if ( ~d & res & 0x8000 ) s |= _BV_( SREG_V );
+                if ( ~res & d & 0x8000 ) s |= _BV_( SREG_C );
+            } else {
+                if ( d & ~res & 0x8000 ) s |= _BV_( SREG_V );
+                if ( res & ~d & 0x8000 ) s |= _BV_( SREG_C );
+            }
+
+            if ( res & 0x8000 ) s |= _BV_( SREG_N );
+            if ( !res ) s |= _BV_( SREG_Z );
+            if ( ( ( s >> SREG_N ) ^ ( s >> SREG_V ) ) & 1 ) s |= _BV_( SREG_S );
+
+            cycles = 2;
+            break;
+        }
+
+        case OP_BRBS:
+        case OP_BRBC:
+
+            if ( ( ( s >> b ) & 1 ) == ( op->kind == OP_BRBS ) ) {
+                avr->pc = ( avr->pc + (int16_t) op->k ) & ( AVR_FLASH_SIZE / 2 - 1 );
+                cycles = 2;
+            }
+            break;
+
+        case OP_RJMP:
+            avr->pc = ( avr->pc + (int16_t) op->k ) & ( AVR_FLASH_SIZE / 2 - 1 );
+            cycles = 2;
+            break;
+
+        case OP_JMP:
+            avr->pc = op->k & ( AVR_FLASH_SIZE / 2 - 1 );
+            cycles = 3;
+            break;
+
+        case OP_IJMP:
+            avr->pc = reg_pair( avr , 30 ) & ( AVR_FLASH_SIZE / 2 - 1 );
+            cycles = 2;
+            break;
+
+        case OP_RCALL:
+        case OP_CALL:
+        case OP_ICALL: {
+
+            uint16_t ret = avr->pc;
+            uint16_t target;
+
+            if ( op->kind == OP_RCALL ) {
+                target = ( avr->pc + (int16_t) op->k ) & ( AVR_FLASH_SIZE / 2 - 1 );
+                cycles = 3;
+            } else if ( op->kind == OP_CALL ) {
+                ret = ( pc + 2 ) & ( AVR_FLASH_SIZE / 2 - 1 );
+                target = op->k & ( AVR_FLASH_SIZE / 2 - 1 );
+                cycles = 4;
+            } else {
+                target = reg_pair( avr , 30 ) & ( AVR_FLASH_SIZE / 2 - 1 );
+                cycles = 3;
+            }
+
+            SREG = s;
+            push_pc( avr , ret );
+            avr->pc = target;
+
+            if ( avr->hooks.call ) {
+                avr->hooks.call( avr->hooks.ctx , avr , target , avr_sp( avr ) );
+            }
+
+            return cycles;
+        }
+
+        case OP_RET:
+        case OP_RETI:
+
+            SREG = s;
+
+            if ( op->kind == OP_RET ) {
+                if ( avr->hooks.ret ) avr->hooks.ret( avr->hooks.ctx , avr , avr_sp( avr ) );
+            } else {
+                if ( avr->hooks.reti ) avr->hooks.reti( avr->hooks.ctx , avr );
+            }
+
+            avr->pc = pop_pc( avr );
+
+            if ( op->kind == OP_RETI ) {
+                SREG |= _BV_( SREG_I );
+                avr->irq_delay = 1;        // Always run one more instruction before the next interrupt
+                avr->irq_dirty = 1;
+            }
+
+            return 4;
+
+        case OP_LDS:
+            r[a] = read_data( avr , op->k );
+            avr->pc++;
+            cycles = 2;
+            break;
+
+        case OP_STS:
+            SREG = s;
+            write_data( avr , op->k , r[a] );
+            s = SREG;
+            avr->pc++;
+            cycles = 2;
+            break;
+
+        case OP_LDD_Y: r[a] = read_data( avr , reg_pair( avr , 28 ) + op->k ); cycles = 2; break;
+        case OP_LDD_Z: r[a] = read_data( avr , reg_pair( avr , 30 ) + op->k ); cycles = 2; break;
+
+        case OP_STD_Y: SREG = s; write_data( avr , reg_pair( avr , 28 ) + op->k , r[a] ); s = SREG; cycles = 2; break;
+        case OP_STD_Z: SREG = s; write_data( avr , reg_pair( avr , 30 ) + op->k , r[a] ); s = SREG; cycles = 2; break;
+
+        case OP_LD_X:  r[a] = read_data( avr , reg_pair( avr , 26 ) ); cycles = 2; break;
+
+        case OP_LD_XP:
+        case OP_LD_YP:
+        case OP_LD_ZP: {
+            uint8_t p = ( op->kind == OP_LD_XP ) ? 26 : ( op->kind == OP_LD_YP ) ? 28 : 30;
+            uint16_t addr = reg_pair( avr , p );
+            set_reg_pair( avr , p , addr + 1 );
+            r[a] = read_data( avr , addr );
+            cycles = 2;
+            break;
+        }
+
+        case OP_LD_MX:
+        case OP_LD_MY:
+        case OP_LD_MZ: {
+            uint8_t p = ( op->kind == OP_LD_MX ) ? 26 : ( op->kind == OP_LD_MY ) ? 28 : 30;
+            uint16_t addr = reg_pair( avr , p ) - 1;
+            set_reg_pair( avr , p , addr );
+            r[a] = read_data( avr , addr );
+            cycles = 2;
+            break;
+        }
+
+        case OP_ST_X:  SREG = s; write_data( avr , reg_pair( avr , 26 ) , r[a] ); s = SREG; cycles = 2; break;
+
+        case OP_ST_XP:
+        case OP_ST_YP:
+        case OP_ST_ZP: {
+            uint8_t p = ( op->kind == OP_ST_XP ) ? 26 : ( op->kind == OP_ST_YP ) ? 28 : 30;
+            uint16_t addr = reg_pair( avr , p );
+            uint8_t v = r[a];
+            set_reg_pair( avr , p , addr + 1 );
+            SREG = s;
+            write_data( avr , addr , v );
+            s = SREG;
+            cycles = 2;
+            break;
+        }
+
+        case OP_ST_MX:
+        case OP_ST_MY:
+        case OP_ST_MZ: {
+            uint8_t p = ( op->kind == OP_ST_MX ) ? 26 : ( op->kind == OP_ST_MY ) ? 28 : 30;
+            uint16_t addr = reg_pair( avr , p ) - 1;
+            uint8_t v = r[a];
+            set_reg_pair( avr , p , addr );
+            SREG = s;
+            write_data( avr , addr , v );
+            s = SREG;
+            cycles = 2;
+            break;
+        }
+
+        case OP_LPM_R0:
+            r[0] = avr->flash[ reg_pair( avr , 30 ) & ( AVR_FLASH_SIZE - 1 ) ];
+            cycles = 3;
+            break;
+
+        case OP_LPM_Z:
+            r[a] = avr->flash[ reg_pair( avr , 30 ) & ( AVR_FLASH_SIZE - 1 ) ];
+            cycles = 3;
+            break;
+
+        case OP_LPM_ZP: {
+            uint16_t z = reg_pair( avr , 30 );
+            set_reg_pair( avr , 30 , z + 1 );
+            r[a] = avr->flash[ z & ( AVR_FLASH_SIZE - 1 ) ];
+            cycles = 3;
+            break;
+        }
+
+        case OP_PUSH:
+            SREG = s;
+            push( avr , r[a] );
+            s = SREG;
+            cycles = 2;
+            break;
+
+        case OP_POP:
+            r[a] = pop( avr );
+            cycles = 2;
+            break;
+
+        case OP_SLEEP:
+            if ( avr->data[ AVR_SMCR ] & 0x01 ) {
+                avr->sleeping = 1;
+            }
+            break;
+
+        case OP_WDR:
+            restart_wdt( avr );
+            break;
+
+        case OP_SPM:
+            SREG = s;
+            if ( !do_spm( avr ) ) {
+                avr->stall_cycles = SPM_STALL_CYCLES;
+            }
+            return 1;
+
+        case OP_BREAK:
+            avr->stop = AVR_STOP_BREAK;
+            break;
+
+        default:
+            avr->pc = pc;
+            avr->stop = AVR_STOP_BAD_OP;
+            return 0;
+
+    }
+
+    SREG = s;
+
+    return cycles;
+
+}
+
+// Which clocks keep running in each sleep mode (SM2:0)
+
+static uint8_t io_clock_runs( const avr_t *avr ) {
+
+    if ( !avr->sleeping ) return 1;
+
+    uint8_t sm = ( avr->data[ AVR_SMCR ] >> 1 ) & 0x07;
+
+    return sm == 0 || sm == 1;      // Idle and ADC noise reduction
+
+}
+
+// Can this interrupt wake us from the current sleep mode?
+
+static uint8_t wakes( const avr_t *avr , uint8_t vector ) {
+
+    if ( io_clock_runs( avr ) ) return 1;
+
+    return vector == AVR_VECTOR_WDT || vector == AVR_VECTOR_PCINT0 || vector == AVR_VECTOR_PCINT1 ||
+           vector == AVR_VECTOR_PCINT2 || vector == AVR_VECTOR_INT0 || vector == AVR_VECTOR_INT1 ||
+           vector == AVR_VECTOR_TWI;
+
+}
+
+static inline void elapse( avr_t *avr , uint32_t n , uint8_t cpu ) {
+
+    if ( cpu ) avr->cycles += n;
+
+    if ( io_clock_runs( avr ) ) avr->io_clock += n;
+
+    avr->ticks += (uint64_t) n << avr->clock_shift;
+
+}
+
+uint8_t avr_run( avr_t *avr , uint64_t ticks ) {
+
+    uint64_t end = avr->ticks + ticks;
+
+    avr->stop = AVR_STOP_NONE;
+
+    while ( avr->ticks < end ) {
+
+        if ( avr->io_clock >= avr->next_io_event || avr->ticks >= avr->wdt_due ) {
+            service_peripherals( avr );
+        }
+
+        if ( avr->irq_dirty ) {
+            avr->irq_vector = find_irq( avr );
+            avr->irq_dirty = 0;
+        }
+
+        if ( avr->sleeping ) {
+
+            if ( avr->irq_vector && wakes( avr , avr->irq_vector ) && ( SREG & _BV_( SREG_I ) ) ) {
+
+                avr->sleeping = 0;
+                elapse( avr , 4 , 0 );      // Wake up time
+
+            } else {
+
+                // Skip ahead to whenever something could next happen
+
+                uint64_t until = end;
+
+                if ( avr->wdt_due < until ) until = avr->wdt_due;
+
+                uint64_t n = until > avr->ticks ? ( until - avr->ticks ) >> avr->clock_shift : 0;
+
+                if ( io_clock_runs( avr ) && avr->next_io_event != NEVER && avr->next_io_event - avr->io_clock < n ) {
+                    n = avr->next_io_event - avr->io_clock;
+                }
+
+                elapse( avr , n ? (uint32_t) ( n < 0x10000000 ? n : 0x10000000 ) : 1 , 0 );
+
+                continue;
+
+            }
+
+        }
+
+        if ( avr->irq_vector && ( SREG & _BV_( SREG_I ) ) && !avr->irq_delay ) {
+
+            uint8_t vector = avr->irq_vector;
+
+            elapse( avr , take_irq( avr , vector ) , 1 );
+            continue;
+
+        }
+
+        avr->irq_delay = 0;
+
+        if ( avr->pc == avr->break_addr ) {
+            avr->stop = AVR_STOP_BREAK;
+            return AVR_STOP_BREAK;
+        }
+
+        uint8_t n = step( avr );
+
+        // Timed sequences only stay open for 4 cycles
+
+        if ( avr->wdt_change )   avr->wdt_change   = avr->wdt_change   > n ? avr->wdt_change   - n : 0;
+        if ( avr->clkpr_change ) avr->clkpr_change = avr->clkpr_change > n ? avr->clkpr_change - n : 0;
+        if ( avr->ivce_change )  avr->ivce_change  = avr->ivce_change  > n ? avr->ivce_change  - n : 0;
+        if ( avr->spm_armed )    avr->spm_armed    = avr->spm_armed    > n ? avr->spm_armed    - n : 0;
+
+        elapse( avr , n , 1 );
+
+        if ( avr->stall_cycles ) {
+            elapse( avr , avr->stall_cycles , 1 );
+            avr->stall_cycles = 0;
+        }
+
+        if ( avr->stop ) {
+            return avr->stop;
+        }
+
+    }
+
+    return AVR_STOP_NONE;
+
+}
@@ -0,0 +1,300 @@
+/*
+ * avr_core.h
+ *
+ * A cycle counting emulator for the ATmega168PB in a blink, good enough to run the real BlinkBIOS.hex and
+ * a real sketch ELF side by side.
+ *
+ * It models the whole avr5 instruction set with the datasheet cycle counts, interrupts (including the
+ * IVSEL move up to the bootloader section), sleep, and the peripherals the BIOS actually touches - the
+ * three timers, the watchdog, pin change interrupts, the ADC, the clock prescaler, SPM, and the USART that
+ * the service port uses.
+ *
+ * It knows nothing about IR or LEDs or buttons. Those are just pins. Whatever is driving the emulator
+ * looks at the PORT and DDR registers to see what the firmware is doing and sets the input pin levels
+ * to push back. See blinkemu.cpp for an example.
+ *
+ * Everything lives in one `avr_t` so you can have as many of them as you want.
+ *
+ */
+
+#ifndef AVR_CORE_H_
+#define AVR_CORE_H_
+
+#include <stdint.h>
+
+#define AVR_FLASH_SIZE      0x4000          // Bytes. 16K on the 168.
+#define AVR_DATA_SIZE       0x0500          // Registers + IO + 1K SRAM starting at 0x100
+#define AVR_EEPROM_SIZE     0x0200
+#define AVR_PAGE_SIZE       128             // SPM page size in bytes
+
+#define AVR_BOOT_START      0x3800          // Byte address of the boot section (BOOTSZ for the 2K words the BIOS expects)
+#define AVR_VECTOR_COUNT    27
+
+// Data space addresses of the registers we care about. Same numbers as the datasheet register summary.
+
+#define AVR_PINB    0x23
+#define AVR_DDRB    0x24
+#define AVR_PORTB   0x25
+#define AVR_PINC    0x26
+#define AVR_DDRC    0x27
+#define AVR_PORTC   0x28
+#define AVR_PIND    0x29
+#define AVR_DDRD    0x2A
+#define AVR_PORTD   0x2B
+#define AVR_PINE    0x2C
+#define AVR_DDRE    0x2D
+#define AVR_PORTE   0x2E
+#define AVR_TIFR0   0x35
+#define AVR_TIFR1   0x36
+#define AVR_TIFR2   0x37
+#define AVR_PCIFR   0x3B
+#define AVR_EIFR    0x3C
+#define AVR_EIMSK   0x3D
+#define AVR_EECR    0x3F
+#define AVR_EEDR    0x40
+#define AVR_EEARL   0x41
+#define AVR_EEARH   0x42
+#define AVR_GTCCR   0x43
+#define AVR_TCCR0A  0x44
+#define AVR_TCCR0B  0x45
+#define AVR_TCNT0   0x46
+#define AVR_OCR0A   0x47
+#define AVR_OCR0B   0x48
+#define AVR_SMCR    0x53
+#define AVR_MCUSR   0x54
+#define AVR_MCUCR   0x55
+#define AVR_SPMCSR  0x57
+#define AVR_SPL     0x5D
+#define AVR_SPH     0x5E
+#define AVR_SREG    0x5F
+#define AVR_WDTCSR  0x60
+#define AVR_CLKPR   0x61
+#define AVR_PRR     0x64
+#define AVR_PCICR   0x68
+#define AVR_EICRA   0x69
+#define AVR_PCMSK0  0x6B
+#define AVR_PCMSK1  0x6C
+#define AVR_PCMSK2  0x6D
+#define AVR_TIMSK0  0x6E
+#define AVR_TIMSK1  0x6F
+#define AVR_TIMSK2  0x70
+#define AVR_ADCL    0x78
+#define AVR_ADCH    0x79
+#define AVR_ADCSRA  0x7A
+#define AVR_ADCSRB  0x7B
+#define AVR_ADMUX   0x7C
+#define AVR_TCCR1A  0x80
+#define AVR_TCCR1B  0x81
+#define AVR_TCCR1C  0x82
+#define AVR_TCNT1L  0x84
+#define AVR_TCNT1H  0x85
+#define AVR_ICR1L   0x86
+#define AVR_ICR1H   0x87
+#define AVR_OCR1AL  0x88
+#define AVR_OCR1AH  0x89
+#define AVR_OCR1BL  0x8A
+#define AVR_OCR1BH  0x8B
+#define AVR_TCCR2A  0xB0
+#define AVR_TCCR2B  0xB1
+#define AVR_TCNT2   0xB2
+#define AVR_OCR2A   0xB3
+#define AVR_OCR2B   0xB4
+#define AVR_ASSR    0xB6
+#define AVR_UCSR0A  0xC0
+#define AVR_UCSR0B  0xC1
+#define AVR_UCSR0C  0xC2
+#define AVR_UBRR0L  0xC4
+#define AVR_UBRR0H  0xC5
+#define AVR_UDR0    0xC6
+#define AVR_SNOBR0  0xF0        // The 9 serial number bytes unique to each 168PB
+
+#define AVR_SERIALNO_LEN    9
+
+// Interrupt vector numbers
+
+#define AVR_VECTOR_RESET        0
+#define AVR_VECTOR_INT0         1
+#define AVR_VECTOR_INT1         2
+#define AVR_VECTOR_PCINT0       3
+#define AVR_VECTOR_PCINT1       4
+#define AVR_VECTOR_PCINT2       5
+#define AVR_VECTOR_WDT          6
+#define AVR_VECTOR_TIMER2_COMPA 7
+#define AVR_VECTOR_TIMER2_COMPB 8
+#define AVR_VECTOR_TIMER2_OVF   9
+#define AVR_VECTOR_TIMER1_CAPT  10
+#define AVR_VECTOR_TIMER1_COMPA 11
+#define AVR_VECTOR_TIMER1_COMPB 12
+#define AVR_VECTOR_TIMER1_OVF   13
+#define AVR_VECTOR_TIMER0_COMPA 14
+#define AVR_VECTOR_TIMER0_COMPB 15
+#define AVR_VECTOR_TIMER0_OVF   16
+#define AVR_VECTOR_SPI_STC      17
+#define AVR_VECTOR_USART_RX     18
+#define AVR_VECTOR_USART_UDRE   19
+#define AVR_VECTOR_USART_TX     20
+#define AVR_VECTOR_ADC          21
+#define AVR_VECTOR_EE_READY     22
+#define AVR_VECTOR_ANALOG_COMP  23
+#define AVR_VECTOR_TWI          24
+#define AVR_VECTOR_SPM_READY    25
+
+// Why avr_run() came back
+
+#define AVR_STOP_NONE       0       // Used up all the cycles we were given
+#define AVR_STOP_BREAK      1       // Hit a BREAK instruction or a watched address (see avr_t.break_addr)
+#define AVR_STOP_BAD_OP     2       // Hit something that is not a valid instruction. pc is left pointing at it.
+
+// Everything the emulator needs from whoever is driving it. Any of these can be NULL.
+
+struct avr_t;
+
+struct avr_hooks_t {
+
+    void *ctx;
+
+    // Called after any write to a PORTx or DDRx register so the driver can see the pins change
+
+    void (*port_write)( void *ctx , avr_t *avr , uint16_t addr , uint8_t value );
+
+    // Called with every byte the USART sends
+
+    void (*serial_tx)( void *ctx , avr_t *avr , uint8_t b );
+
+    // Called on every CALL, RCALL, ICALL and RET so a profiler can track who is running.
+    // `sp` is the SP after the return address was pushed (for calls) or before it was popped (for rets),
+    // so a RET with the same `sp` as a CALL is the matching one.
+
+    void (*call)( void *ctx , avr_t *avr , uint16_t target_word , uint16_t sp );
+    void (*ret)( void *ctx , avr_t *avr , uint16_t sp );
+
+    // Called when we enter an interrupt (vector number) and on every RETI
+
+    void (*irq)( void *ctx , avr_t *avr , uint8_t vector );
+    void (*reti)( void *ctx , avr_t *avr );
+
+};
+
+struct avr_timer_t {
+
+    uint64_t last_io;           // io_clock when we last brought this counter up to date
+    uint32_t prescale_count;    // io_clock cycles since the last timer clock
+    uint8_t  down;              // Counting down in phase correct mode
+    uint16_t ocr[2];            // OCRxA/B as the compare unit sees them (PWM modes only update these at TOP)
+    uint64_t next_io;           // io_clock when this timer could next set a flag
+
+};
+
+struct avr_t {
+
+    uint64_t cycles;            // CPU cycles actually executed since power on. Does not count sleep.
+    uint64_t io_clock;          // clk_IO cycles. Same as `cycles` but keeps going in idle sleep.
+    uint64_t ticks;             // Ticks of the undivided 8MHz oscillator. Real time, always going.
+
+    uint16_t pc;                // In words, just like the hardware
+
+    uint8_t data[ AVR_DATA_SIZE ];
+    uint8_t flash[ AVR_FLASH_SIZE ];
+    uint8_t eeprom[ AVR_EEPROM_SIZE ];
+
+    uint8_t pin_input[ 5 ];     // Level driven on each pin of ports B-E from outside when it is an input
+
+    uint8_t serialno[ AVR_SERIALNO_LEN ];
+
+    uint8_t stop;               // Set to one of the AVR_STOP_* codes to make avr_run() come back
+    uint8_t sleeping;
+    uint8_t irq_delay;          // Set after SEI and RETI so one more instruction runs before the next interrupt
+    uint8_t irq_dirty;          // Something changed that could change which interrupt is pending
+    uint8_t irq_vector;         // Highest priority pending and enabled interrupt, or 0 if none
+
+    uint8_t clock_shift;        // CLKPR divides the CPU clock by 1<<clock_shift
+
+    avr_timer_t timer[3];
+
+    uint64_t next_io_event;     // io_clock when a timer, the ADC, or the USART next needs attention
+
+    uint64_t wdt_due;           // `ticks` when the watchdog next fires, or UINT64_MAX if off
+    double   wdt_scale;         // The 128KHz watchdog oscillator is not very accurate. 1.1 = runs 10% slow.
+
+    uint64_t adc_due;           // io_clock when the conversion in progress finishes, or UINT64_MAX if none
+    uint16_t adc_value;         // What the ADC will read. Defaults to a nice full battery.
+
+    uint64_t usart_due;         // io_clock when the byte in the USART shift register finishes, or UINT64_MAX
+    uint8_t  usart_shift;       // Byte being sent
+    uint8_t  usart_pending;     // Byte waiting in UDR0 behind it (when UDRE is clear)
+
+    uint8_t pc_last[3];         // Pin levels at the last pin change check for PCINT0-2
+
+    uint8_t spm_buffer[ AVR_PAGE_SIZE ];
+    uint8_t spm_armed;          // Cycles left after SPMCSR write where SPM is allowed
+    uint32_t stall_cycles;      // CPU is held while a flash page erases or writes
+
+    uint8_t wdt_change;         // Cycles left after WDCE where the prescaler can be changed
+    uint8_t clkpr_change;       // Cycles left after CLKPCE
+    uint8_t ivce_change;        // Cycles left after IVCE where IVSEL can be changed
+
+    uint8_t temp16;             // The shared TEMP register for 16-bit timer access
+
+    uint32_t resets;            // How many times we reset since power on (watchdog, mostly)
+
+    uint16_t break_addr;        // avr_run() stops when pc gets here (words). 0xffff for never.
+
+    avr_hooks_t hooks;
+
+    // Instructions get decoded once into here so we do not have to pick them apart every time through
+
+    struct op_t {
+        uint8_t  kind;
+        uint8_t  a;
+        uint8_t  b;
+        uint16_t k;
+    } ops[ AVR_FLASH_SIZE / 2 ];
+
+};
+
+// Clear the flash to 0xff and power on
+
+void avr_init( avr_t *avr );
+
+// Pin reset
+
+void avr_reset( avr_t *avr );
+
+// Load an Intel HEX file into flash, moved by `offset` bytes. Returns 0 (with a message on stderr) on failure.
+
+uint8_t avr_load_hex( avr_t *avr , const char *filename , int32_t offset );
+
+// Load the flash PT_LOAD segments of an AVR ELF, moved by `offset` bytes. Returns 0 (with a message on stderr) on failure.
+
+uint8_t avr_load_elf( avr_t *avr , const char *filename , int32_t offset );
+
+// Call `cb` with every function symbol in an AVR ELF. Values are flash byte addresses. Returns 0 on failure.
+
+uint8_t avr_elf_symbols( const char *filename , void (*cb)( void *ctx , const char *name , uint32_t value , uint32_t size ) , void *ctx );
+
+// Call after changing flash directly so the decoded ops get updated
+
+void avr_flash_changed( avr_t *avr , uint16_t addr , uint16_t len );
+
+// Run for `ticks` of real time at 8MHz (might go over by the length of one instruction or interrupt).
+// Returns one of the AVR_STOP_* codes.
+
+uint8_t avr_run( avr_t *avr , uint64_t ticks );
+
+// Update the input pin levels seen on a port (0=B, 1=C, 2=D, 3=E). Checks for pin change interrupts.
+
+void avr_set_pins( avr_t *avr , uint8_t port , uint8_t levels );
+
+// Bring the timers up to date. Normally only done lazily as needed.
+
+void avr_sync_timers( avr_t *avr );
+
+// Helpers for reading RAM from outside
+
+#define _BV_(x) ( 1 << (x) )
+
+static inline uint16_t avr_sp( const avr_t *avr ) {
+    return avr->data[ AVR_SPL ] | ( avr->data[ AVR_SPH ] << 8 );
+}
+
+#endif /* AVR_CORE_H_ */
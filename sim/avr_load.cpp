@@ -0,0 +1,259 @@
+/*
+ * avr_load.cpp
+ *
+ * Getting code into an avr_t. Intel HEX for BlinkBIOS.hex, ELF for a sketch straight out of the Arduino build
+ * (which also gets us the symbol table so we know where run() and friends ended up).
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include "avr_core.h"
+
+#ifndef EM_AVR
+    #define EM_AVR 83
+#endif
+
+#define AVR_DATA_OFFSET     0x800000        // Where avr-ld puts data space in the ELF address space
+
+static uint8_t hex_byte( const char *p , uint8_t *ok ) {
+
+    char s[3] = { p[0] , p[1] , 0 };
+    char *end;
+
+    unsigned long v = strtoul( s , &end , 16 );
+
+    if ( end != s + 2 ) *ok = 0;
+
+    return (uint8_t) v;
+
+}
+
+uint8_t avr_load_hex( avr_t *avr , const char *filename , int32_t offset ) {
+
+    FILE *f = fopen( filename , "r" );
+
+    if ( !f ) {
+        perror( filename );
+        return 0;
+    }
+
+    char line[ 600 ];
+    unsigned lineno = 0;
+    uint32_t base = 0;
+    uint32_t low = AVR_FLASH_SIZE , high = 0;
+
+    while ( fgets( line , sizeof( line ) , f ) ) {
+
+        lineno++;
+
+        char *p = line;
+        while ( *p == ' ' || *p == '\t' ) p++;
+
+        if ( *p == '\r' || *p == '\n' || !*p ) continue;
+
+        uint8_t ok = ( *p == ':' );
+        p++;
+
+        uint8_t len = hex_byte( p , &ok );
+
+        if ( !ok || strlen( p ) < (size_t) ( 10 + len * 2 ) ) {
+            fprintf( stderr , "%s:%u: bad hex record\n" , filename , lineno );
+            fclose( f );
+            return 0;
+        }
+
+        uint8_t bytes[ 5 + 255 ];
+        uint8_t sum = 0;
+
+        for( uint16_t i=0; i < 5 + len ; i++ ) {
+            bytes[i] = hex_byte( p + i * 2 , &ok );
+            sum += bytes[i];
+        }
+
+        if ( !ok || sum != 0 ) {
+            fprintf( stderr , "%s:%u: bad hex checksum\n" , filename , lineno );
+            fclose( f );
+            return 0;
+        }
+
+        uint16_t addr = ( bytes[1] << 8 ) | bytes[2];
+        uint8_t type = bytes[3];
+        const uint8_t *data = bytes + 4;
+
+        if ( type == 0x00 ) {
+
+            for( uint8_t i=0; i < len ; i++ ) {
+
+                int32_t a = (int32_t) ( base + addr + i ) + offset;
+
+                if ( a < 0 || a >= AVR_FLASH_SIZE ) {
+                    fprintf( stderr , "%s:%u: address 0x%x does not fit in flash\n" , filename , lineno , (unsigned) a );
+                    fclose( f );
+                    return 0;
+                }
+
+                avr->flash[ a ] = data[i];
+
+                if ( (uint32_t) a < low ) low = a;
+                if ( (uint32_t) a >= high ) high = a + 1;
+
+            }
+
+        } else if ( type == 0x01 ) {
+
+            break;
+
+        } else if ( type == 0x02 ) {
+
+            base = ( ( data[0] << 8 ) | data[1] ) << 4;
+
+        } else if ( type == 0x04 ) {
+
+            base = ( ( data[0] << 8 ) | data[1] ) << 16;
+
+        }
+
+        // Types 3 and 5 are start addresses. The BIOS always starts at the reset vector so we do not care.
+
+    }
+
+    fclose( f );
+
+    if ( high > low ) {
+        avr_flash_changed( avr , low , high - low );
+    }
+
+    return 1;
+
+}
+
+// Read the whole file in. Returns NULL (with a message) if it is not an AVR ELF.
+
+static uint8_t *read_elf( const char *filename , size_t *size_out ) {
+
+    FILE *f = fopen( filename , "rb" );
+
+    if ( !f ) {
+        perror( filename );
+        return NULL;
+    }
+
+    fseek( f , 0 , SEEK_END );
+    long size = ftell( f );
+    fseek( f , 0 , SEEK_SET );
+
+    uint8_t *image = (uint8_t *) malloc( size > 0 ? size : 1 );
+
+    if ( !image || size < (long) sizeof( Elf32_Ehdr ) || fread( image , 1 , size , f ) != (size_t) size ) {
+        fprintf( stderr , "%s: could not read\n" , filename );
+        free( image );
+        fclose( f );
+        return NULL;
+    }
+
+    fclose( f );
+
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *) image;
+
+    if ( memcmp( eh->e_ident , ELFMAG , SELFMAG ) || eh->e_ident[ EI_CLASS ] != ELFCLASS32 || eh->e_machine != EM_AVR ) {
+        fprintf( stderr , "%s: not an AVR ELF file\n" , filename );
+        free( image );
+        return NULL;
+    }
+
+    *size_out = size;
+    return image;
+
+}
+
+uint8_t avr_load_elf( avr_t *avr , const char *filename , int32_t offset ) {
+
+    size_t size;
+    uint8_t *image = read_elf( filename , &size );
+
+    if ( !image ) return 0;
+
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *) image;
+
+    uint8_t loaded = 0;
+
+    for( uint16_t i=0; i < eh->e_phnum ; i++ ) {
+
+        const Elf32_Phdr *ph = (const Elf32_Phdr *) ( image + eh->e_phoff + i * eh->e_phentsize );
+
+        if ( (uint8_t *) ( ph + 1 ) > image + size ) break;
+
+        // Flash contents are anything that has to be loaded below the data space offset.
+        // That includes .datax, which avr5.xn loads AT the end of .text for mainx() to copy into RAM.
+
+        if ( ph->p_type != PT_LOAD || !ph->p_filesz || ph->p_paddr >= AVR_DATA_OFFSET ) continue;
+
+        int32_t addr = (int32_t) ph->p_paddr + offset;
+
+        if ( addr < 0 || addr + ph->p_filesz > AVR_FLASH_SIZE || ph->p_offset + ph->p_filesz > size ) {
+            fprintf( stderr , "%s: segment at 0x%x does not fit in flash\n" , filename , (unsigned) addr );
+            free( image );
+            return 0;
+        }
+
+        memcpy( avr->flash + addr , image + ph->p_offset , ph->p_filesz );
+        avr_flash_changed( avr , addr , ph->p_filesz );
+
+        loaded = 1;
+
+    }
+
+    free( image );
+
+    if ( !loaded ) {
+        fprintf( stderr , "%s: nothing to load into flash\n" , filename );
+    }
+
+    return loaded;
+
+}
+
+uint8_t avr_elf_symbols( const char *filename , void (*cb)( void *ctx , const char *name , uint32_t value , uint32_t size ) , void *ctx ) {
+
+    size_t size;
+    uint8_t *image = read_elf( filename , &size );
+
+    if ( !image ) return 0;
+
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *) image;
+
+    for( uint16_t i=0; i < eh->e_shnum ; i++ ) {
+
+        const Elf32_Shdr *sh = (const Elf32_Shdr *) ( image + eh->e_shoff + i * eh->e_shentsize );
+
+        if ( (uint8_t *) ( sh + 1 ) > image + size ) break;
+
+        if ( sh->sh_type != SHT_SYMTAB || sh->sh_link >= eh->e_shnum ) continue;
+
+        const Elf32_Shdr *strtab = (const Elf32_Shdr *) ( image + eh->e_shoff + sh->sh_link * eh->e_shentsize );
+
+        if ( sh->sh_offset + sh->sh_size > size || strtab->sh_offset + strtab->sh_size > size ) continue;
+
+        const Elf32_Sym *syms = (const Elf32_Sym *) ( image + sh->sh_offset );
+        const char *names = (const char *) ( image + strtab->sh_offset );
+
+        for( uint32_t s=0; s < sh->sh_size / sizeof( Elf32_Sym ) ; s++ ) {
+
+            if ( ELF32_ST_TYPE( syms[s].st_info ) != STT_FUNC && ELF32_ST_TYPE( syms[s].st_info ) != STT_NOTYPE ) continue;
+            if ( syms[s].st_name >= strtab->sh_size ) continue;
+
+            cb( ctx , names + syms[s].st_name , syms[s].st_value , syms[s].st_size );
+
+        }
+
+    }
+
+    free( image );
+
+    return 1;
+
+}
@@ -0,0 +1,371 @@
+/*
+ * blinkbios_sim.cpp
+ *
+ * The simulated BlinkBIOS. See blinkbios_sim.h for the big picture.
+ *
+ * This gets compiled and linked right alongside blinklib and the sketch, so every tile gets its own copy
+ * of all of the state in here.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/io.h>         // WDTCSR
+
+#include "shared/blinkbios_shared_button.h"
+#include "shared/blinkbios_shared_millis.h"
+#include "shared/blinkbios_shared_pixel.h"
+#include "shared/blinkbios_shared_irdata.h"
+
+#include "shared/blinkbios_shared_functions.h"
+
+#include "run.h"
+
+#include "blinkbios_sim.h"
+
+// These timings are our best guess at what the real BIOS does. They match the behavior described in blinklib.cpp.
+
+#define SIM_COLD_SLEEP_TIMEOUT_MS   ( 2 * 60 * 60 * 1000UL )    // BLINKBIOS_POSTPONE_SLEEP_VECTOR pushes cold sleep this far out
+
+#define SIM_BUTTON_CLICK_WINDOW_MS  330     // How long after a release we wait to see if another click is coming
+#define SIM_BUTTON_LONGPRESS_MS     2000    // Down this long counts as a long press (and is not a click)
+#define SIM_BUTTON_3SEC_MS          6000    // Down this long sets BUTTON_BITFLAG_3SECPRESSED (seed mode if alone)
+#define SIM_BUTTON_6SEC_MS          7000    // Down this long sets BUTTON_BITFLAG_6SECPRESSED (force warm sleep)
+
+#define SIM_BLINKBIOS_VERSION       1
+
+// Here are the actual allocations for the shared memory blocks. On the real tile these go into the special
+// `.ipcram` sections (see main.cpp), but here they are just normal globals.
+
+blinkbios_pixelblock_t      blinkbios_pixel_block;
+blinkbios_millis_block_t    blinkbios_millis_block;
+blinkbios_button_block_t    blinkbios_button_block;
+blinkbios_irdata_block_t    blinkbios_irdata_block;
+
+// blinklib reads the serial number from here rather than from the SNOBRx registers in a host build
+
+uint8_t blinkbios_sim_serialno[ BLINKBIOS_SIM_SERIALNO_LEN ];
+
+// Stand in for the watchdog control register. blinklib turns on the WDT interrupt in randomize().
+
+volatile uint8_t blinkbios_sim_wdtcsr;
+
+const blinkbios_sim_port_t *blinkbios_sim_port;         // Also used by sp_sim.cpp for the serial port
+
+static uint16_t sub_millis_us;          // Microseconds past the current millis. Kept so step_8us stays right.
+
+static uint8_t sleeping;                // 1 while in cold sleep. millis do not advance while we are sleeping.
+
+static uint8_t button_requested;        // What the driver wants the button to be. We pick it up on the next millisecond.
+
+static uint32_t entropy_state = 2463534242UL;      // Used to fake the WDT jitter. Mixed with the serial number on attach.
+
+extern "C" void blinkbios_sim_attach( const blinkbios_sim_port_t *p , const uint8_t *serialno ) {
+
+    blinkbios_sim_port = p;
+
+    memcpy( blinkbios_sim_serialno , serialno , BLINKBIOS_SIM_SERIALNO_LEN );
+
+    for( uint8_t i=0; i < BLINKBIOS_SIM_SERIALNO_LEN ; i++ ) {
+        entropy_state = ( entropy_state * 31 ) + serialno[i];
+    }
+
+    if (!entropy_state) entropy_state=1;        // xorshift must never be 0
+
+    blinkbios_millis_block.sleep_time = SIM_COLD_SLEEP_TIMEOUT_MS;
+
+    blinkbios_pixel_block.start_state = BLINKBIOS_START_STATE_POWER_UP;
+
+}
+
+static void postpone_sleep() {
+    blinkbios_millis_block.sleep_time = blinkbios_millis_block.millis + SIM_COLD_SLEEP_TIMEOUT_MS;
+}
+
+// The real BIOS wakes when the button goes down. It sets wokeFlag to 0 so the game can tell.
+
+static void wake() {
+
+    sleeping = 0;
+    blinkbios_button_block.wokeFlag = 0;
+    postpone_sleep();
+
+}
+
+// Runs once per simulated millisecond, but only while there is something for the button to do
+
+static void button_tick() {
+
+    blinkbios_button_block_t *b = &blinkbios_button_block;
+
+    if ( button_requested != b->down ) {
+
+        b->down = button_requested;
+
+        if (b->down) {
+
+            b->bitflags |= BUTTON_BITFLAG_PRESSED;
+            b->pressCountup = 0;
+            b->longpressRegisteredFlag = 0;
+            b->clickWindowCountdown = 0;        // Any click window stays open while the button is down
+
+            postpone_sleep();
+
+        } else {
+
+            b->bitflags |= BUTTON_BITFLAG_RELEASED;
+
+            if ( b->pressCountup < SIM_BUTTON_LONGPRESS_MS ) {
+
+                b->clickPendingcount++;
+                b->clickWindowCountdown = SIM_BUTTON_CLICK_WINDOW_MS;
+
+            } else {
+
+                // Held too long on the last click, so the whole click interaction is aborted
+
+                b->clickPendingcount = 0;
+
+            }
+
+        }
+
+        return;
+
+    }
+
+    if (b->down) {
+
+        b->pressCountup++;
+
+        if ( b->pressCountup == SIM_BUTTON_LONGPRESS_MS && !b->longpressRegisteredFlag ) {
+            b->bitflags |= BUTTON_BITFLAG_LONGPRESSED;
+            b->longpressRegisteredFlag = 1;
+        }
+
+        if ( b->pressCountup == SIM_BUTTON_3SEC_MS ) {
+            b->bitflags |= BUTTON_BITFLAG_3SECPRESSED;
+        }
+
+        if ( b->pressCountup == SIM_BUTTON_6SEC_MS ) {
+            b->bitflags |= BUTTON_BITFLAG_6SECPRESSED;
+        }
+
+    } else if ( b->clickWindowCountdown ) {
+
+        b->clickWindowCountdown--;
+
+        if ( !b->clickWindowCountdown ) {
+
+            b->clickcount = b->clickPendingcount;
+
+            if ( b->clickPendingcount == 1 ) {
+                b->bitflags |= BUTTON_BITFLAG_SINGLECLICKED;
+            } else if ( b->clickPendingcount == 2 ) {
+                b->bitflags |= BUTTON_BITFLAG_DOUBLECLICKED;
+            } else {
+                b->bitflags |= BUTTON_BITFLAG_MULITCLICKED;
+            }
+
+            b->clickPendingcount = 0;
+
+        }
+
+    }
+
+}
+
+extern "C" void blinkbios_sim_advance( uint32_t us ) {
+
+    if (sleeping) {
+
+        // Time goes by, but millis stands still while we sleep. Only the button can wake us.
+
+        if (button_requested) {
+            wake();
+        }
+
+        return;
+    }
+
+    uint32_t total_us = sub_millis_us + us;
+    uint32_t elapsed_ms = total_us / 1000;
+
+    sub_millis_us = total_us % 1000;
+
+    if ( blinkbios_button_block.down || button_requested || blinkbios_button_block.clickWindowCountdown ) {
+
+        // Step one ms at a time so click windows and long presses land on the right millisecond
+
+        while (elapsed_ms--) {
+
+            blinkbios_millis_block.millis++;
+            button_tick();
+
+        }
+
+    } else {
+
+        blinkbios_millis_block.millis += elapsed_ms;
+
+    }
+
+    blinkbios_millis_block.step_8us = sub_millis_us / 8;
+
+    if ( blinkbios_millis_block.millis > blinkbios_millis_block.sleep_time ) {
+
+        // Cold sleep. The pixels go dark and the IR goes quiet until someone presses the button.
+
+        sleeping = 1;
+
+    }
+
+}
+
+extern "C" void blinkbios_sim_button( uint8_t down ) {
+    button_requested = down;
+}
+
+extern "C" uint8_t blinkbios_sim_ir_receive( uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    ir_rx_state_t *ir_rx_state = &blinkbios_irdata_block.ir_rx_states[face];
+
+    if ( sleeping || ir_rx_state->packetBufferReady || len == 0 || len > IR_RX_PACKET_SIZE ) {
+
+        // The real BIOS will not start receiving into a buffer that the foreground has not read yet
+
+        return 0;
+    }
+
+    ir_rx_state->packetBuffer[0] = IR_USER_DATA_HEADER_BYTE;
+    memcpy( (uint8_t *) ir_rx_state->packetBuffer + 1 , data , len );
+    ir_rx_state->packetBufferLen = len + 1;         // The length includes the type byte
+
+    ir_rx_state->packetBufferReady = 1;
+
+    return 1;
+
+}
+
+extern "C" void blinkbios_sim_ir_rx_active( uint8_t face , uint8_t active ) {
+
+    // The real RX ISR primes byteBuffer with a 1 when it sees a valid start and shifts bits up from there,
+    // so it is nonzero the whole time a byte is coming in
+
+    blinkbios_irdata_block.ir_rx_states[face].byteBuffer = active ? 1 : 0;
+
+}
+
+extern "C" uint8_t blinkbios_sim_sleeping( void ) {
+    return sleeping;
+}
+
+// Give the driver a turn. If we fell asleep in the meantime, then we park right here until woken just like
+// a real tile would when the BIOS puts the CPU into power down in the middle of whatever it was doing.
+
+static void yield( uint8_t reason ) {
+
+    blinkbios_sim_port->yield( blinkbios_sim_port->ctx , reason , 0 );
+
+    while (sleeping) {
+        blinkbios_sim_port->yield( blinkbios_sim_port->ctx , BLINKBIOS_SIM_YIELD_SLEEP , 0 );
+    }
+
+}
+
+static void __attribute__((noreturn)) halt( uint8_t code ) {
+
+    blinkbios_sim_port->yield( blinkbios_sim_port->ctx , BLINKBIOS_SIM_YIELD_HALT , code );
+
+    // Driver promised to never come back here
+    __builtin_unreachable();
+
+}
+
+// Called by blinklib from any busy-wait loop. This is where things that happen in ISRs on the
+// real tile get their chance to run.
+
+extern "C" void blinkbios_sim_spin( void ) {
+
+    if ( blinkbios_sim_wdtcsr & _BV( WDIE ) ) {
+
+        // The WDT ISR captures TCNT0, which is effectively random because the WDT runs off its own oscillator
+
+        uint32_t x = entropy_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        entropy_state = x;
+
+        blinkbios_pixel_block.capturedEntropy = (uint8_t) x;
+
+    }
+
+    yield( BLINKBIOS_SIM_YIELD_SPIN );
+
+}
+
+// --- Here are the actual entry points
+
+extern "C" uint8_t BLINKBIOS_IRDATA_SEND_PACKET_VECTOR(  uint8_t face, const uint8_t *data , uint8_t len ) {
+
+    if ( sleeping ) {
+        return 0;
+    }
+
+    return blinkbios_sim_port->ir_send( blinkbios_sim_port->ctx , face , data , len );
+
+}
+
+extern "C" void BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR() {
+
+    // The real BIOS waits for the next vertical blanking interval here, so this is the end of the frame
+
+    yield( BLINKBIOS_SIM_YIELD_FRAME );
+
+}
+
+extern "C" void BLINKBIOS_BOOTLOADER_SEED_VECTOR() {
+
+    // We can not send the game anywhere, so this is the end of the line for this tile
+
+    halt( 0 );
+
+}
+
+extern "C" void BLINKBIOS_POSTPONE_SLEEP_VECTOR() {
+    postpone_sleep();
+}
+
+extern "C" void BLINKBIOS_SLEEP_NOW_VECTOR() {
+
+    sleeping = 1;
+
+    yield( BLINKBIOS_SIM_YIELD_SLEEP );
+
+}
+
+extern "C" void BLINKBIOS_WRITE_FLASH_PAGE_VECTOR(uint8_t page) {
+
+    // No flash to write to
+
+    (void) page;
+
+}
+
+extern "C" uint8_t BLINKBIOS_VERSION_VECTOR() {
+    return SIM_BLINKBIOS_VERSION;
+}
+
+extern "C" void BLINKBIOS_ABEND_VECTOR( uint8_t blinkCount ) {
+
+    halt( blinkCount );
+
+}
+
+extern "C" void blinkbios_sim_main( void ) {
+
+    run();
+
+}
@@ -0,0 +1,88 @@
+/*
+ * blinkbios_sim.h
+ *
+ * A stand-in for the BlinkBIOS that lets blinklib and a sketch run as a normal program on the host.
+ *
+ * On a real tile, the BlinkBIOS lives up in the bootloader area and talks to the game through the shared
+ * memory blocks and the `boot_vectorN` entry points. Here we provide the exact same blocks and entry points,
+ * but instead of ISRs updating things in the background, the simulated BIOS only runs when the tile calls
+ * into it. The most important call is BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR, which happens once per frame.
+ * That is where we hand control to the driver so it can advance the virtual clock, deliver IR packets,
+ * push the button, or go run some other tile for a while.
+ *
+ * Time is virtual. It only moves when the driver calls blinkbios_sim_advance(), so a simulated hour
+ * takes as long as it takes to run the frames in it - a few seconds for most sketches.
+ *
+ * Everything here is plain C linkage so a driver can find these with dlsym() when the tile is loaded
+ * as a shared object.
+ *
+ */
+
+#ifndef BLINKBIOS_SIM_H_
+#define BLINKBIOS_SIM_H_
+
+#include <stdint.h>
+
+#define BLINKBIOS_SIM_SERIALNO_LEN  9       // Matches SERIAL_NUMBER_LEN in blinklib.h
+
+// Why the tile called back into the driver
+
+#define BLINKBIOS_SIM_YIELD_FRAME   0       // Display was updated, so this frame is done
+#define BLINKBIOS_SIM_YIELD_SPIN    1       // Tile is busy-waiting on something that only the BIOS can change
+#define BLINKBIOS_SIM_YIELD_SLEEP   2       // Tile is in cold sleep and will stay here until the button is pressed
+#define BLINKBIOS_SIM_YIELD_HALT    3       // Tile entered seed mode or ABENDed. Never resume it again.
+
+// Everything the simulated BIOS needs from whatever is driving the tile
+
+struct blinkbios_sim_port_t {
+
+    void *ctx;                  // Passed back to each of the callbacks
+
+    // Called with one of the BLINKBIOS_SIM_YIELD_* reasons. The driver should call blinkbios_sim_advance() before
+    // returning (except for HALT, where it must not return at all).
+
+    void (*yield)( void *ctx , uint8_t reason , uint8_t code );
+
+    // Called for every IR packet the tile sends. `data` is the user payload without the BIOS header byte.
+    // Returns 1 if the packet was sent, or 0 if it was refused (like when an RX is in progress on that face).
+
+    uint8_t (*ir_send)( void *ctx , uint8_t face , const uint8_t *data , uint8_t len );
+
+    // Called for every byte written to the service port serial
+
+    void (*serial_tx)( void *ctx , uint8_t b );
+
+};
+
+// Connect the BIOS to its driver and set the serial number this tile will report. Call before run().
+
+extern "C" void blinkbios_sim_attach( const blinkbios_sim_port_t *port , const uint8_t *serialno );
+
+// Move the virtual clock forward. Runs anything the BIOS ISRs would have done in that time
+// (millis, button debounce and click timing, sleep timeout).
+
+extern "C" void blinkbios_sim_advance( uint32_t us );
+
+// Push or release the button
+
+extern "C" void blinkbios_sim_button( uint8_t down );
+
+// An IR packet arrived on `face`. Returns 1 if it was put into the packet buffer, or 0 if it was
+// dropped because the previous packet on that face had not been read yet.
+
+extern "C" uint8_t blinkbios_sim_ir_receive( uint8_t face , const uint8_t *data , uint8_t len );
+
+// Tell the BIOS that bits are (or are no longer) coming in on `face`. While active, blinkbios_is_rx_in_progress()
+// returns true for that face just like it does on a real tile between the end of the leading sync and the last byte.
+
+extern "C" void blinkbios_sim_ir_rx_active( uint8_t face , uint8_t active );
+
+// 1 if the tile is currently in cold sleep
+
+extern "C" uint8_t blinkbios_sim_sleeping( void );
+
+// Start the tile. Just like mainx() in the core main.cpp, this calls into blinklib's run() and never returns.
+
+extern "C" void blinkbios_sim_main( void );
+
+#endif /* BLINKBIOS_SIM_H_ */
@@ -0,0 +1,1249 @@
+/*
+ * blinkcluster.cpp
+ *
+ * Runs a whole cluster of simulated tiles on a hex lattice, spread across all the CPU cores.
+ *
+ * Each tile is its own copy of the tile image (blinklib + sketch + simulated BIOS built as a shared object),
+ * so every tile gets its own globals just like on real hardware. We get those separate copies by loading the
+ * same image over and over from anonymous memory files since dlopen() will not load the same file twice.
+ *
+ * Each tile runs on its own little stack as a coroutine. It runs until it finishes a frame (or starts spinning
+ * waiting on the BIOS) and then hands control back to whichever worker thread resumed it. This way any tile can
+ * be picked up by any worker on any frame.
+ *
+ * Every frame has two phases with a barrier after each...
+ *
+ *   1. RUN: Every tile runs one frame. Packets sent on each face are collected in that tile's outbox.
+ *   2. DELIVER: Every tile picks up what its neighbors sent toward it into the BIOS packet buffer on the facing face.
+ *
+ * Both phases hand out tiles with a work-stealing scheduler. Because no tile can see anything another tile did in
+ * the same phase, the results are the same no matter how many threads we use or who ran what.
+ *
+ * The IR link in this mode is perfect - every packet arrives instantly unless the receiving buffer is still full.
+ *
+ * With `-e` we instead run a discrete-event model of the IR channel. Every tile keeps its own virtual clock and
+ * we always resume whichever tile is furthest behind. A packet takes time on the air depending on its length and the
+ * sender is stuck in the BIOS until it is done, just like on a real tile. The link is half-duplex, so if both ends
+ * transmit at the same time then both packets are lost, and a send is refused if bits are already coming in on that
+ * face (the `blinkbios_is_rx_in_progress()` check in the BIOS). Since events only ever need to be handled in time order,
+ * this mode runs on a single thread.
+ *
+ * Either way, you can also have packets randomly lost or bits flipped. Which packets get hit only depends on the seed and
+ * on who sent what, so you can compare two versions of a protocol against the exact same bad luck.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "blinkbios_sim.h"
+
+#define FACE_COUNT          6
+
+#define DEFAULT_TILES       100
+#define DEFAULT_SECONDS     60
+#define DEFAULT_FRAME_US    55555           // About 18 frames per second, same as blinksim
+#define CLICK_DOWN_MS       100
+#define SPIN_US             1000            // How much time passes each time a tile spins waiting on the BIOS, same as blinksim
+
+#define TILE_STACK_SIZE     ( 64 * 1024 )   // Only the pages a tile actually touches ever get allocated
+
+#define OUTBOX_SIZE         16              // Packets per face per frame. Warm sleep splats 5 per face, nothing else sends more than 1.
+#define MAX_PACKET_LEN      64
+
+// IR timing for the event model. These are our best guess at the real BIOS and can be changed with `-b`.
+// The BIOS puts its own type byte in front of every packet, so that gets counted in the airtime too.
+
+#define DEFAULT_IR_BIT_US   100             // Length of one bit time on the air
+#define IR_SYNC_BITS        3               // Leading sync before the first byte. A collision can still sneak in here.
+#define IR_BYTE_BITS        10              // Start bit, 8 data bits, and the gap after
+
+// The entry points we look up in each copy of the tile image
+
+struct tile_api_t {
+    void    (*attach)( const blinkbios_sim_port_t *port , const uint8_t *serialno );
+    void    (*advance)( uint32_t us );
+    void    (*button)( uint8_t down );
+    uint8_t (*ir_receive)( uint8_t face , const uint8_t *data , uint8_t len );
+    void    (*rx_active)( uint8_t face , uint8_t active );
+    void    (*main)( void );
+};
+
+struct packet_t {
+    uint32_t seq;
+    uint8_t len;
+    uint8_t data[ MAX_PACKET_LEN ];
+};
+
+struct tile_t {
+
+    tile_api_t api;
+
+    blinkbios_sim_port_t port;
+
+    ucontext_t ctx;
+    ucontext_t *return_ctx;         // Context of the worker that resumed us. We go back there on yield.
+
+    int32_t neighbor[ FACE_COUNT ]; // Index of the tile touching each face, or -1 for nobody
+    uint8_t neighbor_face[ FACE_COUNT ];    // Which of the neighbor's faces is touching each of ours
+
+    uint8_t halted;
+    uint8_t started;
+    uint8_t sleeping;
+
+    uint64_t removed_us;            // Pulled out of the cluster at this virtual time (-k), or 0 for never
+
+    uint8_t outbox_count[ FACE_COUNT ];
+    packet_t outbox[ FACE_COUNT ][ OUTBOX_SIZE ];
+
+    uint32_t click_phase_ms;
+
+    uint32_t tx_seq[ FACE_COUNT ];  // Packets sent so far on each face. Picks which ones the fault injection hits.
+
+    // Only used by the event model
+
+    uint64_t now_us;                // This tile's own virtual clock
+    uint64_t bios_us;               // How far we have moved the BIOS clock so far
+    uint64_t phase_us;              // Where in the frame this tile's display updates land
+
+    uint64_t tx_until[ FACE_COUNT ];    // We are transmitting on this face until this time
+    int32_t  rx_xmit[ FACE_COUNT ];     // The transmission currently coming in on this face, or -1
+
+    uint64_t frames;
+
+    uint64_t packets_sent;
+    uint64_t packets_delivered;
+    uint64_t packets_dropped;       // Made it here but the packet buffer was still full (or we were asleep)
+    uint64_t packets_refused;       // We tried to send but there was an RX in progress on that face
+    uint64_t packets_collided;      // Coming to us, but we were transmitting on that face at the same time
+    uint64_t packets_lost;          // Coming to us, but fault injection ate it
+    uint64_t packets_corrupted;     // Coming to us, and fault injection flipped some bits on the way
+    uint64_t bytes_delivered;
+
+    std::vector<char> serial_line;  // Service port output waiting for a newline
+    uint64_t serial_line_us;        // When the first character of it came out
+
+    double clock_scale;             // How fast this tile's millis run compared to real time
+    double clock_carry_us;          // Fraction of a us we still owe the BIOS clock
+
+};
+
+static std::vector<tile_t> tiles;
+
+static uint32_t frame_us = DEFAULT_FRAME_US;
+static uint32_t click_period_ms;
+static uint8_t quiet;
+
+static uint64_t now_us;             // Virtual time. Only changes between frames (or between events with `-e`).
+
+static uint8_t  event_mode;
+static uint32_t ir_bit_us = DEFAULT_IR_BIT_US;
+static double   loss_rate;          // Chance any one packet is lost
+static double   bit_error_rate;     // Chance any one bit is flipped
+static uint64_t channel_seed;
+static uint64_t apart_us;           // Tiles can not hear each other until this virtual time, like they were all pushed together right then
+static double   clock_error;        // Each tile's millis run up to this fraction fast or slow
+static uint8_t  timestamps;         // Put the virtual time on each line of service port output
+static uint8_t  rotate_tiles;       // Turn each tile a random number of faces
+
+struct removal_t {
+    uint32_t tile;
+    uint64_t at_us;
+};
+
+static std::vector<removal_t> removals;     // -k
+
+// --- Hex lattice
+
+// We lay the tiles out as a parallelogram in axial hex coordinates, `width` tiles per row.
+// Face f on a tile points in direction (f+rotation)%6, and direction d and (d+3)%6 are opposite, so with no rotation the face
+// touching our face f is (f+3)%6 on the neighbor.
+
+static const int8_t face_dq[ FACE_COUNT ] = { +1 , +1 ,  0 , -1 , -1 ,  0 };
+static const int8_t face_dr[ FACE_COUNT ] = {  0 , -1 , -1 ,  0 , +1 , +1 };
+
+static uint64_t splitmix64( uint64_t x );
+static double unit_random( uint64_t x );
+
+static uint8_t tile_rotation( uint32_t i ) {
+
+    if ( !rotate_tiles ) return 0;
+
+    return (uint8_t) ( unit_random( splitmix64( channel_seed ^ 0x707aULL ) + i ) * FACE_COUNT ) % FACE_COUNT;
+
+}
+
+// True if packets can get from tile t to its neighbor n right now
+
+static bool is_linked( const tile_t *t , int32_t n , uint64_t now ) {
+
+    if ( n < 0 || now < apart_us ) return false;
+
+    const tile_t *o = &tiles[n];
+
+    if ( t->removed_us && now >= t->removed_us ) return false;
+    if ( o->removed_us && now >= o->removed_us ) return false;
+
+    return true;
+
+}
+
+static void build_lattice( uint32_t count , uint32_t width ) {
+
+    for( uint32_t i=0; i < count ; i++ ) {
+
+        int32_t q = i % width;
+        int32_t r = i / width;
+
+        uint8_t rot = tile_rotation( i );
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+            uint8_t d = ( f + rot ) % FACE_COUNT;
+
+            int32_t nq = q + face_dq[d];
+            int32_t nr = r + face_dr[d];
+
+            int32_t n = nr * (int32_t) width + nq;
+
+            if ( nq < 0 || nq >= (int32_t) width || nr < 0 || n >= (int32_t) count ) {
+                tiles[i].neighbor[f] = -1;
+            } else {
+                tiles[i].neighbor[f] = n;
+                tiles[i].neighbor_face[f] = ( d + 3 + FACE_COUNT - tile_rotation( n ) ) % FACE_COUNT;
+            }
+
+        }
+
+    }
+
+}
+
+// --- Fault injection
+
+static uint64_t splitmix64( uint64_t x ) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+
+}
+
+// A number in [0,1) that only depends on `x`
+
+static double unit_random( uint64_t x ) {
+    return ( splitmix64( x ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+#define FAULT_OK          0
+#define FAULT_LOST        1
+#define FAULT_CORRUPTED   2
+
+// Decide what happens to the `seq`th packet sent by tile `from` on `face`. Might flip bits in `data`.
+// Packets are picked by a hash rather than a running random number so that it does not matter in what order
+// we get to them, or how many threads are doing it.
+
+static uint8_t inject_faults( uint32_t from , uint8_t face , uint32_t seq , uint8_t *data , uint8_t len ) {
+
+    if ( !loss_rate && !bit_error_rate ) return FAULT_OK;
+
+    uint64_t key = splitmix64( channel_seed ^ ( ( (uint64_t) from << 32 ) | ( (uint64_t) face << 29 ) | seq ) );
+
+    if ( loss_rate && unit_random( key ) < loss_rate ) {
+        return FAULT_LOST;
+    }
+
+    uint8_t result = FAULT_OK;
+
+    if ( bit_error_rate ) {
+
+        for( uint16_t bit=0; bit < len * 8 ; bit++ ) {
+
+            if ( unit_random( key + 1 + bit ) < bit_error_rate ) {
+                data[ bit / 8 ] ^= 1 << ( bit % 8 );
+                result = FAULT_CORRUPTED;
+            }
+
+        }
+
+    }
+
+    return result;
+
+}
+
+// Hand a packet that made it across the link to the receiving tile's BIOS
+
+static void receive_packet( tile_t *t , uint8_t face , uint32_t from , uint8_t from_face , uint32_t seq , const uint8_t *data , uint8_t len ) {
+
+    uint8_t buffer[ MAX_PACKET_LEN ];
+    memcpy( buffer , data , len );
+
+    uint8_t fault = inject_faults( from , from_face , seq , buffer , len );
+
+    if ( fault == FAULT_LOST ) {
+        t->packets_lost++;
+        return;
+    }
+
+    if ( fault == FAULT_CORRUPTED ) {
+        t->packets_corrupted++;
+    }
+
+    if ( t->api.ir_receive( face , buffer , len ) ) {
+        t->packets_delivered++;
+        t->bytes_delivered += len;
+    } else {
+        t->packets_dropped++;
+    }
+
+}
+
+// --- Work stealing
+
+// Each worker owns a range of tile indexes packed into one atomic word so that both ends can be updated with a single CAS.
+// The owner takes small chunks off the front. When a worker runs dry, it steals the back half of the biggest range it can find.
+
+#define STEAL_CHUNK 16
+
+struct alignas(64) worker_t {
+
+    std::atomic<uint64_t> range;        // begin in the low 32 bits, end in the high 32 bits
+
+    ucontext_t sched_ctx;               // Tiles we resume swap back to here
+
+    uint64_t steals;
+    uint64_t tiles_run;
+
+};
+
+static std::vector<worker_t> workers;
+
+static uint64_t pack_range( uint32_t begin , uint32_t end ) {
+    return ( (uint64_t) end << 32 ) | begin;
+}
+
+// Take up to STEAL_CHUNK tiles off the front of our own range. Returns 0 if empty.
+
+static uint8_t take_front( worker_t *w , uint32_t *begin , uint32_t *end ) {
+
+    uint64_t r = w->range.load();
+
+    while (1) {
+
+        uint32_t b = (uint32_t) r;
+        uint32_t e = (uint32_t) ( r >> 32 );
+
+        if ( b >= e ) return 0;
+
+        uint32_t nb = ( e - b > STEAL_CHUNK ) ? b + STEAL_CHUNK : e;
+
+        if ( w->range.compare_exchange_weak( r , pack_range( nb , e ) ) ) {
+            *begin = b;
+            *end = nb;
+            return 1;
+        }
+
+    }
+
+}
+
+// Steal the back half of some other worker's range into our own. Returns 0 if everyone is empty.
+
+static uint8_t steal( worker_t *self ) {
+
+    uint32_t nworkers = workers.size();
+    uint32_t start = self - &workers[0];
+
+    for( uint32_t i=1; i < nworkers ; i++ ) {
+
+        worker_t *victim = &workers[ ( start + i ) % nworkers ];
+
+        uint64_t r = victim->range.load();
+
+        while (1) {
+
+            uint32_t b = (uint32_t) r;
+            uint32_t e = (uint32_t) ( r >> 32 );
+
+            if ( b >= e ) break;
+
+            uint32_t mid = b + ( e - b ) / 2;
+
+            if ( victim->range.compare_exchange_weak( r , pack_range( b , mid ) ) ) {
+                self->range.store( pack_range( mid , e ) );
+                self->steals++;
+                return 1;
+            }
+
+        }
+
+    }
+
+    return 0;
+
+}
+
+static void split_work( uint32_t count ) {
+
+    uint32_t nworkers = workers.size();
+
+    for( uint32_t w=0; w < nworkers ; w++ ) {
+        workers[w].range.store( pack_range( count * w / nworkers , count * ( w + 1 ) / nworkers ) );
+    }
+
+}
+
+// --- The event model
+
+// A packet on the air between two tiles
+
+struct xmit_t {
+
+    uint32_t from;
+    uint8_t  from_face;
+    uint32_t to;
+    uint8_t  to_face;
+
+    uint32_t seq;
+
+    uint64_t start_us;
+    uint64_t end_us;
+
+    uint8_t collided;
+
+    uint8_t len;
+    uint8_t data[ MAX_PACKET_LEN ];
+
+};
+
+static std::vector<xmit_t> xmits;           // Only the ones in flight are used. Freed slots get reused.
+static std::vector<uint32_t> free_xmits;
+
+// Events at the same time go in this order, so a tile always sees anything that finished arriving at the same
+// moment it woke up, and always sees an RX that started at the same moment it tries to send
+
+#define EVENT_RX_END        0
+#define EVENT_RX_START      1
+#define EVENT_RESUME        2
+
+struct event_t {
+
+    uint64_t time_us;
+    uint8_t  type;
+    uint64_t order;         // Breaks any remaining ties by when the event was scheduled
+    uint32_t index;         // Tile for RESUME, otherwise xmit
+
+    bool operator<( const event_t &e ) const {
+
+        // priority_queue puts the biggest on top, so this is backwards
+
+        if ( time_us != e.time_us ) return time_us > e.time_us;
+        if ( type != e.type ) return type > e.type;
+        return order > e.order;
+
+    }
+
+};
+
+static std::priority_queue<event_t> events;
+static uint64_t event_order;
+
+static ucontext_t event_sched_ctx;
+
+static void schedule( uint64_t time_us , uint8_t type , uint32_t index ) {
+
+    event_t e = { time_us , type , event_order++ , index };
+    events.push( e );
+
+}
+
+static uint32_t airtime_us( uint8_t len ) {
+
+    return ir_bit_us * ( IR_SYNC_BITS + ( len + 1 ) * IR_BYTE_BITS );      // +1 for the BIOS type byte
+
+}
+
+static uint32_t sync_us() {
+    return ir_bit_us * IR_SYNC_BITS;
+}
+
+static uint32_t tile_index( tile_t *t ) {
+    return t - &tiles[0];
+}
+
+// Move the tile's BIOS clock along by `us` of virtual time, but at its own slightly wrong speed
+
+static void advance_tile( tile_t *t , uint64_t us ) {
+
+    double scaled = us * t->clock_scale + t->clock_carry_us;
+    uint32_t whole = (uint32_t) scaled;
+
+    t->clock_carry_us = scaled - whole;
+
+    t->api.advance( whole );
+
+}
+
+// Called on the tile's stack. Go back to the scheduler and do not come back until our clock gets to `wake_us`.
+
+static void tile_wait_until( tile_t *t , uint64_t wake_us ) {
+
+    schedule( wake_us , EVENT_RESUME , tile_index( t ) );
+
+    swapcontext( &t->ctx , t->return_ctx );
+
+    // Let the BIOS catch up on everything that happened while we were away
+
+    if ( click_period_ms ) {
+        t->api.button( ( t->now_us / 1000 + t->click_phase_ms ) % click_period_ms < CLICK_DOWN_MS );
+    }
+
+    advance_tile( t , t->now_us - t->bios_us );
+    t->bios_us = t->now_us;
+
+}
+
+static uint8_t event_ir_send( tile_t *t , uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    uint64_t now = t->now_us;
+
+    int32_t incoming = t->rx_xmit[ face ];
+
+    if ( incoming >= 0 ) {
+
+        xmit_t *x = &xmits[ incoming ];
+
+        if ( now >= x->start_us + sync_us() ) {
+
+            // The BIOS can already see the bits coming in, so it refuses to send
+
+            t->packets_refused++;
+            return 0;
+
+        }
+
+        // Still in the leading sync, so nobody can tell yet. We walk right over it.
+
+        x->collided = 1;
+
+    }
+
+    uint32_t seq = t->tx_seq[ face ]++;
+    uint32_t airtime = airtime_us( len );
+
+    t->tx_until[ face ] = now + airtime;
+
+    int32_t n = t->neighbor[ face ];
+
+    if ( is_linked( t , n , now ) && len <= MAX_PACKET_LEN ) {
+
+        uint32_t i;
+
+        if ( free_xmits.empty() ) {
+            i = xmits.size();
+            xmits.push_back( xmit_t() );
+        } else {
+            i = free_xmits.back();
+            free_xmits.pop_back();
+        }
+
+        xmit_t *x = &xmits[i];
+
+        x->from = tile_index( t );
+        x->from_face = face;
+        x->to = n;
+        x->to_face = t->neighbor_face[ face ];
+        x->seq = seq;
+        x->start_us = now;
+        x->end_us = now + airtime;
+        x->len = len;
+        memcpy( x->data , data , len );
+
+        // Half-duplex. If they are sending to us right now then they will never hear this.
+
+        tile_t *r = &tiles[n];
+
+        x->collided = ( r->tx_until[ x->to_face ] > now );
+
+        r->rx_xmit[ x->to_face ] = i;
+
+        schedule( x->start_us + sync_us() , EVENT_RX_START , i );
+        schedule( x->end_us , EVENT_RX_END , i );
+
+    }
+
+    // The BIOS does not come back until the whole packet is out
+
+    tile_wait_until( t , now + airtime );
+
+    return 1;
+
+}
+
+static void event_yield( tile_t *t , uint8_t reason ) {
+
+    uint64_t wake_us;
+
+    if ( reason == BLINKBIOS_SIM_YIELD_FRAME ) {
+
+        // Display waits for our next refresh
+
+        t->frames++;
+        wake_us = t->phase_us + ( ( t->now_us - t->phase_us ) / frame_us + 1 ) * frame_us;
+
+    } else if ( reason == BLINKBIOS_SIM_YIELD_SPIN ) {
+
+        wake_us = t->now_us + SPIN_US;
+
+    } else {
+
+        wake_us = t->now_us + frame_us;
+
+    }
+
+    tile_wait_until( t , wake_us );
+
+}
+
+static void event_rx_start( xmit_t *x ) {
+
+    tile_t *r = &tiles[ x->to ];
+
+    r->api.rx_active( x->to_face , 1 );
+
+}
+
+static void event_rx_end( uint32_t i ) {
+
+    xmit_t *x = &xmits[i];
+    tile_t *r = &tiles[ x->to ];
+
+    r->api.rx_active( x->to_face , 0 );
+
+    if ( r->rx_xmit[ x->to_face ] == (int32_t) i ) {
+        r->rx_xmit[ x->to_face ] = -1;
+    }
+
+    if ( x->collided ) {
+        r->packets_collided++;
+    } else if ( !r->halted ) {
+        receive_packet( r , x->to_face , x->from , x->from_face , x->seq , x->data , x->len );
+    }
+
+    free_xmits.push_back( i );
+
+}
+
+static void flush_serial();
+
+static void run_events( uint64_t end_us ) {
+
+    for( uint32_t i=0; i < tiles.size() ; i++ ) {
+
+        tile_t *t = &tiles[i];
+
+        // Each tile gets powered up at a different point in the frame
+
+        t->phase_us = splitmix64( channel_seed + i ) % frame_us;
+        t->now_us = t->phase_us;
+        t->bios_us = t->phase_us;
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+            t->rx_xmit[f] = -1;
+        }
+
+        schedule( t->now_us , EVENT_RESUME , i );
+
+    }
+
+    uint64_t next_flush_us = frame_us;
+
+    while ( !events.empty() && events.top().time_us < end_us ) {
+
+        event_t e = events.top();
+        events.pop();
+
+        now_us = e.time_us;
+
+        if ( now_us >= next_flush_us ) {
+
+            if (!quiet) flush_serial();
+            next_flush_us += frame_us;
+
+        }
+
+        if ( e.type == EVENT_RESUME ) {
+
+            tile_t *t = &tiles[ e.index ];
+
+            if ( t->halted ) continue;
+
+            t->now_us = e.time_us;
+            t->return_ctx = &event_sched_ctx;
+
+            swapcontext( &event_sched_ctx , &t->ctx );
+
+        } else if ( e.type == EVENT_RX_START ) {
+
+            event_rx_start( &xmits[ e.index ] );
+
+        } else {
+
+            event_rx_end( e.index );
+
+        }
+
+    }
+
+    now_us = end_us;
+
+}
+
+// --- Callbacks from inside each tile. These run on the tile's own stack.
+
+static void tile_yield( void *ctx , uint8_t reason , uint8_t code ) {
+
+    tile_t *t = (tile_t *) ctx;
+
+    if ( reason == BLINKBIOS_SIM_YIELD_HALT ) {
+
+        t->halted = 1;
+
+        if (!quiet) {
+            fprintf( stderr , "tile %u halted (%s %u)\n" , tile_index( t ) , code ? "ABEND" : "seed mode" , code );
+        }
+
+        setcontext( t->return_ctx );        // Never coming back
+
+    }
+
+    t->sleeping = ( reason == BLINKBIOS_SIM_YIELD_SLEEP );
+
+    if ( event_mode ) {
+        event_yield( t , reason );
+        return;
+    }
+
+    swapcontext( &t->ctx , t->return_ctx );
+
+    // We are back for the next frame. A whole frame of time went by while we were gone.
+
+    if ( click_period_ms ) {
+        t->api.button( ( now_us / 1000 + t->click_phase_ms ) % click_period_ms < CLICK_DOWN_MS );
+    }
+
+    advance_tile( t , frame_us );
+
+}
+
+static uint8_t tile_ir_send( void *ctx , uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    tile_t *t = (tile_t *) ctx;
+
+    if ( event_mode ) {
+
+        uint8_t sent = event_ir_send( t , face , data , len );
+
+        t->packets_sent += sent;
+
+        return sent;
+
+    }
+
+    t->packets_sent++;
+
+    uint32_t seq = t->tx_seq[ face ]++;
+
+    if ( len <= MAX_PACKET_LEN && t->outbox_count[face] < OUTBOX_SIZE ) {
+
+        packet_t *p = &t->outbox[face][ t->outbox_count[face]++ ];
+
+        p->seq = seq;
+        p->len = len;
+        memcpy( p->data , data , len );
+
+    }
+
+    return 1;
+
+}
+
+static void tile_serial_tx( void *ctx , uint8_t b ) {
+
+    tile_t *t = (tile_t *) ctx;
+
+    if (!quiet) {
+        if ( t->serial_line.empty() ) {
+            t->serial_line_us = event_mode ? t->now_us : now_us;
+        }
+
+        t->serial_line.push_back( b );
+    }
+
+}
+
+static void tile_entry( uint32_t hi , uint32_t lo ) {
+
+    tile_t *t = (tile_t *) ( ( (uintptr_t) hi << 32 ) | lo );
+
+    t->api.main();      // Never returns
+
+}
+
+// --- The two phases
+
+static void run_tile( worker_t *w , tile_t *t ) {
+
+    if ( t->halted ) return;
+
+    memset( t->outbox_count , 0 , sizeof( t->outbox_count ) );
+
+    t->return_ctx = &w->sched_ctx;
+
+    swapcontext( &w->sched_ctx , &t->ctx );
+
+    w->tiles_run++;
+
+}
+
+static void deliver_tile( tile_t *t ) {
+
+    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+        int32_t n = t->neighbor[f];
+
+        if ( !is_linked( t , n , now_us ) ) continue;
+
+        tile_t *sender = &tiles[n];
+        uint8_t g = t->neighbor_face[f];
+
+        for( uint8_t i=0; i < sender->outbox_count[g] ; i++ ) {
+
+            packet_t *p = &sender->outbox[g][i];
+
+            receive_packet( t , f , n , g , p->seq , p->data , p->len );
+
+        }
+
+    }
+
+}
+
+#define PHASE_RUN       0
+#define PHASE_DELIVER   1
+#define PHASE_DONE      2
+
+static pthread_barrier_t phase_start;
+static pthread_barrier_t phase_end;
+static volatile uint8_t phase;
+
+static void do_phase( worker_t *w ) {
+
+    uint32_t begin, end;
+
+    do {
+
+        while ( take_front( w , &begin , &end ) ) {
+
+            for( uint32_t i = begin ; i < end ; i++ ) {
+
+                if ( phase == PHASE_RUN ) {
+                    run_tile( w , &tiles[i] );
+                } else {
+                    deliver_tile( &tiles[i] );
+                }
+
+            }
+
+        }
+
+    } while ( steal( w ) );
+
+}
+
+static void worker_thread( worker_t *w ) {
+
+    while (1) {
+
+        pthread_barrier_wait( &phase_start );
+
+        if ( phase == PHASE_DONE ) return;
+
+        do_phase( w );
+
+        pthread_barrier_wait( &phase_end );
+
+    }
+
+}
+
+// The main thread is worker 0
+
+static void run_phase( uint8_t p ) {
+
+    phase = p;
+
+    split_work( tiles.size() );
+
+    pthread_barrier_wait( &phase_start );
+
+    do_phase( &workers[0] );
+
+    pthread_barrier_wait( &phase_end );
+
+}
+
+static void flush_serial() {
+
+    for( uint32_t i=0; i < tiles.size() ; i++ ) {
+
+        std::vector<char> &line = tiles[i].serial_line;
+
+        if ( !line.empty() && line.back() == '\n' ) {
+
+            if ( timestamps ) {
+                printf( "[%u] @%.3f %.*s" , i , tiles[i].serial_line_us / 1000.0 , (int) line.size() , line.data() );
+            } else {
+                printf( "[%u] %.*s" , i , (int) line.size() , line.data() );
+            }
+            line.clear();
+
+        }
+
+    }
+
+}
+
+// --- Loading tiles
+
+static uint8_t load_tile( tile_t *t , const void *image , size_t image_size , uint32_t index , int *fd_out ) {
+
+    int fd = memfd_create( "blinktile" , MFD_CLOEXEC );
+
+    if ( fd < 0 || write( fd , image , image_size ) != (ssize_t) image_size ) {
+        perror( "memfd" );
+        return 0;
+    }
+
+    char path[64];
+    snprintf( path , sizeof( path ) , "/proc/self/fd/%d" , fd );
+
+    void *h = dlopen( path , RTLD_NOW | RTLD_LOCAL );
+
+    // We can not close the fd yet. dlopen() thinks it already has anything with the same path loaded, so if the next
+    // tile got this same fd number it would get handed this same copy. main() closes them all once every tile is loaded.
+
+    *fd_out = fd;
+
+    if (!h) {
+        fprintf( stderr , "dlopen: %s\n" , dlerror() );
+        return 0;
+    }
+
+    t->api.attach     = ( void (*)( const blinkbios_sim_port_t * , const uint8_t * ) ) dlsym( h , "blinkbios_sim_attach" );
+    t->api.advance    = ( void (*)( uint32_t ) ) dlsym( h , "blinkbios_sim_advance" );
+    t->api.button     = ( void (*)( uint8_t ) ) dlsym( h , "blinkbios_sim_button" );
+    t->api.ir_receive = ( uint8_t (*)( uint8_t , const uint8_t * , uint8_t ) ) dlsym( h , "blinkbios_sim_ir_receive" );
+    t->api.rx_active  = ( void (*)( uint8_t , uint8_t ) ) dlsym( h , "blinkbios_sim_ir_rx_active" );
+    t->api.main       = ( void (*)( void ) ) dlsym( h , "blinkbios_sim_main" );
+
+    if ( !t->api.attach || !t->api.advance || !t->api.button || !t->api.ir_receive || !t->api.rx_active || !t->api.main ) {
+        fprintf( stderr , "tile image is missing the blinkbios_sim_* entry points\n" );
+        return 0;
+    }
+
+    t->port.ctx = t;
+    t->port.yield = tile_yield;
+    t->port.ir_send = tile_ir_send;
+    t->port.serial_tx = tile_serial_tx;
+
+    uint8_t serialno[ BLINKBIOS_SIM_SERIALNO_LEN ];
+
+    for( uint8_t i=0; i < BLINKBIOS_SIM_SERIALNO_LEN ; i++ ) {
+        serialno[i] = (uint8_t) ( index >> ( ( i % 4 ) * 8 ) ) ^ ( i * 0x5b );
+    }
+
+    t->api.attach( &t->port , serialno );
+
+    t->clock_scale = 1.0 + clock_error * ( unit_random( splitmix64( channel_seed ^ 0xc10cULL ) + index ) * 2 - 1 );
+
+    t->click_phase_ms = ( index * 7919UL ) % ( click_period_ms ? click_period_ms : 1 );
+
+    return 1;
+
+}
+
+static uint8_t *stack_arena;
+
+static void start_tile( tile_t *t , uint32_t index ) {
+
+    getcontext( &t->ctx );
+
+    t->ctx.uc_stack.ss_sp = stack_arena + (size_t) index * TILE_STACK_SIZE;
+    t->ctx.uc_stack.ss_size = TILE_STACK_SIZE;
+    t->ctx.uc_link = NULL;
+
+    uintptr_t p = (uintptr_t) t;
+
+    makecontext( &t->ctx , (void (*)()) tile_entry , 2 , (uint32_t) ( p >> 32 ) , (uint32_t) p );
+
+}
+
+static void *read_file( const char *name , size_t *size ) {
+
+    FILE *f = fopen( name , "rb" );
+
+    if (!f) {
+        perror( name );
+        return NULL;
+    }
+
+    fseek( f , 0 , SEEK_END );
+    *size = ftell( f );
+    fseek( f , 0 , SEEK_SET );
+
+    void *buffer = malloc( *size );
+
+    if ( fread( buffer , 1 , *size , f ) != *size ) {
+        perror( name );
+        fclose( f );
+        return NULL;
+    }
+
+    fclose( f );
+
+    return buffer;
+
+}
+
+static double seconds_since( const struct timespec *start ) {
+
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC , &t );
+
+    return ( t.tv_sec - start->tv_sec ) + ( t.tv_nsec - start->tv_nsec ) / 1e9;
+
+}
+
+static void usage( const char *name ) {
+
+    fprintf( stderr , "usage: %s [-n tiles] [-w width] [-t seconds] [-j threads] [-f frame_us] [-c click_period_ms] [-e] [-b bit_us] [-l loss] [-x ber] [-r seed] [-a apart_ms] [-d clock_error] [-R] [-k tile:ms] [-T] [-q] tile.so\n" , name );
+    fprintf( stderr , "  -n  number of tiles (default %u)\n" , DEFAULT_TILES );
+    fprintf( stderr , "  -w  tiles per row of the hex lattice (default square-ish)\n" );
+    fprintf( stderr , "  -t  virtual seconds to run (default %u)\n" , DEFAULT_SECONDS );
+    fprintf( stderr , "  -j  worker threads (default one per CPU)\n" );
+    fprintf( stderr , "  -f  virtual microseconds per frame (default %u)\n" , DEFAULT_FRAME_US );
+    fprintf( stderr , "  -c  click each tile's button once every this many virtual ms (default never)\n" );
+    fprintf( stderr , "  -e  use the discrete-event IR channel model (airtime, collisions) on one thread\n" );
+    fprintf( stderr , "  -b  virtual microseconds per IR bit time with -e (default %u)\n" , DEFAULT_IR_BIT_US );
+    fprintf( stderr , "  -l  chance that any packet is lost, like 0.01 (default 0)\n" );
+    fprintf( stderr , "  -x  chance that any bit is flipped, like 1e-4 (default 0)\n" );
+    fprintf( stderr , "  -r  seed for fault injection and tile power up times (default 0)\n" );
+    fprintf( stderr , "  -a  keep the tiles apart for this many virtual ms, then push them all together (default 0)\n" );
+    fprintf( stderr , "  -d  each tile's clock runs up to this fraction fast or slow, like 0.05 (default 0)\n" );
+    fprintf( stderr , "  -R  turn each tile a random number of faces (picked from the seed)\n" );
+    fprintf( stderr , "  -k  pull tile i out of the cluster after ms virtual ms, like -k 12:5000 (can repeat)\n" );
+    fprintf( stderr , "  -T  start each line of service port output with the virtual ms it came out at\n" );
+    fprintf( stderr , "  -q  do not print service port output\n" );
+    exit(2);
+
+}
+
+int main( int argc , char **argv ) {
+
+    uint32_t count = DEFAULT_TILES;
+    uint32_t width = 0;
+    uint32_t nthreads = std::thread::hardware_concurrency();
+    double seconds = DEFAULT_SECONDS;
+
+    int opt;
+
+    while ( ( opt = getopt( argc , argv , "n:w:t:j:f:c:eb:l:x:r:a:d:Rk:Tq" ) ) != -1 ) {
+
+        switch (opt) {
+
+            case 'n': count = strtoul( optarg , NULL , 0 ); break;
+            case 'w': width = strtoul( optarg , NULL , 0 ); break;
+            case 't': seconds = atof( optarg ); break;
+            case 'j': nthreads = strtoul( optarg , NULL , 0 ); break;
+            case 'f': frame_us = strtoul( optarg , NULL , 0 ); break;
+            case 'c': click_period_ms = strtoul( optarg , NULL , 0 ); break;
+            case 'e': event_mode = 1; break;
+            case 'b': ir_bit_us = strtoul( optarg , NULL , 0 ); break;
+            case 'l': loss_rate = atof( optarg ); break;
+            case 'x': bit_error_rate = atof( optarg ); break;
+            case 'r': channel_seed = strtoull( optarg , NULL , 0 ); break;
+            case 'a': apart_us = strtoull( optarg , NULL , 0 ) * 1000; break;
+            case 'd': clock_error = atof( optarg ); break;
+            case 'R': rotate_tiles = 1; break;
+            case 'k': {
+                char *colon;
+                removal_t r;
+                r.tile = strtoul( optarg , &colon , 0 );
+                if ( *colon != ':' ) usage( argv[0] );
+                r.at_us = strtoull( colon + 1 , NULL , 0 ) * 1000;
+                removals.push_back( r );
+                break;
+            }
+            case 'T': timestamps = 1; break;
+            case 'q': quiet = 1; break;
+            default: usage( argv[0] );
+
+        }
+
+    }
+
+    if ( optind != argc - 1 || !count || !frame_us ) usage( argv[0] );
+
+    if ( !width ) {
+        width = 1;
+        while ( width * width < count ) width++;
+    }
+
+    if ( !nthreads || event_mode ) nthreads = 1;
+
+    size_t image_size;
+    void *image = read_file( argv[optind] , &image_size );
+
+    if (!image) return 1;
+
+    struct timespec load_start;
+    clock_gettime( CLOCK_MONOTONIC , &load_start );
+
+    tiles = std::vector<tile_t>( count );
+
+    stack_arena = (uint8_t *) mmap( NULL , (size_t) count * TILE_STACK_SIZE , PROT_READ | PROT_WRITE , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE , -1 , 0 );
+
+    if ( stack_arena == MAP_FAILED ) {
+        perror( "mmap stacks" );
+        return 1;
+    }
+
+    // Every tile holds an fd open until they are all loaded (see load_tile), so we need plenty of them
+
+    struct rlimit nofile;
+    getrlimit( RLIMIT_NOFILE , &nofile );
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit( RLIMIT_NOFILE , &nofile );
+
+    std::vector<int> fds( count , -1 );
+
+    for( uint32_t i=0; i < count ; i++ ) {
+
+        if ( !load_tile( &tiles[i] , image , image_size , i , &fds[i] ) ) {
+            fprintf( stderr , "failed loading tile %u\n" , i );
+            return 1;
+        }
+
+        start_tile( &tiles[i] , i );
+
+    }
+
+    for( int fd : fds ) close( fd );        // The mappings keep the files alive
+
+    build_lattice( count , width );
+
+    for( const removal_t &r : removals ) {
+        if ( r.tile < count ) {
+            tiles[ r.tile ].removed_us = r.at_us ? r.at_us : 1;
+        }
+    }
+
+    fprintf( stderr , "loaded %u tiles (%u per row) in %.2f s\n" , count , width , seconds_since( &load_start ) );
+
+    workers = std::vector<worker_t>( nthreads );
+
+    pthread_barrier_init( &phase_start , NULL , nthreads );
+    pthread_barrier_init( &phase_end , NULL , nthreads );
+
+    std::vector<std::thread> threads;
+
+    for( uint32_t w=1; w < nthreads ; w++ ) {
+        threads.push_back( std::thread( worker_thread , &workers[w] ) );
+    }
+
+    uint64_t end_us = (uint64_t) ( seconds * 1e6 );
+    uint64_t frames = 0;
+
+    struct timespec run_start;
+    clock_gettime( CLOCK_MONOTONIC , &run_start );
+
+    if ( event_mode ) {
+
+        run_events( end_us );
+
+        uint64_t tile_frames = 0;
+        for( auto &t : tiles ) tile_frames += t.frames;
+
+        frames = tile_frames / count;
+
+    } else {
+
+        while ( now_us < end_us ) {
+
+            run_phase( PHASE_RUN );
+            run_phase( PHASE_DELIVER );
+
+            if (!quiet) flush_serial();
+
+            now_us += frame_us;
+            frames++;
+
+        }
+
+    }
+
+    phase = PHASE_DONE;
+    pthread_barrier_wait( &phase_start );
+
+    for( auto &t : threads ) t.join();
+
+    double wall = seconds_since( &run_start );
+    double simulated = now_us / 1e6;
+
+    uint64_t sent = 0, delivered = 0, dropped = 0, refused = 0, collided = 0, lost = 0, corrupted = 0, bytes = 0, steals = 0;
+    uint32_t halted = 0, sleeping = 0;
+
+    for( auto &t : tiles ) {
+        sent += t.packets_sent;
+        delivered += t.packets_delivered;
+        dropped += t.packets_dropped;
+        refused += t.packets_refused;
+        collided += t.packets_collided;
+        lost += t.packets_lost;
+        corrupted += t.packets_corrupted;
+        bytes += t.bytes_delivered;
+        halted += t.halted;
+        sleeping += t.sleeping;
+    }
+
+    for( auto &w : workers ) steals += w.steals;
+
+    fprintf( stderr , "simulated %.3f s of %u tiles in %.3f s wall (%.2fx real time) on %u threads\n" , simulated , count , wall , wall > 0 ? simulated / wall : 0 , nthreads );
+    fprintf( stderr , "frames %llu, %.2f us host time per tile-frame, %llu steals\n" , (unsigned long long) frames , frames ? wall * 1e6 / ( (double) frames * count ) : 0 , (unsigned long long) steals );
+    fprintf( stderr , "ir packets sent %llu, delivered %llu, dropped (buffer full) %llu\n" , (unsigned long long) sent , (unsigned long long) delivered , (unsigned long long) dropped );
+    fprintf( stderr , "ir packets refused (rx in progress) %llu, collided %llu, lost %llu, corrupted %llu\n" , (unsigned long long) refused , (unsigned long long) collided , (unsigned long long) lost , (unsigned long long) corrupted );
+    fprintf( stderr , "ir bytes delivered %llu (%.1f bytes per tile per second)\n" , (unsigned long long) bytes , simulated > 0 ? bytes / ( simulated * count ) : 0 );
+    fprintf( stderr , "tiles halted %u, asleep %u\n" , halted , sleeping );
+
+    // Tiles are stuck mid-frame on their own stacks, so do not try to unwind anything
+    fflush( stdout );
+    _exit(0);
+
+}
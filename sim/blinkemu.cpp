@@ -0,0 +1,554 @@
+/*
+ * blinkemu.cpp
+ *
+ * Runs the real thing - a sketch ELF from the Arduino build plus the real BlinkBIOS.hex - on the emulated
+ * ATmega168PB in avr_core.cpp and counts exactly how many CPU cycles each frame takes.
+ *
+ * A frame is from one return out of BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR to the next. Inside each frame we
+ * count the cycles spent in loop(), RX_IRFaces(), TX_IRFaces(), and the display vector itself. Time spent
+ * in the BIOS interrupts is taken out of all of them and reported on its own, so the numbers are the same no
+ * matter where an interrupt happened to land.
+ *
+ * LTO likes to inline all of these straight into run(), so build with PROFILE_NOINLINE defined if you
+ * want them broken out (see README.md).
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avr_core.h"
+
+#define DEFAULT_BIOS        "../bootloaders/BlinkBIOS.hex"
+#define DEFAULT_SECONDS     10
+
+#define TICKS_PER_SECOND    8000000UL
+#define TICKS_PER_SLICE     8000            // How often we come up for air to check the clock (1ms)
+
+// The game does not go straight to 0. It goes into the upper half of the game area, and then the BIOS copies it
+// down to 0 every time it starts up. That is why platform.txt moves the hex file up by this much.
+
+#define GAME_STAGING        0x1700
+
+#define DISPLAY_VECTOR      ( 0x3820 / 2 )  // boot_vector8 from avr5.xn, in words
+#define ABEND_VECTOR        ( 0x383c / 2 )  // boot_vector15
+
+#define MAX_PROBES          16
+#define MAX_STACK           64
+
+#define NOT_FOUND           0xffff
+
+struct stats_t {
+
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+
+};
+
+static void stats_add( stats_t *s , uint64_t v ) {
+
+    if ( !s->count || v < s->min ) s->min = v;
+    if ( v > s->max ) s->max = v;
+
+    s->total += v;
+    s->count++;
+
+}
+
+// A function we count cycles for
+
+struct probe_t {
+
+    const char *name;           // Plain name. We find it in the ELF as either this or the C++ mangled version.
+
+    uint16_t word;              // Entry point in words, or NOT_FOUND
+
+    uint8_t  active;            // Inside it right now (we only count the outermost call if it recurses)
+    uint64_t start;             // Main line cycles when we went in
+
+    uint64_t frame_cycles;      // This frame so far
+    uint32_t frame_calls;
+
+    stats_t  stats;             // Per frame, only for frames where it got called
+
+};
+
+static probe_t probes[ MAX_PROBES ];
+static uint8_t probe_count;
+
+// Probe indexes for the built in ones
+
+#define PROBE_DISPLAY   0
+#define PROBE_LOOP      1
+#define PROBE_RX        2
+#define PROBE_TX        3
+
+// Shadow stack of the probed calls we are inside
+
+struct frame_entry_t {
+
+    uint8_t  probe;
+    uint16_t sp;
+
+};
+
+static frame_entry_t shadow[ MAX_STACK ];
+static uint8_t shadow_depth;
+
+// Interrupts
+
+static uint8_t  isr_depth;
+static uint64_t isr_start;
+static uint64_t isr_cycles;                 // Total cycles inside interrupts (outermost only, nested ones are inside)
+static uint64_t isr_vector_count[ AVR_VECTOR_COUNT ];
+
+// Frames
+
+static uint8_t  game_started;
+static uint64_t frame_start;                // Main line cycles when this frame started
+static uint64_t frame_isr_start;
+static uint64_t frame_count;
+static stats_t  frame_stats;                // Main line cycles per frame. This is run() less the interrupts.
+static stats_t  frame_isr_stats;            // Interrupt cycles per frame
+static stats_t  frame_ticks_stats;          // Real time per frame
+static uint64_t frame_start_ticks;
+static uint64_t first_frame_cycles;         // Includes setup()
+
+static uint8_t per_frame;                   // Print a line for every frame
+static uint8_t quiet;
+
+static struct timespec wall_start;
+
+static double wall_seconds() {
+
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC , &t );
+
+    return ( t.tv_sec - wall_start.tv_sec ) + ( t.tv_nsec - wall_start.tv_nsec ) / 1e9;
+
+}
+
+// Cycles spent outside of interrupts. Everything we report is in these.
+
+static uint64_t mainline_cycles( const avr_t *avr ) {
+
+    uint64_t isr = isr_cycles;
+
+    if ( isr_depth ) isr += avr->cycles - isr_start;
+
+    return avr->cycles - isr;
+
+}
+
+static void end_frame( avr_t *avr ) {
+
+    uint64_t now = mainline_cycles( avr );
+    uint64_t cycles = now - frame_start;
+    uint64_t isr = ( avr->cycles - now ) - frame_isr_start;
+
+    if ( frame_count == 0 ) {
+
+        first_frame_cycles = cycles;
+
+    } else {
+
+        stats_add( &frame_stats , cycles );
+        stats_add( &frame_isr_stats , isr );
+        stats_add( &frame_ticks_stats , avr->ticks - frame_start_ticks );
+
+        for( uint8_t i=0; i < probe_count ; i++ ) {
+
+            if ( probes[i].frame_calls ) {
+                stats_add( &probes[i].stats , probes[i].frame_cycles );
+            }
+
+        }
+
+    }
+
+    if ( per_frame ) {
+
+        printf( "frame %llu cycles %llu isr %llu" , (unsigned long long) frame_count , (unsigned long long) cycles , (unsigned long long) isr );
+
+        for( uint8_t i=0; i < probe_count ; i++ ) {
+            if ( probes[i].word != NOT_FOUND ) {
+                printf( " %s %llu" , probes[i].name , (unsigned long long) probes[i].frame_cycles );
+            }
+        }
+
+        printf( "\n" );
+
+    }
+
+    for( uint8_t i=0; i < probe_count ; i++ ) {
+        probes[i].frame_cycles = 0;
+        probes[i].frame_calls = 0;
+    }
+
+    frame_count++;
+    frame_start = now;
+    frame_isr_start = avr->cycles - now;
+    frame_start_ticks = avr->ticks;
+
+}
+
+static void hook_call( void *ctx , avr_t *avr , uint16_t target , uint16_t sp ) {
+
+    (void) ctx;
+
+    if ( target == ABEND_VECTOR ) {
+        fprintf( stderr , "ABEND code %u at %.3f s\n" , avr->data[24] , avr->ticks / (double) TICKS_PER_SECOND );
+    }
+
+    for( uint8_t i=0; i < probe_count ; i++ ) {
+
+        probe_t *p = &probes[i];
+
+        if ( p->word != target ) continue;
+
+        if ( shadow_depth == MAX_STACK ) {
+            fprintf( stderr , "too many nested probed calls, giving up on tracking them\n" );
+            exit(1);
+        }
+
+        shadow[ shadow_depth ].probe = i;
+        shadow[ shadow_depth ].sp = sp;
+        shadow_depth++;
+
+        if ( !p->active++ ) {
+            p->start = mainline_cycles( avr );
+        }
+
+        p->frame_calls++;
+
+        break;
+
+    }
+
+}
+
+static void hook_ret( void *ctx , avr_t *avr , uint16_t sp ) {
+
+    (void) ctx;
+
+    // Anything with a lower SP is a function we are not tracking. Anything with a higher SP got unwound
+    // without a RET (the BIOS resets the stack when it starts the game) so we just forget about it.
+
+    while ( shadow_depth && shadow[ shadow_depth - 1 ].sp <= sp ) {
+
+        shadow_depth--;
+
+        uint8_t matched = ( shadow[ shadow_depth ].sp == sp );
+
+        probe_t *p = &probes[ shadow[ shadow_depth ].probe ];
+
+        if ( !--p->active ) {
+
+            // RET takes 4 cycles that have not been counted yet
+
+            p->frame_cycles += mainline_cycles( avr ) - p->start + ( matched ? 4 : 0 );
+
+        }
+
+        if ( matched ) {
+
+            if ( shadow[ shadow_depth ].probe == PROBE_DISPLAY && !p->active ) {
+                end_frame( avr );
+            }
+
+            break;
+        }
+
+    }
+
+}
+
+static void hook_irq( void *ctx , avr_t *avr , uint8_t vector ) {
+
+    (void) ctx;
+
+    if ( !isr_depth++ ) {
+        isr_start = avr->cycles;
+    }
+
+    isr_vector_count[ vector ]++;
+
+}
+
+static void hook_reti( void *ctx , avr_t *avr ) {
+
+    (void) ctx;
+
+    if ( !isr_depth ) return;
+
+    if ( !--isr_depth ) {
+        isr_cycles += avr->cycles - isr_start + 4;      // The RETI itself has not been counted yet
+    }
+
+}
+
+static void hook_serial_tx( void *ctx , avr_t *avr , uint8_t b ) {
+
+    (void) ctx; (void) avr;
+
+    if (!quiet) {
+        putchar( b );
+    }
+
+}
+
+// Match either a plain C name or a C++ mangled free function like `_Z4loopv` or `_ZL10RX_IRFacesv`.
+// LTO can also tack on things like `.lto_priv.0`.
+
+static uint8_t symbol_matches( const char *symbol , const char *name ) {
+
+    size_t len = strcspn( symbol , "." );
+    size_t name_len = strlen( name );
+
+    if ( len == name_len && !memcmp( symbol , name , len ) ) return 1;
+
+    char mangled[ 128 ];
+
+    snprintf( mangled , sizeof( mangled ) , "_Z%zu%sv" , name_len , name );
+    if ( len == strlen( mangled ) && !memcmp( symbol , mangled , len ) ) return 1;
+
+    snprintf( mangled , sizeof( mangled ) , "_ZL%zu%sv" , name_len , name );
+    if ( len == strlen( mangled ) && !memcmp( symbol , mangled , len ) ) return 1;
+
+    return 0;
+
+}
+
+static void found_symbol( void *ctx , const char *name , uint32_t value , uint32_t size ) {
+
+    (void) ctx; (void) size;
+
+    if ( value >= AVR_FLASH_SIZE ) return;
+
+    for( uint8_t i=0; i < probe_count ; i++ ) {
+
+        if ( probes[i].word == NOT_FOUND && symbol_matches( name , probes[i].name ) ) {
+            probes[i].word = value / 2;
+        }
+
+    }
+
+}
+
+static void add_probe( const char *name , uint16_t word ) {
+
+    if ( probe_count == MAX_PROBES ) {
+        fprintf( stderr , "too many functions to profile\n" );
+        exit(2);
+    }
+
+    probes[ probe_count ].name = name;
+    probes[ probe_count ].word = word;
+    probe_count++;
+
+}
+
+static void print_stats( const char *name , const stats_t *s , uint64_t frames ) {
+
+    if ( !s->count ) {
+        fprintf( stderr , "%-24s %10s\n" , name , "never called" );
+        return;
+    }
+
+    fprintf( stderr , "%-24s %10llu %10llu %10.1f %10llu" , name ,
+        (unsigned long long) s->count , (unsigned long long) s->min , s->total / (double) s->count , (unsigned long long) s->max );
+
+    if ( s->count != frames ) {
+        fprintf( stderr , "  (in %.1f%% of frames)" , 100.0 * s->count / frames );
+    }
+
+    fprintf( stderr , "\n" );
+
+}
+
+static void report( const avr_t *avr ) {
+
+    double wall = wall_seconds();
+    double simulated = avr->ticks / (double) TICKS_PER_SECOND;
+
+    fprintf( stderr , "simulated %.3f s in %.3f s wall (%.2fx real time), %llu cpu cycles, %u resets\n" ,
+        simulated , wall , wall > 0 ? simulated / wall : 0 , (unsigned long long) avr->cycles , avr->resets );
+
+    if ( !frame_count ) {
+        fprintf( stderr , "no frames. Did the game ever start?\n" );
+        return;
+    }
+
+    fprintf( stderr , "first frame (includes setup) %llu cycles\n" , (unsigned long long) first_frame_cycles );
+
+    uint64_t frames = frame_stats.count;
+
+    fprintf( stderr , "\ncycles per frame over %llu frames, not counting interrupts\n\n" , (unsigned long long) frames );
+    fprintf( stderr , "%-24s %10s %10s %10s %10s\n" , "" , "frames" , "min" , "avg" , "max" );
+
+    print_stats( "run() (whole frame)" , &frame_stats , frames );
+
+    for( uint8_t i=0; i < probe_count ; i++ ) {
+
+        const probe_t *p = &probes[i];
+
+        char label[ 64 ];
+        snprintf( label , sizeof( label ) , "%s" , i == PROBE_DISPLAY ? "DISPLAY_PIXEL_BUFFER" : p->name );
+
+        if ( p->word == NOT_FOUND ) {
+            fprintf( stderr , "%-24s %10s\n" , label , "not in ELF (inlined? see README.md)" );
+        } else {
+            print_stats( label , &p->stats , frames );
+        }
+
+    }
+
+    print_stats( "interrupts" , &frame_isr_stats , frames );
+    print_stats( "real time (8MHz ticks)" , &frame_ticks_stats , frames );
+
+    fprintf( stderr , "\ninterrupts taken\n\n" );
+
+    for( uint8_t v=0; v < AVR_VECTOR_COUNT ; v++ ) {
+        if ( isr_vector_count[v] ) {
+            fprintf( stderr , "vector %2u %12llu\n" , v , (unsigned long long) isr_vector_count[v] );
+        }
+    }
+
+}
+
+static void usage( const char *name ) {
+
+    fprintf( stderr , "usage: %s [-b BlinkBIOS.hex] [-t seconds] [-s serial_seed] [-o offset] [-p function]... [-f] [-q] sketch.elf|sketch.hex\n" , name );
+    fprintf( stderr , "  -b  BIOS to load (default %s)\n" , DEFAULT_BIOS );
+    fprintf( stderr , "  -t  seconds of tile time to run (default %u)\n" , DEFAULT_SECONDS );
+    fprintf( stderr , "  -s  number used to make up the tile serial number (default 0)\n" );
+    fprintf( stderr , "  -o  byte offset to add to the addresses in a sketch hex file (default 0, since the Arduino build already moved it up to 0x%x)\n" , GAME_STAGING );
+    fprintf( stderr , "  -p  also count cycles in this function (ELF only, can repeat)\n" );
+    fprintf( stderr , "  -f  print the counts for every frame\n" );
+    fprintf( stderr , "  -q  do not print service port output\n" );
+    exit(2);
+
+}
+
+static avr_t avr;
+
+int main( int argc , char **argv ) {
+
+    const char *bios = DEFAULT_BIOS;
+    double seconds = DEFAULT_SECONDS;
+    unsigned long serial_seed = 0;
+    long hex_offset = 0;
+
+    add_probe( "BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR" , DISPLAY_VECTOR );     // Always at boot_vector8, no need to look it up
+    add_probe( "loop" , NOT_FOUND );
+    add_probe( "RX_IRFaces" , NOT_FOUND );
+    add_probe( "TX_IRFaces" , NOT_FOUND );
+
+    int opt;
+
+    while ( ( opt = getopt( argc , argv , "b:t:s:o:p:fq" ) ) != -1 ) {
+
+        switch (opt) {
+
+            case 'b': bios = optarg; break;
+            case 't': seconds = atof( optarg ); break;
+            case 's': serial_seed = strtoul( optarg , NULL , 0 ); break;
+            case 'o': hex_offset = strtol( optarg , NULL , 0 ); break;
+            case 'p': add_probe( optarg , NOT_FOUND ); break;
+            case 'f': per_frame = 1; break;
+            case 'q': quiet = 1; break;
+            default: usage( argv[0] );
+
+        }
+
+    }
+
+    if ( optind != argc - 1 ) usage( argv[0] );
+
+    const char *sketch = argv[ optind ];
+
+    avr_init( &avr );
+
+    // Load the sketch first so if it is big enough to run into the BIOS, the BIOS wins
+
+    size_t len = strlen( sketch );
+
+    if ( len > 4 && !strcmp( sketch + len - 4 , ".hex" ) ) {
+
+        if ( !avr_load_hex( &avr , sketch , hex_offset ) ) return 1;
+
+    } else {
+
+        if ( !avr_load_elf( &avr , sketch , GAME_STAGING ) ) return 1;
+
+        avr_elf_symbols( sketch , found_symbol , NULL );
+
+    }
+
+    if ( !avr_load_hex( &avr , bios , 0 ) ) return 1;
+
+    for( uint8_t i=0; i < AVR_SERIALNO_LEN ; i++ ) {
+        avr.serialno[i] = (uint8_t) ( serial_seed >> ( ( i % 4 ) * 8 ) ) ^ ( i * 0x5b );    // Same as blinksim
+    }
+
+    avr.hooks.call = hook_call;
+    avr.hooks.ret = hook_ret;
+    avr.hooks.irq = hook_irq;
+    avr.hooks.reti = hook_reti;
+    avr.hooks.serial_tx = hook_serial_tx;
+
+    clock_gettime( CLOCK_MONOTONIC , &wall_start );
+
+    uint64_t end = (uint64_t) ( seconds * TICKS_PER_SECOND );
+
+    // The BIOS jumps to the game at 0 when it is done starting up. That is where we start counting frames.
+
+    avr.break_addr = 0;
+
+    while ( avr.ticks < end ) {
+
+        uint8_t stop = avr_run( &avr , TICKS_PER_SLICE );
+
+        if ( stop == AVR_STOP_BREAK && avr.pc == avr.break_addr ) {
+
+            avr.break_addr = 0xffff;
+            game_started = 1;
+            shadow_depth = 0;
+
+            frame_start = mainline_cycles( &avr );
+            frame_isr_start = avr.cycles - frame_start;
+            frame_start_ticks = avr.ticks;
+
+            continue;
+
+        }
+
+        if ( stop == AVR_STOP_BREAK ) {
+            fprintf( stderr , "BREAK at 0x%04x\n" , ( avr.pc - 1 ) * 2 );
+            break;
+        }
+
+        if ( stop == AVR_STOP_BAD_OP ) {
+            fprintf( stderr , "invalid instruction at 0x%04x\n" , avr.pc * 2 );
+            break;
+        }
+
+    }
+
+    fflush( stdout );
+
+    if ( !game_started ) {
+        fprintf( stderr , "BIOS never started the game\n" );
+    }
+
+    report( &avr );
+
+    return 0;
+
+}
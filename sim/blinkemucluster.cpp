@@ -0,0 +1,610 @@
+/*
+ * blinkemucluster.cpp
+ *
+ * Runs a whole cluster of emulated tiles, each one running the real BlinkBIOS.hex and a real game image on its own
+ * avr_t (see avr_core.h), with the IR LEDs of touching faces wired together at the pin level.
+ *
+ * On a blink, each face has one IR LED that is both the transmitter and the receiver. The anodes are on PORTB and the
+ * cathodes on PORTC (bits 0-5 are faces 0-5)...
+ *
+ *   - To send a pulse, the BIOS drives the cathode low and the anode high for about 20us.
+ *   - To receive, the BIOS charges up the reverse biased LED by driving the cathode high, then lets it float.
+ *     Light hitting the LED drains the charge and the cathode pin reads 0 until it gets charged up again.
+ *
+ * So that is what we emulate. Every rising edge of an LED is a pulse that turns on the light on the neighbor's facing
+ * LED, and the falling edge turns it off. While the light is on, the receiving cathode drains whenever it is not
+ * being driven. The BIOS timer ISR takes it from there, so bit timing, collisions, and seeding are all the real code.
+ *
+ * Time moves in lockstep windows of `-W` microseconds. In each window, every tile runs on its own until the end of the
+ * window, and any edges it makes go into its outbox. At the start of the next window, every tile collects the edges
+ * its neighbors sent toward it. An edge that happened at time t shows up at the neighbor at exactly t plus one window,
+ * so all the gaps between pulses (which is what carries the bits) are exact. Only the absolute latency is off.
+ *
+ * There is a barrier at the end of each window, but none inside it, so the tiles can spread out across all the CPU cores.
+ * No tile can see what any other tile did in the same window, so the results are the same no matter how many threads.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "avr_core.h"
+
+#define FACE_COUNT          6
+#define FACE_MASK           0x3f
+
+#define DEFAULT_BIOS        "../bootloaders/BlinkBIOS.hex"
+#define DEFAULT_TILES       100
+#define DEFAULT_SECONDS     10
+#define DEFAULT_WINDOW_US   50
+#define DEFAULT_MAX_START_MS 200            // Tiles power up at random times within this long
+#define CLICK_DOWN_MS       100
+
+#define TICKS_PER_US        8
+
+#define GAME_STAGING        0x1700          // Where the game image goes. See blinkemu.cpp.
+
+#define DISPLAY_VECTOR      ( 0x3820 / 2 )  // boot_vector8, in words
+
+#define PORT_B              0
+#define PORT_C              1
+#define PORT_D              2
+
+#define BUTTON_BIT          7               // PD7, low when pressed
+
+#define CHUNK               4               // Tiles a worker grabs at a time
+
+// An LED turning on or off
+
+struct edge_t {
+
+    uint64_t tick;          // Global time
+    uint8_t  face;
+    uint8_t  on;
+
+    bool operator<( const edge_t &e ) const {
+        if ( tick != e.tick ) return tick < e.tick;
+        if ( face != e.face ) return face < e.face;
+        return on < e.on;
+    }
+
+};
+
+struct emu_tile_t {
+
+    avr_t avr;
+
+    int32_t neighbor[ FACE_COUNT ]; // Index of the tile touching each face, or -1 for nobody
+
+    uint64_t start_tick;            // Global time when this tile powered up. Its own `avr.ticks` count from here.
+
+    uint8_t led_on;                 // LEDs we are lighting right now
+    uint8_t light;                  // LEDs that have light from a neighbor falling on them right now
+    uint8_t charged;                // Cathodes holding a charge
+
+    std::vector<edge_t> outbox[2];  // Edges we made, by window parity
+    std::vector<edge_t> inbox;      // Edges coming in during this window
+
+    uint32_t click_phase_ms;
+
+    uint64_t frames;
+    uint64_t pulses_sent;
+    uint64_t pulses_received;
+    uint8_t  crashed;
+
+    std::vector<char> serial_line;  // Service port output waiting for a newline
+
+};
+
+static std::vector<emu_tile_t> tiles;
+
+static uint64_t window_ticks = DEFAULT_WINDOW_US * TICKS_PER_US;
+static uint64_t window;             // Which window we are in
+static uint64_t now_tick;           // Global time at the start of the window
+
+static uint32_t click_period_ms;
+static uint8_t quiet;
+
+// --- Hex lattice, same layout as blinkcluster
+
+static const int8_t face_dq[ FACE_COUNT ] = { +1 , +1 ,  0 , -1 , -1 ,  0 };
+static const int8_t face_dr[ FACE_COUNT ] = {  0 , -1 , -1 ,  0 , +1 , +1 };
+
+static uint8_t opposite_face( uint8_t face ) {
+    return ( face + 3 ) % FACE_COUNT;
+}
+
+static void build_lattice( uint32_t count , uint32_t width ) {
+
+    for( uint32_t i=0; i < count ; i++ ) {
+
+        int32_t q = i % width;
+        int32_t r = i / width;
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+            int32_t nq = q + face_dq[f];
+            int32_t nr = r + face_dr[f];
+
+            int32_t n = nr * (int32_t) width + nq;
+
+            if ( nq < 0 || nq >= (int32_t) width || nr < 0 || n >= (int32_t) count ) {
+                tiles[i].neighbor[f] = -1;
+            } else {
+                tiles[i].neighbor[f] = n;
+            }
+
+        }
+
+    }
+
+}
+
+static uint64_t splitmix64( uint64_t x ) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+
+}
+
+// --- The IR LEDs
+
+// Work out the cathode levels the BIOS will read from what it is driving and what light is falling on each LED
+
+static void update_cathodes( emu_tile_t *t ) {
+
+    avr_t *avr = &t->avr;
+
+    uint8_t ddr  = avr->data[ AVR_DDRC ];
+    uint8_t port = avr->data[ AVR_PORTC ];
+
+    // Driven high or pulled up charges the LED. Driven low drains it.
+
+    t->charged |= ( ddr & port ) | ( ~ddr & port );
+    t->charged &= ~( ddr & ~port );
+
+    // Light drains anything that is not being driven
+
+    t->charged &= ~( t->light & ~ddr );
+
+    avr_set_pins( avr , PORT_C , ( avr->pin_input[ PORT_C ] & ~FACE_MASK ) | ( t->charged & FACE_MASK ) );
+
+}
+
+static void hook_port_write( void *ctx , avr_t *avr , uint16_t addr , uint8_t value ) {
+
+    (void) value;
+
+    emu_tile_t *t = (emu_tile_t *) ctx;
+
+    if ( addr != AVR_PORTB && addr != AVR_DDRB && addr != AVR_PORTC && addr != AVR_DDRC ) return;
+
+    // An LED lights with the anode driven high and the cathode driven low
+
+    uint8_t on = avr->data[ AVR_DDRB ] & avr->data[ AVR_PORTB ] & avr->data[ AVR_DDRC ] & ~avr->data[ AVR_PORTC ] & FACE_MASK;
+
+    uint8_t changed = on ^ t->led_on;
+
+    if ( changed ) {
+
+        std::vector<edge_t> &out = t->outbox[ window & 1 ];
+
+        for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+            if ( changed & ( 1 << f ) ) {
+
+                uint8_t is_on = ( on >> f ) & 1;
+
+                out.push_back( { t->start_tick + avr->ticks , f , is_on } );
+
+                if ( is_on ) t->pulses_sent++;
+
+            }
+
+        }
+
+        t->led_on = on;
+
+    }
+
+    if ( addr == AVR_PORTC || addr == AVR_DDRC ) {
+        update_cathodes( t );
+    }
+
+}
+
+static void hook_call( void *ctx , avr_t *avr , uint16_t target , uint16_t sp ) {
+
+    (void) avr; (void) sp;
+
+    emu_tile_t *t = (emu_tile_t *) ctx;
+
+    if ( target == DISPLAY_VECTOR ) {
+        t->frames++;
+    }
+
+}
+
+static void hook_serial_tx( void *ctx , avr_t *avr , uint8_t b ) {
+
+    (void) avr;
+
+    emu_tile_t *t = (emu_tile_t *) ctx;
+
+    if (!quiet) {
+        t->serial_line.push_back( b );
+    }
+
+}
+
+// Pick up the edges our neighbors made toward us in the last window. They land one window later than they happened.
+
+static void gather_edges( emu_tile_t *t ) {
+
+    t->inbox.clear();
+
+    if ( !window ) return;
+
+    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+        int32_t n = t->neighbor[f];
+
+        if ( n < 0 ) continue;
+
+        uint8_t g = opposite_face( f );
+
+        for( const edge_t &e : tiles[n].outbox[ ( window - 1 ) & 1 ] ) {
+
+            if ( e.face == g ) {
+                t->inbox.push_back( { e.tick + window_ticks , f , e.on } );
+            }
+
+        }
+
+    }
+
+    std::sort( t->inbox.begin() , t->inbox.end() );
+
+}
+
+// Run the tile up to global time `until`
+
+static void run_until( emu_tile_t *t , uint64_t until ) {
+
+    if ( t->crashed || until <= t->start_tick ) return;
+
+    uint64_t local = until - t->start_tick;
+
+    while ( t->avr.ticks < local ) {
+
+        uint8_t stop = avr_run( &t->avr , local - t->avr.ticks );
+
+        if ( stop == AVR_STOP_BAD_OP || stop == AVR_STOP_BREAK ) {
+
+            fprintf( stderr , "tile %u stopped (%s at 0x%04x)\n" , (unsigned) ( t - &tiles[0] ) , stop == AVR_STOP_BAD_OP ? "invalid instruction" : "BREAK" , t->avr.pc * 2 );
+            t->crashed = 1;
+            return;
+
+        }
+
+    }
+
+}
+
+static void run_window( emu_tile_t *t ) {
+
+    t->outbox[ window & 1 ].clear();
+
+    gather_edges( t );
+
+    if ( click_period_ms && now_tick >= t->start_tick ) {
+
+        uint64_t ms = ( now_tick - t->start_tick ) / ( 1000 * TICKS_PER_US ) + t->click_phase_ms;
+        uint8_t down = ms % click_period_ms < CLICK_DOWN_MS;
+
+        uint8_t pins = t->avr.pin_input[ PORT_D ];
+        uint8_t next = down ? pins & ~( 1 << BUTTON_BIT ) : pins | ( 1 << BUTTON_BIT );
+
+        if ( next != pins ) avr_set_pins( &t->avr , PORT_D , next );
+
+    }
+
+    for( const edge_t &e : t->inbox ) {
+
+        run_until( t , e.tick );
+
+        if ( e.on ) {
+            t->light |= 1 << e.face;
+            t->pulses_received++;
+        } else {
+            t->light &= ~( 1 << e.face );
+        }
+
+        if ( e.tick >= t->start_tick ) update_cathodes( t );
+
+    }
+
+    run_until( t , now_tick + window_ticks );
+
+}
+
+// --- Threads
+
+static pthread_barrier_t window_start;
+static pthread_barrier_t window_end;
+static volatile uint8_t done;
+static std::atomic<uint32_t> next_tile;
+
+static void do_window() {
+
+    uint32_t count = tiles.size();
+
+    while (1) {
+
+        uint32_t begin = next_tile.fetch_add( CHUNK );
+
+        if ( begin >= count ) return;
+
+        uint32_t end = std::min( begin + CHUNK , count );
+
+        for( uint32_t i = begin ; i < end ; i++ ) {
+            run_window( &tiles[i] );
+        }
+
+    }
+
+}
+
+static void worker_thread() {
+
+    while (1) {
+
+        pthread_barrier_wait( &window_start );
+
+        if ( done ) return;
+
+        do_window();
+
+        pthread_barrier_wait( &window_end );
+
+    }
+
+}
+
+static void flush_serial() {
+
+    for( uint32_t i=0; i < tiles.size() ; i++ ) {
+
+        std::vector<char> &line = tiles[i].serial_line;
+
+        if ( !line.empty() && line.back() == '\n' ) {
+
+            printf( "[%u] %.*s" , i , (int) line.size() , line.data() );
+            line.clear();
+
+        }
+
+    }
+
+}
+
+static double seconds_since( const struct timespec *start ) {
+
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC , &t );
+
+    return ( t.tv_sec - start->tv_sec ) + ( t.tv_nsec - start->tv_nsec ) / 1e9;
+
+}
+
+static uint8_t load_game( avr_t *avr , const char *name ) {
+
+    size_t len = strlen( name );
+
+    if ( len > 4 && !strcmp( name + len - 4 , ".hex" ) ) {
+        return avr_load_hex( avr , name , 0 );
+    }
+
+    return avr_load_elf( avr , name , GAME_STAGING );
+
+}
+
+static void usage( const char *name ) {
+
+    fprintf( stderr , "usage: %s [-n tiles] [-w width] [-t seconds] [-j threads] [-W window_us] [-b BlinkBIOS.hex] [-g tile=game]... [-c click_period_ms] [-r seed] [-q] game.elf|game.hex\n" , name );
+    fprintf( stderr , "  -n  number of tiles (default %u)\n" , DEFAULT_TILES );
+    fprintf( stderr , "  -w  tiles per row of the hex lattice (default square-ish)\n" );
+    fprintf( stderr , "  -t  seconds of tile time to run (default %u)\n" , DEFAULT_SECONDS );
+    fprintf( stderr , "  -j  worker threads (default one per CPU)\n" );
+    fprintf( stderr , "  -W  lockstep window in microseconds. Also the IR latency. (default %u)\n" , DEFAULT_WINDOW_US );
+    fprintf( stderr , "  -b  BIOS to load (default %s)\n" , DEFAULT_BIOS );
+    fprintf( stderr , "  -g  load a different game on one tile, like -g 0=seed.elf (can repeat)\n" );
+    fprintf( stderr , "  -c  click each tile's button once every this many ms (default never)\n" );
+    fprintf( stderr , "  -r  seed for power up times, serial numbers, and watchdog oscillator skew (default 0)\n" );
+    fprintf( stderr , "  -q  do not print service port output\n" );
+    exit(2);
+
+}
+
+int main( int argc , char **argv ) {
+
+    uint32_t count = DEFAULT_TILES;
+    uint32_t width = 0;
+    uint32_t nthreads = std::thread::hardware_concurrency();
+    double seconds = DEFAULT_SECONDS;
+    const char *bios = DEFAULT_BIOS;
+    uint64_t seed = 0;
+
+    std::vector<std::pair<uint32_t,const char *>> overrides;
+
+    int opt;
+
+    while ( ( opt = getopt( argc , argv , "n:w:t:j:W:b:g:c:r:q" ) ) != -1 ) {
+
+        switch (opt) {
+
+            case 'n': count = strtoul( optarg , NULL , 0 ); break;
+            case 'w': width = strtoul( optarg , NULL , 0 ); break;
+            case 't': seconds = atof( optarg ); break;
+            case 'j': nthreads = strtoul( optarg , NULL , 0 ); break;
+            case 'W': window_ticks = strtoull( optarg , NULL , 0 ) * TICKS_PER_US; break;
+            case 'b': bios = optarg; break;
+            case 'c': click_period_ms = strtoul( optarg , NULL , 0 ); break;
+            case 'r': seed = strtoull( optarg , NULL , 0 ); break;
+            case 'q': quiet = 1; break;
+
+            case 'g': {
+                char *eq = strchr( optarg , '=' );
+                if ( !eq ) usage( argv[0] );
+                overrides.push_back( { (uint32_t) strtoul( optarg , NULL , 0 ) , eq + 1 } );
+                break;
+            }
+
+            default: usage( argv[0] );
+
+        }
+
+    }
+
+    if ( optind != argc - 1 || !count || !window_ticks ) usage( argv[0] );
+
+    if ( !width ) {
+        width = 1;
+        while ( width * width < count ) width++;
+    }
+
+    if ( !nthreads ) nthreads = 1;
+
+    // Build one image and copy it to every tile. Game first so the BIOS wins if they overlap.
+
+    static avr_t image;
+
+    avr_init( &image );
+
+    if ( !load_game( &image , argv[ optind ] ) || !avr_load_hex( &image , bios , 0 ) ) return 1;
+
+    tiles = std::vector<emu_tile_t>( count );
+
+    for( uint32_t i=0; i < count ; i++ ) {
+
+        emu_tile_t *t = &tiles[i];
+
+        t->avr = image;
+
+        uint64_t r = splitmix64( seed ^ ( (uint64_t) i << 20 ) );
+
+        for( uint8_t b=0; b < AVR_SERIALNO_LEN ; b++ ) {
+            t->avr.serialno[b] = (uint8_t) ( i >> ( ( b % 4 ) * 8 ) ) ^ ( b * 0x5b ) ^ (uint8_t) ( seed >> ( b * 8 ) );
+        }
+
+        // Real tiles do not all power up at the same instant, and the 128KHz watchdog oscillator that randomize()
+        // gets its entropy from is only good to a few percent
+
+        t->start_tick = ( r % ( DEFAULT_MAX_START_MS * 1000 ) ) * TICKS_PER_US;
+        t->avr.wdt_scale = 1.0 + ( ( ( r >> 32 ) % 2001 ) - 1000.0 ) / 20000.0;
+
+        t->click_phase_ms = click_period_ms ? ( r >> 16 ) % click_period_ms : 0;
+
+        t->avr.hooks.ctx = t;
+        t->avr.hooks.port_write = hook_port_write;
+        t->avr.hooks.call = hook_call;
+        t->avr.hooks.serial_tx = hook_serial_tx;
+
+        // LEDs start out with no charge
+
+        t->avr.pin_input[ PORT_C ] &= ~FACE_MASK;
+
+    }
+
+    for( auto &o : overrides ) {
+
+        if ( o.first >= count ) usage( argv[0] );
+
+        avr_t *avr = &tiles[ o.first ].avr;
+
+        memset( avr->flash , 0xff , GAME_STAGING * 2 );
+
+        if ( !load_game( avr , o.second ) || !avr_load_hex( avr , bios , 0 ) ) return 1;
+
+    }
+
+    build_lattice( count , width );
+
+    fprintf( stderr , "%u tiles (%u per row), %u us windows, %u threads\n" , count , width , (unsigned) ( window_ticks / TICKS_PER_US ) , nthreads );
+
+    pthread_barrier_init( &window_start , NULL , nthreads );
+    pthread_barrier_init( &window_end , NULL , nthreads );
+
+    std::vector<std::thread> threads;
+
+    for( uint32_t w=1; w < nthreads ; w++ ) {
+        threads.push_back( std::thread( worker_thread ) );
+    }
+
+    uint64_t end_tick = (uint64_t) ( seconds * 1e6 ) * TICKS_PER_US;
+
+    struct timespec run_start;
+    clock_gettime( CLOCK_MONOTONIC , &run_start );
+
+    while ( now_tick < end_tick ) {
+
+        next_tile = 0;
+
+        pthread_barrier_wait( &window_start );
+
+        do_window();
+
+        pthread_barrier_wait( &window_end );
+
+        if (!quiet) flush_serial();
+
+        now_tick += window_ticks;
+        window++;
+
+    }
+
+    done = 1;
+    pthread_barrier_wait( &window_start );
+
+    for( auto &t : threads ) t.join();
+
+    fflush( stdout );
+
+    double wall = seconds_since( &run_start );
+    double simulated = now_tick / ( 1e6 * TICKS_PER_US );
+
+    uint64_t frames = 0, sent = 0, received = 0, cycles = 0, resets = 0;
+    uint32_t crashed = 0, sleeping = 0;
+
+    for( auto &t : tiles ) {
+        frames += t.frames;
+        sent += t.pulses_sent;
+        received += t.pulses_received;
+        cycles += t.avr.cycles;
+        resets += t.avr.resets;
+        crashed += t.crashed;
+        sleeping += t.avr.sleeping;
+    }
+
+    fprintf( stderr , "simulated %.3f s of %u tiles in %.3f s wall (%.4fx real time, %.1f emulated MHz)\n" ,
+        simulated , count , wall , wall > 0 ? simulated / wall : 0 , wall > 0 ? cycles / wall / 1e6 : 0 );
+    fprintf( stderr , "frames %llu (%.1f per tile per second), %llu windows\n" ,
+        (unsigned long long) frames , simulated > 0 ? frames / ( simulated * count ) : 0 , (unsigned long long) window );
+    fprintf( stderr , "ir pulses sent %llu, received %llu\n" , (unsigned long long) sent , (unsigned long long) received );
+    fprintf( stderr , "tiles reset %llu times, crashed %u, asleep right now %u\n" , (unsigned long long) resets , crashed , sleeping );
+
+    return 0;
+
+}
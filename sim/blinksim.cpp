@@ -0,0 +1,183 @@
+/*
+ * blinksim.cpp
+ *
+ * Runs a single tile (blinklib + a sketch + the simulated BIOS) as a normal host program in virtual time.
+ *
+ * There are no neighbors, so anything sent over IR just goes out into the void. This is mostly useful
+ * for profiling `loop()` and the IR stack with normal host tools like `perf` and `gprof` since we can
+ * run an hour of frames in a couple of seconds.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blinkbios_sim.h"
+
+#define DEFAULT_SECONDS     ( 60 * 60 )     // Simulate one hour unless told otherwise
+#define DEFAULT_FRAME_US    55555           // The display update we wait on runs at about 18 frames per second (see Layers.md)
+#define SPIN_US             1000            // How much time passes each time the tile spins waiting on the BIOS
+#define CLICK_DOWN_MS       100             // How long the button stays down for each scripted click
+
+static uint64_t end_us;
+static uint32_t frame_us = DEFAULT_FRAME_US;
+static uint32_t click_period_ms;            // 0=never press the button
+static uint8_t quiet;
+
+static uint64_t now_us;                     // Virtual time since start. Keeps going while the tile sleeps.
+
+static uint64_t frame_count;
+static uint64_t sleep_count;
+static uint64_t ir_packet_count;
+static uint64_t ir_byte_count;
+
+static struct timespec wall_start;
+
+static double wall_seconds() {
+
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC , &t );
+
+    return ( t.tv_sec - wall_start.tv_sec ) + ( t.tv_nsec - wall_start.tv_nsec ) / 1e9;
+
+}
+
+static void report() {
+
+    double wall = wall_seconds();
+    double simulated = now_us / 1e6;
+
+    fprintf( stderr , "simulated %.3f s in %.3f s wall (%.0fx real time)\n" , simulated , wall , wall > 0 ? simulated / wall : 0 );
+    fprintf( stderr , "frames %llu (%.2f us host time per frame), frames asleep %llu\n" , (unsigned long long) frame_count , frame_count ? wall * 1e6 / frame_count : 0 , (unsigned long long) sleep_count );
+    fprintf( stderr , "ir packets sent %llu (%llu bytes)\n" , (unsigned long long) ir_packet_count , (unsigned long long) ir_byte_count );
+
+}
+
+static void sim_yield( void *ctx , uint8_t reason , uint8_t code ) {
+
+    (void) ctx;
+
+    if ( reason == BLINKBIOS_SIM_YIELD_HALT ) {
+
+        report();
+        fprintf( stderr , "tile halted (%s %u)\n" , code ? "ABEND" : "seed mode" , code );
+        exit( code ? 1 : 0 );
+
+    }
+
+    uint32_t step_us;
+
+    if ( reason == BLINKBIOS_SIM_YIELD_SPIN ) {
+
+        step_us = SPIN_US;
+
+    } else {
+
+        step_us = frame_us;
+
+        if ( reason == BLINKBIOS_SIM_YIELD_SLEEP ) {
+            sleep_count++;
+        } else {
+            frame_count++;
+        }
+
+    }
+
+    now_us += step_us;
+
+    if ( click_period_ms ) {
+        blinkbios_sim_button( ( now_us / 1000 ) % click_period_ms < CLICK_DOWN_MS );
+    }
+
+    blinkbios_sim_advance( step_us );
+
+    if ( now_us >= end_us ) {
+
+        fflush( stdout );
+        report();
+        exit(0);
+
+    }
+
+}
+
+static uint8_t sim_ir_send( void *ctx , uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    (void) ctx; (void) face; (void) data;
+
+    ir_packet_count++;
+    ir_byte_count += len;
+
+    return 1;
+
+}
+
+static void sim_serial_tx( void *ctx , uint8_t b ) {
+
+    (void) ctx;
+
+    if (!quiet) {
+        putchar( b );
+    }
+
+}
+
+static void usage( const char *name ) {
+
+    fprintf( stderr , "usage: %s [-t seconds] [-f frame_us] [-c click_period_ms] [-s serial_seed] [-q]\n" , name );
+    fprintf( stderr , "  -t  virtual seconds to run (default %u)\n" , DEFAULT_SECONDS );
+    fprintf( stderr , "  -f  virtual microseconds per frame (default %u)\n" , DEFAULT_FRAME_US );
+    fprintf( stderr , "  -c  click the button once every this many virtual ms (default never)\n" );
+    fprintf( stderr , "  -s  number used to make up the tile serial number (default 0)\n" );
+    fprintf( stderr , "  -q  do not print service port output\n" );
+    exit(2);
+
+}
+
+int main( int argc , char **argv ) {
+
+    double seconds = DEFAULT_SECONDS;
+    unsigned long serial_seed = 0;
+
+    int opt;
+
+    while ( ( opt = getopt( argc , argv , "t:f:c:s:q" ) ) != -1 ) {
+
+        switch (opt) {
+
+            case 't': seconds = atof( optarg ); break;
+            case 'f': frame_us = strtoul( optarg , NULL , 0 ); break;
+            case 'c': click_period_ms = strtoul( optarg , NULL , 0 ); break;
+            case 's': serial_seed = strtoul( optarg , NULL , 0 ); break;
+            case 'q': quiet = 1; break;
+            default: usage( argv[0] );
+
+        }
+
+    }
+
+    if ( !frame_us ) usage( argv[0] );
+
+    end_us = (uint64_t) ( seconds * 1e6 );
+
+    uint8_t serialno[ BLINKBIOS_SIM_SERIALNO_LEN ];
+
+    for( uint8_t i=0; i < BLINKBIOS_SIM_SERIALNO_LEN ; i++ ) {
+        serialno[i] = (uint8_t) ( serial_seed >> ( ( i % 4 ) * 8 ) ) ^ ( i * 0x5b );
+    }
+
+    static blinkbios_sim_port_t port = { NULL , sim_yield , sim_ir_send , sim_serial_tx };
+
+    blinkbios_sim_attach( &port , serialno );
+
+    clock_gettime( CLOCK_MONOTONIC , &wall_start );
+
+    blinkbios_sim_main();       // Never returns. sim_yield() exits when time is up.
+
+    return 0;
+
+}
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for avr-libc's <avr/interrupt.h>
+ *
+ * The simulated BIOS only ever runs when the tile calls into it (or spins waiting on it), so there
+ * is nothing that could interrupt us and cli()/sei() have nothing to do.
+ *
+ */
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#define cli()
+#define sei()
+
+#define ISR(vector, ...) extern "C" void vector(void)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for avr-libc's <avr/io.h>
+ *
+ * Only the handful of registers that blinklib touches directly are here. They are plain
+ * variables in the simulated BIOS so that writes to them are harmless.
+ *
+ */
+
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// Watchdog timer control register. randomize() uses the WDT interrupt to capture entropy.
+
+extern volatile uint8_t blinkbios_sim_wdtcsr;
+
+#define WDTCSR  blinkbios_sim_wdtcsr
+
+#define WDIF    7
+#define WDIE    6
+#define WDCE    4
+#define WDE     3
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for avr-libc's <avr/sleep.h>
+ *
+ */
+
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()
+
+#endif /* SIM_AVR_SLEEP_H_ */
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for avr-libc's <avr/wdt.h>
+ *
+ */
+
+#ifndef SIM_AVR_WDT_H_
+#define SIM_AVR_WDT_H_
+
+#include "io.h"
+
+#define wdt_reset()
+#define wdt_disable() ( WDTCSR = 0 )
+
+#endif /* SIM_AVR_WDT_H_ */
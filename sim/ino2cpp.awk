@@ -0,0 +1,66 @@
+# Turns an Arduino sketch into plain C++ the same way the Arduino IDE does...
+#
+#   awk -f ino2cpp.awk sketch.ino sketch.ino > sketch.cpp
+#
+# ...which is to say by adding a prototype for every top-level function right before the
+# first function definition, so that sketches can call functions that are defined further down.
+# Like the IDE, we only look at single-line signatures that start in the first column.
+#
+# The file is named twice because we read it twice. Once to find the functions and once to copy it.
+
+function is_definition( line ,    name ) {
+
+    if ( line !~ /^[A-Za-z_][A-Za-z0-9_ \t\*&:<>,]*[ \t\*&][A-Za-z_][A-Za-z0-9_]*[ \t]*\([^;]*\)[ \t]*(\{.*)?$/ ) {
+        return 0
+    }
+
+    name = line
+    sub( /[ \t\*&].*/ , "" , name )
+
+    return name !~ /^(if|else|for|while|do|switch|return|case|typedef|struct|class|union|enum|template|static_assert)$/
+
+}
+
+# Everything up to the ) that closes the parameter list, so a body on the same line gets left behind
+
+function signature( line ,    i , c , depth ) {
+
+    depth = 0
+
+    for ( i = 1 ; i <= length( line ) ; i++ ) {
+
+        c = substr( line , i , 1 )
+
+        if ( c == "(" ) {
+            depth++
+        } else if ( c == ")" && --depth == 0 ) {
+            return substr( line , 1 , i )
+        }
+
+    }
+
+    return line
+
+}
+
+FNR == NR {
+
+    if ( is_definition( $0 ) ) {
+
+        protos = protos signature( $0 ) ";\n"
+        if (!first) first = FNR
+
+    }
+
+    next
+}
+
+FNR == 1 {
+    printf "#line 1 \"%s\"\n" , FILENAME
+}
+
+FNR == first {
+    printf "%s#line %d \"%s\"\n" , protos , FNR , FILENAME
+}
+
+{ print }
@@ -0,0 +1,42 @@
+/*
+ * sp_sim.cpp
+ *
+ * Service port serial for host builds. Replaces the core sp.cpp, which talks straight to the UART.
+ *
+ * Everything sent is handed to the driver, which decides where it goes. Nothing is ever received.
+ *
+ */
+
+#include "sp.h"
+
+#include "blinkbios_sim.h"
+
+// The simulated BIOS owns the port so it can be shared here
+
+extern const blinkbios_sim_port_t *blinkbios_sim_port;
+
+void sp_serial_init(void) {
+}
+
+void sp_serial_tx(unsigned char b) {
+
+    blinkbios_sim_port->serial_tx( blinkbios_sim_port->ctx , b );
+
+}
+
+void sp_serial_flush(void) {
+}
+
+unsigned char sp_serial_rx_ready(void) {
+
+    return 0;
+
+}
+
+unsigned char sp_serial_rx(void) {
+
+    // Would block forever on a real tile too
+
+    while (1);
+
+}